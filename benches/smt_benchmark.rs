@@ -4,8 +4,126 @@ extern crate criterion;
 use criterion::Criterion;
 use rand::{thread_rng, Rng};
 use sparse_merkle_tree::{
-    blake2b::Blake2bHasher, default_store::DefaultStore, tree::SparseMerkleTree, H256,
+    blake2b::Blake2bHasher,
+    checkpoint::CheckpointStore,
+    default_store::DefaultStore,
+    error::Error,
+    frozen::FrozenTree,
+    hexary::{DefaultHexaryStore, HexarySparseMerkleTree},
+    history::HistoryStore,
+    hybrid_store::HybridStore,
+    multi_tree::{MultiTreeStore, Namespace},
+    segment_store::SegmentStore,
+    snapshot::SnapshotView,
+    trace_store::{TraceEvent, TraceStore},
+    traits::{Hasher, Store, Value},
+    tree::{BranchKey, BranchNode, SparseMerkleTree},
+    H256,
 };
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+// Count heap allocations to keep an eye on allocation heavy code paths
+struct CountingAllocator;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+// Count finished hashes to see how many BLAKE2b calls a code path makes
+static HASHES: AtomicUsize = AtomicUsize::new(0);
+
+#[derive(Default)]
+struct CountingHasher(Blake2bHasher);
+
+impl Hasher for CountingHasher {
+    fn write_h256(&mut self, h: &H256) {
+        self.0.write_h256(h);
+    }
+    fn write_byte(&mut self, b: u8) {
+        self.0.write_byte(b);
+    }
+    fn finish(self) -> H256 {
+        HASHES.fetch_add(1, Ordering::Relaxed);
+        self.0.finish()
+    }
+}
+
+// A store without the optional methods, so it keeps no fork hashes
+#[derive(Default)]
+struct PlainStore(DefaultStore<H256>);
+
+impl Store<H256> for PlainStore {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        self.0.get_branch(branch_key)
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<H256>, Error> {
+        self.0.get_leaf(leaf_key)
+    }
+    fn insert_branch(&mut self, node_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        self.0.insert_branch(node_key, branch)
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: H256) -> Result<(), Error> {
+        self.0.insert_leaf(leaf_key, leaf)
+    }
+    fn remove_branch(&mut self, node_key: &BranchKey) -> Result<(), Error> {
+        self.0.remove_branch(node_key)
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        self.0.remove_leaf(leaf_key)
+    }
+}
+
+// Average hashes of updating every key again, after inserting them all
+fn update_hashes<S: Store<H256> + Default>(keys: &[H256]) -> f64 {
+    let mut rng = thread_rng();
+    let mut smt: SparseMerkleTree<CountingHasher, H256, S> = SparseMerkleTree::default();
+    for key in keys {
+        smt.update(*key, random_h256(&mut rng)).unwrap();
+    }
+    let hashes = HASHES.load(Ordering::Relaxed);
+    for key in keys {
+        smt.update(*key, random_h256(&mut rng)).unwrap();
+    }
+    (HASHES.load(Ordering::Relaxed) - hashes) as f64 / keys.len() as f64
+}
+
+// A large value, hashed over all of its bytes
+#[derive(Default, Clone)]
+struct Blob(Vec<u8>);
+
+impl Value for Blob {
+    fn to_h256(&self) -> H256 {
+        if self.0.is_empty() {
+            return H256::zero();
+        }
+        let mut hasher = Blake2bHasher::default();
+        for chunk in self.0.chunks(32) {
+            let mut buf = [0u8; 32];
+            buf[..chunk.len()].copy_from_slice(chunk);
+            hasher.write_h256(&buf.into());
+        }
+        hasher.finish()
+    }
+    fn zero() -> Self {
+        Default::default()
+    }
+}
 
 const TARGET_LEAVES_COUNT: usize = 20;
 
@@ -30,6 +148,47 @@ fn random_smt(update_count: usize, rng: &mut impl Rng) -> (SMT, Vec<H256>) {
     (smt, keys)
 }
 
+type HybridSMT = SparseMerkleTree<Blake2bHasher, H256, HybridStore<DefaultStore<H256>>>;
+
+fn hybrid_smt(update_count: usize, rng: &mut impl Rng) -> (HybridSMT, Vec<H256>) {
+    let (smt, keys) = random_smt(update_count, rng);
+    let root = *smt.root();
+    let mut store = HybridStore::new(smt.take_store());
+    let dense_levels = store.adapt::<H256>().unwrap();
+    println!(
+        "SMT hybrid {} leaves: {} dense levels",
+        update_count, dense_levels
+    );
+    (HybridSMT::new(root, store), keys)
+}
+
+const HISTORY_VERSIONS: u64 = 100;
+
+type HistorySMT = SparseMerkleTree<Blake2bHasher, H256, HistoryStore<H256, DefaultStore<H256>>>;
+
+// versions over 1000 keys, 10 writes per version
+fn history_smt(rng: &mut impl Rng) -> (HistorySMT, Vec<H256>) {
+    let mut smt = HistorySMT::default();
+    let keys: Vec<_> = (0..1000).map(|_| random_h256(rng)).collect();
+    smt.update_all(keys.iter().map(|k| (*k, random_h256(rng))).collect())
+        .unwrap();
+    smt.commit_version().unwrap();
+    for _ in 1..HISTORY_VERSIONS {
+        let leaves = (0..10)
+            .map(|_| (keys[rng.gen_range(0, keys.len())], random_h256(rng)))
+            .collect();
+        smt.update_all(leaves).unwrap();
+        smt.commit_version().unwrap();
+    }
+    (smt, keys)
+}
+
+// (reads, writes) of a trace
+fn count_io(events: &[TraceEvent]) -> (usize, usize) {
+    let reads = events.iter().filter(|e| e.op.is_read()).count();
+    (reads, events.len() - reads)
+}
+
 fn bench(c: &mut Criterion) {
     c.bench_function_over_inputs(
         "SMT update",
@@ -42,6 +201,226 @@ fn bench(c: &mut Criterion) {
         &[100, 10_000],
     );
 
+    c.bench_function_over_inputs(
+        "SMT update_all",
+        |b, &&size| {
+            let mut rng = thread_rng();
+            let (mut smt, keys) = random_smt(size, &mut rng);
+            // rewrite existing keys, so the store itself does not need to grow
+            let leaves: Vec<_> = keys.iter().map(|k| (*k, random_h256(&mut rng))).collect();
+            let allocations = ALLOCATIONS.load(Ordering::Relaxed);
+            smt.update_all(leaves.clone()).unwrap();
+            println!(
+                "SMT update_all {} leaves: {} heap allocations",
+                size,
+                ALLOCATIONS.load(Ordering::Relaxed) - allocations
+            );
+            b.iter(|| {
+                smt.update_all(leaves.clone()).unwrap();
+            });
+        },
+        &[100, 10_000],
+    );
+
+    c.bench_function_over_inputs(
+        "SMT update_all_parallel",
+        |b, &&value_size| {
+            let mut rng = thread_rng();
+            let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+            let leaves: Vec<_> = (0..256)
+                .map(|_| {
+                    let mut value = vec![0u8; value_size];
+                    rng.fill(&mut value[..]);
+                    (random_h256(&mut rng), Blob(value))
+                })
+                .collect();
+            let mut smt: SparseMerkleTree<Blake2bHasher, Blob, DefaultStore<Blob>> =
+                SparseMerkleTree::default();
+            // rewrite the same keys, so both runs only update existing branches
+            smt.update_all(leaves.clone()).unwrap();
+            let start = std::time::Instant::now();
+            smt.update_all(leaves.clone()).unwrap();
+            let serial = start.elapsed();
+            let start = std::time::Instant::now();
+            smt.update_all_parallel(leaves.clone(), threads).unwrap();
+            println!(
+                "SMT update_all 256 leaves of {} bytes: serial {:?}, {} threads {:?}",
+                value_size,
+                serial,
+                threads,
+                start.elapsed()
+            );
+            b.iter(|| {
+                smt.update_all_parallel(leaves.clone(), threads).unwrap();
+            });
+        },
+        &[1024, 16 * 1024, 64 * 1024],
+    );
+
+    c.bench_function_over_inputs(
+        "SMT update 64 levels",
+        |b, &&size| {
+            b.iter(|| {
+                let mut rng = thread_rng();
+                let mut smt: SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>, 64> =
+                    SparseMerkleTree::default();
+                for _ in 0..size {
+                    let mut key = [0u8; 32];
+                    key[..8].copy_from_slice(&rng.gen::<u64>().to_le_bytes());
+                    smt.update(key.into(), random_h256(&mut rng)).unwrap();
+                }
+                smt
+            });
+        },
+        &[100, 10_000],
+    );
+
+    c.bench_function("SMT hexary I/O and proof size", |b| {
+        // 10M leaves do not fit the memory stores, compare at 10k
+        const LEAVES: usize = 10_000;
+        const SAMPLES: usize = 100;
+        let mut rng = thread_rng();
+        let pairs: Vec<_> = (0..LEAVES)
+            .map(|_| (random_h256(&mut rng), random_h256(&mut rng)))
+            .collect();
+        let mut smt = SMT::default();
+        smt.update_all(pairs.clone()).unwrap();
+        let mut hexary: HexarySparseMerkleTree<Blake2bHasher, H256, DefaultHexaryStore<H256>> =
+            HexarySparseMerkleTree::default();
+        for (key, value) in &pairs {
+            hexary.update(*key, *value).unwrap();
+        }
+        let mut smt = SparseMerkleTree::<Blake2bHasher, H256, _>::new(
+            *smt.root(),
+            TraceStore::new(smt.take_store(), 1 << 16),
+        );
+        let mut hexary = HexarySparseMerkleTree::<Blake2bHasher, H256, _>::new(
+            *hexary.root(),
+            TraceStore::new(hexary.take_store(), 1 << 16),
+        );
+
+        let (mut binary_io, mut hexary_io) = ([0usize; 4], [0usize; 4]);
+        let (mut binary_size, mut hexary_size) = (0, 0);
+        for (key, _value) in pairs.iter().take(SAMPLES) {
+            let proof: Vec<u8> = smt
+                .merkle_proof(vec![*key])
+                .unwrap()
+                .compile(vec![*key])
+                .unwrap()
+                .into();
+            binary_size += proof.len();
+            let (reads, _) = count_io(&smt.store().take_events());
+            binary_io[0] += reads;
+            smt.update(*key, random_h256(&mut rng)).unwrap();
+            let (reads, writes) = count_io(&smt.store().take_events());
+            binary_io[1] += reads;
+            binary_io[2] += writes;
+
+            let proof: Vec<u8> = hexary.merkle_proof(key).unwrap().into();
+            hexary_size += proof.len();
+            let (reads, _) = count_io(&hexary.store().take_events());
+            hexary_io[0] += reads;
+            hexary.update(*key, random_h256(&mut rng)).unwrap();
+            let (reads, writes) = count_io(&hexary.store().take_events());
+            hexary_io[1] += reads;
+            hexary_io[2] += writes;
+        }
+        for (name, io, size) in &[
+            ("binary", binary_io, binary_size),
+            ("hexary", hexary_io, hexary_size),
+        ] {
+            println!(
+                "SMT {} {} leaves: proof {} reads / {} bytes, update {} reads {} writes",
+                name,
+                LEAVES,
+                io[0] / SAMPLES,
+                size / SAMPLES,
+                io[1] / SAMPLES,
+                io[2] / SAMPLES
+            );
+        }
+        b.iter(|| {
+            let (key, _value) = pairs[rng.gen_range(0, pairs.len())];
+            hexary.update(key, random_h256(&mut rng)).unwrap();
+            hexary.store().take_events();
+        });
+    });
+
+    c.bench_function("SMT update hashes", |b| {
+        let mut rng = thread_rng();
+        let keys: Vec<_> = (0..10_000).map(|_| random_h256(&mut rng)).collect();
+        let cached = update_hashes::<DefaultStore<H256>>(&keys);
+        let plain = update_hashes::<PlainStore>(&keys);
+        println!(
+            "SMT update: {:.2} hashes per update of an existing key, {:.2} without fork hashes, {:.2} saved",
+            cached,
+            plain,
+            plain - cached
+        );
+        let mut smt: SparseMerkleTree<CountingHasher, H256, DefaultStore<H256>> =
+            SparseMerkleTree::default();
+        for key in &keys {
+            smt.update(*key, random_h256(&mut rng)).unwrap();
+        }
+        b.iter(|| {
+            let key = keys[rng.gen_range(0, keys.len())];
+            smt.update(key, random_h256(&mut rng)).unwrap();
+        });
+    });
+
+    c.bench_function("SMT graft shards", |b| {
+        type CountingSMT = SparseMerkleTree<CountingHasher, H256, DefaultStore<H256>>;
+        let mut rng = thread_rng();
+        // 4 shards of 2500 leaves by the most significant byte of keys
+        let shards: Vec<Vec<(H256, H256)>> = (0..4u8)
+            .map(|n| {
+                (0..2500)
+                    .map(|_| {
+                        let mut key: [u8; 32] = rng.gen();
+                        key[31] = n;
+                        (key.into(), random_h256(&mut rng))
+                    })
+                    .collect()
+            })
+            .collect();
+        let trees: Vec<CountingSMT> = shards
+            .iter()
+            .map(|leaves| {
+                let mut smt = CountingSMT::default();
+                smt.update_all(leaves.clone()).unwrap();
+                smt
+            })
+            .collect();
+        let hashes = HASHES.load(Ordering::Relaxed);
+        let mut smt = CountingSMT::default();
+        smt.update_all(shards.concat()).unwrap();
+        let rebuild = HASHES.load(Ordering::Relaxed) - hashes;
+        let root = *smt.root();
+        let hashes = HASHES.load(Ordering::Relaxed);
+        let mut smt = CountingSMT::default();
+        for (n, shard) in trees.into_iter().enumerate() {
+            let mut prefix = [0u8; 32];
+            prefix[31] = n as u8;
+            smt.graft(shard, 247, prefix.into()).unwrap();
+        }
+        assert_eq!(smt.root(), &root);
+        println!(
+            "SMT combine 4 shards of 2500 leaves: {} hashes by update_all, {} by graft",
+            rebuild,
+            HASHES.load(Ordering::Relaxed) - hashes
+        );
+        let mut shard = CountingSMT::default();
+        shard.update_all(shards[3].clone()).unwrap();
+        let (shard_root, shard_store) = (*shard.root(), shard.take_store());
+        let mut prefix = [0u8; 32];
+        prefix[31] = 3;
+        b.iter(|| {
+            let shard = CountingSMT::new(shard_root, shard_store.clone());
+            let mut smt = CountingSMT::default();
+            smt.graft(shard, 247, prefix.into()).unwrap();
+        });
+    });
+
     c.bench_function_over_inputs(
         "SMT get",
         |b, &&size| {
@@ -55,6 +434,168 @@ fn bench(c: &mut Criterion) {
         &[5_000, 10_000],
     );
 
+    // one batch over 20 trees of 50 leaves
+    fn multi_tree_batch(rng: &mut impl Rng) -> Vec<(Namespace, Vec<(H256, H256)>)> {
+        (0..20)
+            .map(|_| {
+                let leaves = (0..50)
+                    .map(|_| (random_h256(rng), random_h256(rng)))
+                    .collect();
+                (random_h256(rng), leaves)
+            })
+            .collect()
+    }
+
+    c.bench_function("SMT multi-tree commit", |b| {
+        let mut rng = thread_rng();
+        let batch = multi_tree_batch(&mut rng);
+        b.iter(|| {
+            let mut store = MultiTreeStore::default();
+            store.commit::<Blake2bHasher, 256>(batch.clone()).unwrap();
+        });
+    });
+
+    c.bench_function("SMT multi-tree commit_parallel", |b| {
+        let mut rng = thread_rng();
+        let batch = multi_tree_batch(&mut rng);
+        b.iter(|| {
+            let mut store = MultiTreeStore::default();
+            store
+                .commit_parallel::<Blake2bHasher, 256>(batch.clone(), 4)
+                .unwrap();
+        });
+    });
+
+    c.bench_function("SMT import", |b| {
+        let mut rng = thread_rng();
+        let (smt, _keys) = random_smt(10_000, &mut rng);
+        let export = smt.export(248).unwrap();
+        let header = export.header();
+        let chunks: Vec<Vec<u8>> = export.map(Result::unwrap).collect();
+        println!(
+            "SMT export of 10000 leaves: {} chunks, {} bytes",
+            chunks.len(),
+            chunks.iter().map(Vec::len).sum::<usize>()
+        );
+        b.iter(|| SMT::import(&header, &chunks).unwrap());
+    });
+
+    c.bench_function("SMT import_parallel", |b| {
+        let mut rng = thread_rng();
+        let (smt, _keys) = random_smt(10_000, &mut rng);
+        let export = smt.export(248).unwrap();
+        let header = export.header();
+        let chunks: Vec<Vec<u8>> = export.map(Result::unwrap).collect();
+        b.iter(|| SMT::import_parallel(&header, &chunks, 4).unwrap());
+    });
+
+    c.bench_function("SMT delta checkpoint", |b| {
+        let mut rng = thread_rng();
+        let mut smt = SparseMerkleTree::<Blake2bHasher, H256, _>::new(
+            H256::zero(),
+            CheckpointStore::new(DefaultStore::default()),
+        );
+        let keys: Vec<H256> = (0..10_000).map(|_| random_h256(&mut rng)).collect();
+        smt.update_all(keys.iter().map(|k| (*k, random_h256(&mut rng))).collect())
+            .unwrap();
+        let base = smt.checkpoint().unwrap();
+        fn updates<R: Rng>(rng: &mut R, keys: &[H256]) -> Vec<(H256, H256)> {
+            (0..100)
+                .map(|_| (keys[rng.gen::<usize>() % keys.len()], random_h256(rng)))
+                .collect()
+        }
+        smt.update_all(updates(&mut rng, &keys)).unwrap();
+        println!(
+            "SMT checkpoints of 10000 leaves: base {} bytes, delta of 100 updates {} bytes",
+            base.len(),
+            smt.checkpoint().unwrap().len()
+        );
+        b.iter(|| {
+            smt.update_all(updates(&mut rng, &keys)).unwrap();
+            smt.checkpoint().unwrap();
+        });
+    });
+
+    c.bench_function("SMT segment compaction", |b| {
+        let mut rng = thread_rng();
+        let mut smt = SparseMerkleTree::<Blake2bHasher, H256, _>::new(
+            H256::zero(),
+            SegmentStore::<H256>::default(),
+        );
+        let keys: Vec<H256> = (0..2_000).map(|_| random_h256(&mut rng)).collect();
+        smt.update_all(keys.iter().map(|k| (*k, random_h256(&mut rng))).collect())
+            .unwrap();
+        smt.update_all(keys[..1_000].iter().map(|k| (*k, H256::zero())).collect())
+            .unwrap();
+        let fragmented = smt.take_store();
+        let mut store = fragmented.clone();
+        store.start_compaction();
+        while !store.compact_step(10_000).unwrap() {}
+        let stats = store.stats();
+        println!(
+            "SMT segments of 1000 leaves: {} bytes, {} garbage, compacted to {} bytes in {} steps, {:.0} MB/s, longest pause {}µs",
+            fragmented.size(),
+            fragmented.garbage_bytes(),
+            store.size(),
+            stats.steps,
+            stats.throughput() / 1e6,
+            stats.max_pause_ns / 1000
+        );
+        b.iter(|| {
+            let mut store = fragmented.clone();
+            store.start_compaction();
+            while !store.compact_step(10_000).unwrap() {}
+        });
+    });
+
+    c.bench_function("SMT get_at", |b| {
+        let mut rng = thread_rng();
+        let (smt, keys) = history_smt(&mut rng);
+        let entries: usize = smt
+            .store()
+            .branches_history()
+            .values()
+            .map(|history| history.len())
+            .sum();
+        println!(
+            "SMT {} versions: {} current branches, {} history entries, {} stored nodes",
+            HISTORY_VERSIONS,
+            smt.store().inner().branches_map().len(),
+            entries,
+            smt.store().nodes().len()
+        );
+        b.iter(|| {
+            let key = keys[rng.gen_range(0, keys.len())];
+            smt.get_at(&key, rng.gen_range(0, HISTORY_VERSIONS))
+                .unwrap();
+        });
+    });
+
+    c.bench_function("SMT merkle_proof_at", |b| {
+        let mut rng = thread_rng();
+        let (smt, keys) = history_smt(&mut rng);
+        let proof_keys: Vec<_> = keys.iter().take(TARGET_LEAVES_COUNT).cloned().collect();
+        let start = std::time::Instant::now();
+        for _ in 0..100 {
+            smt.merkle_proof(proof_keys.clone()).unwrap();
+        }
+        let current = start.elapsed() / 100;
+        let start = std::time::Instant::now();
+        for version in 0..100 {
+            smt.merkle_proof_at(version, proof_keys.clone()).unwrap();
+        }
+        println!(
+            "SMT {} leaves proof: current root {:?}, historical root {:?}",
+            TARGET_LEAVES_COUNT,
+            current,
+            start.elapsed() / 100
+        );
+        b.iter(|| {
+            let version = rng.gen_range(0, HISTORY_VERSIONS);
+            smt.merkle_proof_at(version, proof_keys.clone()).unwrap();
+        });
+    });
+
     c.bench_function("SMT generate merkle proof", |b| {
         let mut rng = thread_rng();
         let (smt, mut keys) = random_smt(10_000, &mut rng);
@@ -65,6 +606,86 @@ fn bench(c: &mut Criterion) {
         });
     });
 
+    c.bench_function("SMT hybrid generate merkle proof", |b| {
+        let mut rng = thread_rng();
+        let (smt, mut keys) = hybrid_smt(10_000, &mut rng);
+        keys.dedup();
+        let keys: Vec<_> = keys.into_iter().take(TARGET_LEAVES_COUNT).collect();
+        b.iter(|| {
+            smt.merkle_proof(keys.clone()).unwrap();
+        });
+    });
+
+    c.bench_function("SMT update one key", |b| {
+        let mut rng = thread_rng();
+        let (mut smt, _keys) = random_smt(10_000, &mut rng);
+        b.iter(|| {
+            let key = random_h256(&mut rng);
+            let value = random_h256(&mut rng);
+            smt.update(key, value).unwrap();
+        });
+    });
+
+    c.bench_function("SMT hybrid update one key", |b| {
+        let mut rng = thread_rng();
+        let (mut smt, _keys) = hybrid_smt(10_000, &mut rng);
+        b.iter(|| {
+            let key = random_h256(&mut rng);
+            let value = random_h256(&mut rng);
+            smt.update(key, value).unwrap();
+        });
+    });
+
+    c.bench_function("SMT frozen merkle proof", |b| {
+        let mut rng = thread_rng();
+        let (smt, mut keys) = random_smt(10_000, &mut rng);
+        keys.dedup();
+        let bytes = smt.freeze().unwrap();
+        println!("SMT frozen 10000 leaves: {} bytes", bytes.len());
+        let frozen = FrozenTree::<Blake2bHasher, H256>::new(&bytes).unwrap();
+        let keys: Vec<_> = keys.into_iter().take(TARGET_LEAVES_COUNT).collect();
+        b.iter(|| {
+            frozen.merkle_proof(keys.clone()).unwrap();
+        });
+    });
+
+    c.bench_function("SMT get existing key", |b| {
+        let mut rng = thread_rng();
+        let (smt, keys) = random_smt(10_000, &mut rng);
+        b.iter(|| {
+            let key = &keys[rng.gen::<usize>() % keys.len()];
+            smt.get(key).unwrap();
+        });
+    });
+
+    c.bench_function("SMT frozen get existing key", |b| {
+        let mut rng = thread_rng();
+        let (smt, keys) = random_smt(10_000, &mut rng);
+        let bytes = smt.freeze().unwrap();
+        let frozen = FrozenTree::<Blake2bHasher, H256>::new(&bytes).unwrap();
+        b.iter(|| {
+            let key = &keys[rng.gen::<usize>() % keys.len()];
+            frozen.get(key).unwrap();
+        });
+    });
+
+    c.bench_function("SMT snapshot merkle proof", |b| {
+        let mut rng = thread_rng();
+        let (smt, keys) = random_smt(10_000, &mut rng);
+        let bytes = smt.snapshot().unwrap();
+        let view = SnapshotView::<H256>::new(&bytes).unwrap();
+        println!(
+            "SMT snapshot of 10000 leaves: {} bytes, {} branches",
+            bytes.len(),
+            view.branches_len()
+        );
+        let snapshot_smt = view.into_tree::<Blake2bHasher, 256>().unwrap();
+        let keys: Vec<_> = keys.into_iter().take(TARGET_LEAVES_COUNT).collect();
+        b.iter(|| {
+            snapshot_smt.merkle_proof(keys.clone()).unwrap();
+        });
+    });
+
     c.bench_function("SMT verify merkle proof", |b| {
         let mut rng = thread_rng();
         let (smt, mut keys) = random_smt(10_000, &mut rng);
@@ -17,5 +17,6 @@ fn main() {
         .flag("-Wno-nonnull")
         .define("__SHARED_LIBRARY__", None)
         .define("CKB_STDLIB_NO_SYSCALL_IMPL", None)
+        .define("SMT_ENABLE_TIMING", None)
         .compile("smt-c-impl");
 }
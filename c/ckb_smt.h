@@ -234,6 +234,83 @@ void *_smt_fast_memcpy(void * RESTRICT dest, const void * RESTRICT src, size_t n
 #define SMT_KEY_BYTES 32
 #define SMT_VALUE_BYTES 32
 
+/*
+ * Number of tree levels, users can define a shallower tree (1..=256) to
+ * match SparseMerkleTree<_, _, _, DEPTH> in Rust. Keys are still 32 bytes,
+ * only their low SMT_TREE_DEPTH bits can be set, and the root is tagged
+ * with the depth.
+ */
+#ifndef SMT_TREE_DEPTH
+#define SMT_TREE_DEPTH 256
+#endif
+#if SMT_TREE_DEPTH < 1 || SMT_TREE_DEPTH > 256
+#error "SMT_TREE_DEPTH must be in 1..=256"
+#endif
+
+/*
+ * Optional per-phase timing. Define SMT_ENABLE_TIMING to get the
+ * smt_state_normalize_timed and smt_verify_timed variants, which add the
+ * cycles spent in each phase to a caller-owned smt_timing_t. Users can
+ * provide their own clock by defining SMT_TIMING_NOW().
+ */
+#ifdef SMT_ENABLE_TIMING
+#ifndef SMT_TIMING_NOW
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t _smt_timing_now() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+#elif defined(__riscv)
+static inline uint64_t _smt_timing_now() {
+  uint64_t cycles;
+  __asm__ volatile("rdcycle %0" : "=r"(cycles));
+  return cycles;
+}
+#else
+#include <time.h>
+static inline uint64_t _smt_timing_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+#endif
+#define SMT_TIMING_NOW() _smt_timing_now()
+#endif
+
+typedef struct {
+  uint64_t normalize_calls;
+  uint64_t verify_calls;
+  /* sorting and deduplicating leaves */
+  uint64_t normalize_cycles;
+  /* walking the proof program, excluding hashing */
+  uint64_t decode_cycles;
+  /* merging and hashing nodes */
+  uint64_t hash_cycles;
+  /* comparing the calculated root */
+  uint64_t compare_cycles;
+} smt_timing_t;
+
+/* the clock is only read when there is an accumulator, so plain
+ * smt_verify does not pay for timing in a build that enables it */
+#define _SMT_TIMED(acc, stmt)                   \
+  do {                                          \
+    if (acc) {                                  \
+      uint64_t _smt_t0 = SMT_TIMING_NOW();      \
+      stmt;                                     \
+      *(acc) += SMT_TIMING_NOW() - _smt_t0;     \
+    } else {                                    \
+      stmt;                                     \
+    }                                           \
+  } while (0)
+#else
+#define _SMT_TIMED(acc, stmt) \
+  do {                        \
+    (void)(acc);              \
+    stmt;                     \
+  } while (0)
+#endif
+
 enum SMTErrorCode {
   // SMT
   ERROR_INSUFFICIENT_CAPACITY = 80,
@@ -397,13 +474,17 @@ typedef struct {
    * * When t is _SMT_MERGE_VALUE_VALUE, current variable represents a non-zero
    * hash value.
    * * When t is _SMT_MERGE_VALUE_MERGE_WITH_ZERO, current variable represents
-   * a hash which is combined from a base node value with multiple zeros.
+   * a hash which is combined from a base node value (kept in value) with
+   * zero_count zeros (0 means 256).
+   *
+   * The zero_bits of a merged with zero value are not stored: for a value
+   * at height h, they are the bits of its key in [h - zero_count, h), so the
+   * verifier keeps them in the stack key and only materializes them when
+   * the value is hashed.
    */
   uint8_t t;
-
-  uint8_t value[SMT_VALUE_BYTES];
-  uint8_t zero_bits[SMT_KEY_BYTES];
   uint8_t zero_count;
+  uint8_t value[SMT_VALUE_BYTES];
 } _smt_merge_value_t;
 
 void _smt_merge_value_zero(_smt_merge_value_t *out) {
@@ -424,8 +505,47 @@ int _smt_merge_value_is_zero(const _smt_merge_value_t *v) {
   return v->t == _SMT_MERGE_VALUE_ZERO;
 }
 
+/* Mask of the bits in [start, end) that fall into byte i */
+uint8_t _smt_bits_mask(int i, int start, int end) {
+  int lo = start - i * 8;
+  int hi = end - i * 8;
+  if (lo < 0) lo = 0;
+  if (hi > 8) hi = 8;
+  if (hi <= lo) {
+    return 0;
+  }
+  return (uint8_t)(((1u << hi) - 1) & ~((1u << lo) - 1));
+}
+
+/* Zero bits of a merged with zero value at height, derived from its key */
+void _smt_zero_bits(const uint8_t *key, uint16_t height, uint8_t zero_count,
+                    uint8_t *out) {
+  int start = (int)height - (zero_count == 0 ? 256 : zero_count);
+  for (int i = 0; i < SMT_KEY_BYTES; i++) {
+    out[i] = key[i] & _smt_bits_mask(i, start, height);
+  }
+}
+
+/*
+ * Zero bits in a proof must come from merges below the sibling height,
+ * anything else can't be derived from the key.
+ */
+int _smt_check_zero_bits(const uint8_t *zero_bits, uint16_t height,
+                         uint8_t zero_count) {
+  if (zero_count == 0 || zero_count > height) {
+    return ERROR_INVALID_PROOF;
+  }
+  uint8_t expected[SMT_KEY_BYTES];
+  _smt_zero_bits(zero_bits, height, zero_count, expected);
+  if (memcmp(expected, zero_bits, SMT_KEY_BYTES) != 0) {
+    return ERROR_INVALID_PROOF;
+  }
+  return 0;
+}
+
 const uint8_t _SMT_MERGE_NORMAL = 1;
 const uint8_t _SMT_MERGE_ZEROS = 2;
+const uint8_t _SMT_MERGE_DEPTH = 3;
 
 /* Hash base node into a H256 */
 void _smt_hash_base_node(uint8_t base_height, const uint8_t *base_key,
@@ -440,14 +560,19 @@ void _smt_hash_base_node(uint8_t base_height, const uint8_t *base_key,
   blake2b_final(&blake2b_ctx, out, SMT_VALUE_BYTES);
 }
 
-void _smt_merge_value_hash(const _smt_merge_value_t *v, uint8_t *out) {
+/* Hash a value at height, key is the stack key the value belongs to */
+void _smt_merge_value_hash(const _smt_merge_value_t *v, const uint8_t *key,
+                           uint16_t height, uint8_t *out) {
   if (v->t == _SMT_MERGE_VALUE_MERGE_WITH_ZERO) {
+    uint8_t zero_bits[SMT_KEY_BYTES];
+    _smt_zero_bits(key, height, v->zero_count, zero_bits);
+
     blake2b_state blake2b_ctx;
     ckb_blake2b_init(&blake2b_ctx, SMT_VALUE_BYTES);
 
     blake2b_update(&blake2b_ctx, &_SMT_MERGE_ZEROS, 1);
     blake2b_update(&blake2b_ctx, v->value, SMT_VALUE_BYTES);
-    blake2b_update(&blake2b_ctx, v->zero_bits, SMT_KEY_BYTES);
+    blake2b_update(&blake2b_ctx, zero_bits, SMT_KEY_BYTES);
     blake2b_update(&blake2b_ctx, &(v->zero_count), 1);
     blake2b_final(&blake2b_ctx, out, SMT_VALUE_BYTES);
   } else {
@@ -455,49 +580,78 @@ void _smt_merge_value_hash(const _smt_merge_value_t *v, uint8_t *out) {
   }
 }
 
+/* Hash the top node of the tree into the root */
+void _smt_depth_root(const _smt_merge_value_t *v, const uint8_t *key,
+                     uint8_t *out) {
+  _smt_merge_value_hash(v, key, SMT_TREE_DEPTH, out);
+#if SMT_TREE_DEPTH < 256
+  if (!_smt_merge_value_is_zero(v)) {
+    uint8_t depth = SMT_TREE_DEPTH;
+    blake2b_state blake2b_ctx;
+    ckb_blake2b_init(&blake2b_ctx, SMT_VALUE_BYTES);
+
+    blake2b_update(&blake2b_ctx, &_SMT_MERGE_DEPTH, 1);
+    blake2b_update(&blake2b_ctx, &depth, 1);
+    blake2b_update(&blake2b_ctx, out, SMT_VALUE_BYTES);
+    blake2b_final(&blake2b_ctx, out, SMT_VALUE_BYTES);
+  }
+#endif
+}
+
+/*
+ * Merge a non-zero value with a zero sibling. The zero bit of this height
+ * is implied by the key, so only the count changes once the value is
+ * merged with zero.
+ */
 void _smt_merge_with_zero(uint8_t height, const uint8_t *node_key,
-                          const _smt_merge_value_t *v, int set_bit,
-                          _smt_merge_value_t *out) {
+                          _smt_merge_value_t *v) {
   if (v->t == _SMT_MERGE_VALUE_MERGE_WITH_ZERO) {
-    if (out != v) {
-      _smt_fast_memcpy(out, v, sizeof(_smt_merge_value_t));
-    }
-    if (set_bit) {
-      _smt_set_bit(out->zero_bits, height);
-    }
-    out->zero_count++;
+    v->zero_count++;
   } else {
-    out->t = _SMT_MERGE_VALUE_MERGE_WITH_ZERO;
-    _smt_hash_base_node(height, node_key, v->value, out->value);
-    _smt_fast_memset(out->zero_bits, 0, 32);
-    if (set_bit) {
-      _smt_set_bit(out->zero_bits, height);
-    }
-    out->zero_count = 1;
+    v->t = _SMT_MERGE_VALUE_MERGE_WITH_ZERO;
+    _smt_hash_base_node(height, node_key, v->value, v->value);
+    v->zero_count = 1;
   }
 }
 
-/* Notice that output might collide with one of lhs, or rhs */
-void _smt_merge(uint8_t height, const uint8_t *node_key,
-                const _smt_merge_value_t *lhs,
-                const _smt_merge_value_t *rhs,
-                _smt_merge_value_t *out) {
-  int lhs_zero = _smt_merge_value_is_zero(lhs);
-  int rhs_zero = _smt_merge_value_is_zero(rhs);
-
-  if (lhs_zero && rhs_zero) {
-    _smt_merge_value_zero(out);
-    return;
-  }
-  if (lhs_zero) {
-    _smt_merge_with_zero(height, node_key, rhs, 1, out);
+/*
+ * Merge the stack value (key, v) with a sibling at height, the result is
+ * written back to (key, v). sibling_key is the key the sibling's zero bits
+ * are derived from, NULL if the sibling has no zero bits, in which case it
+ * is only the key with the bit of this height flipped.
+ */
+void _smt_merge(uint8_t height, const uint8_t *node_key, uint8_t *key,
+                _smt_merge_value_t *v, const uint8_t *sibling_key,
+                const _smt_merge_value_t *sibling) {
+  int value_zero = _smt_merge_value_is_zero(v);
+  int sibling_zero = _smt_merge_value_is_zero(sibling);
+
+  if (sibling_zero) {
+    if (!value_zero) {
+      _smt_merge_with_zero(height, node_key, v);
+    }
     return;
   }
-  if (rhs_zero) {
-    _smt_merge_with_zero(height, node_key, lhs, 0, out);
+  if (value_zero) {
+    /* continue from the sibling, so the key follows its side */
+    *v = *sibling;
+    if (sibling_key != NULL) {
+      _smt_fast_memcpy(key, sibling_key, SMT_KEY_BYTES);
+    } else if (_smt_get_bit(key, height)) {
+      _smt_clear_bit(key, height);
+    } else {
+      _smt_set_bit(key, height);
+    }
+    _smt_merge_with_zero(height, node_key, v);
     return;
   }
 
+  int is_right = _smt_get_bit(key, height);
+  const _smt_merge_value_t *lhs = is_right ? sibling : v;
+  const _smt_merge_value_t *rhs = is_right ? v : sibling;
+  const uint8_t *lhs_key = is_right ? sibling_key : key;
+  const uint8_t *rhs_key = is_right ? key : sibling_key;
+
   blake2b_state blake2b_ctx;
   ckb_blake2b_init(&blake2b_ctx, SMT_VALUE_BYTES);
   uint8_t data[SMT_VALUE_BYTES];
@@ -505,13 +659,13 @@ void _smt_merge(uint8_t height, const uint8_t *node_key,
   blake2b_update(&blake2b_ctx, &_SMT_MERGE_NORMAL, 1);
   blake2b_update(&blake2b_ctx, &height, 1);
   blake2b_update(&blake2b_ctx, node_key, SMT_KEY_BYTES);
-  _smt_merge_value_hash(lhs, data);
+  _smt_merge_value_hash(lhs, lhs_key, height, data);
   blake2b_update(&blake2b_ctx, data, SMT_VALUE_BYTES);
-  _smt_merge_value_hash(rhs, data);
+  _smt_merge_value_hash(rhs, rhs_key, height, data);
   blake2b_update(&blake2b_ctx, data, SMT_VALUE_BYTES);
 
   blake2b_final(&blake2b_ctx, data, SMT_VALUE_BYTES);
-  _smt_merge_value_from_h256(data, out);
+  _smt_merge_value_from_h256(data, v);
 }
 
 const _smt_merge_value_t SMT_ZERO = {
@@ -523,9 +677,14 @@ const _smt_merge_value_t SMT_ZERO = {
  * Theoretically, a stack size of x should be able to process as many as
  * 2 ** (x - 1) updates. In this case with a stack size of 32, we can deal
  * with 2 ** 31 == 2147483648 updates, which is more than enough.
+ *
+ * Stack keys are kept unmasked: the bits below the current height carry
+ * the zero bits of merged with zero values, parent keys are computed when
+ * they are needed.
  */
-int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
-                       const uint8_t *proof, uint32_t proof_length) {
+int _smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
+                        const uint8_t *proof, uint32_t proof_length,
+                        uint64_t *hash_cycles) {
   uint8_t stack_keys[SMT_STACK_SIZE][SMT_KEY_BYTES];
   _smt_merge_value_t stack_values[SMT_STACK_SIZE];
   uint16_t stack_heights[SMT_STACK_SIZE] = {0};
@@ -543,6 +702,15 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
         if (leave_index >= pairs->len) {
           return ERROR_INVALID_PROOF;
         }
+#if SMT_TREE_DEPTH < 256
+        /* keys can't use bits above the tree depth */
+        uint8_t top_key[SMT_KEY_BYTES];
+        _smt_fast_memcpy(top_key, pairs->pairs[leave_index].key, SMT_KEY_BYTES);
+        _smt_parent_path(top_key, SMT_TREE_DEPTH - 1);
+        if (!_smt_is_zero_hash(top_key)) {
+          return ERROR_INVALID_PROOF;
+        }
+#endif
         _smt_fast_memcpy(stack_keys[stack_top], pairs->pairs[leave_index].key,
                SMT_KEY_BYTES);
         _smt_merge_value_from_h256(pairs->pairs[leave_index].value, &stack_values[stack_top]);
@@ -571,14 +739,10 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
         _smt_fast_memcpy(parent_key, key, SMT_KEY_BYTES);
         _smt_parent_path(parent_key, height);
 
-        // push value
-        if (_smt_get_bit(key, height)) {
-          _smt_merge((uint8_t)height, parent_key, &sibling_node, value, value);
-        } else {
-          _smt_merge((uint8_t)height, parent_key, value, &sibling_node, value);
-        }
-        // push key
-        _smt_parent_path(key, height);
+        // push value and key
+        _SMT_TIMED(hash_cycles,
+                   _smt_merge((uint8_t)height, parent_key, key, value, NULL,
+                              &sibling_node));
         // push height
         *height_ptr = height + 1;
       } break;
@@ -589,12 +753,6 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
         if (proof_index + 65 > proof_length) {
           return ERROR_INVALID_PROOF;
         }
-        _smt_merge_value_t sibling_node;
-        sibling_node.t = _SMT_MERGE_VALUE_MERGE_WITH_ZERO;
-        sibling_node.zero_count = proof[proof_index];
-        _smt_fast_memcpy(&sibling_node.value, &proof[proof_index + 1], 32);
-        _smt_fast_memcpy(&sibling_node.zero_bits, &proof[proof_index + 33], 32);
-        proof_index += 65;
         uint8_t *key = stack_keys[stack_top - 1];
         _smt_merge_value_t *value = &stack_values[stack_top - 1];
         uint16_t height = stack_heights[stack_top - 1];
@@ -602,18 +760,37 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
         if (height > 255) {
           return ERROR_INVALID_PROOF;
         }
+        _smt_merge_value_t sibling_node;
+        sibling_node.t = _SMT_MERGE_VALUE_MERGE_WITH_ZERO;
+        sibling_node.zero_count = proof[proof_index];
+        _smt_fast_memcpy(&sibling_node.value, &proof[proof_index + 1], 32);
+        const uint8_t *zero_bits = &proof[proof_index + 33];
+        proof_index += 65;
+        int ret = _smt_check_zero_bits(zero_bits, height, sibling_node.zero_count);
+        if (ret != 0) {
+          return ret;
+        }
+        // the sibling shares the key above this height, its zero bits
+        // replace the bits below
+        uint8_t sibling_key[SMT_KEY_BYTES];
+        int start = height - sibling_node.zero_count;
+        for (int i = 0; i < SMT_KEY_BYTES; i++) {
+          sibling_key[i] =
+              (key[i] & (uint8_t)~_smt_bits_mask(i, start, height)) | zero_bits[i];
+        }
+        if (_smt_get_bit(key, height)) {
+          _smt_clear_bit(sibling_key, height);
+        } else {
+          _smt_set_bit(sibling_key, height);
+        }
         uint8_t parent_key[SMT_KEY_BYTES];
         _smt_fast_memcpy(parent_key, key, SMT_KEY_BYTES);
         _smt_parent_path(parent_key, height);
 
-        // push value
-        if (_smt_get_bit(key, height)) {
-          _smt_merge((uint8_t)height, parent_key, &sibling_node, value, value);
-        } else {
-          _smt_merge((uint8_t)height, parent_key, value, &sibling_node, value);
-        }
-        // push key
-        _smt_parent_path(key, height);
+        // push value and key
+        _SMT_TIMED(hash_cycles,
+                   _smt_merge((uint8_t)height, parent_key, key, value,
+                              sibling_key, &sibling_node));
         // push height
         *height_ptr = height + 1;
       } break;
@@ -642,18 +819,20 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
         _smt_parent_path(parent_key, (uint8_t)height_a);
 
         // 2 keys should have same parent keys
-        _smt_parent_path(key_b, (uint8_t)height_b);
-        if (memcmp(parent_key, key_b, SMT_KEY_BYTES) != 0) {
+        uint8_t parent_key_b[SMT_KEY_BYTES];
+        _smt_fast_memcpy(parent_key_b, key_b, SMT_KEY_BYTES);
+        _smt_parent_path(parent_key_b, (uint8_t)height_b);
+        if (memcmp(parent_key, parent_key_b, SMT_KEY_BYTES) != 0) {
           return ERROR_INVALID_PROOF;
         }
-        // push value
-        if (_smt_get_bit(key_a, height_a)) {
-          _smt_merge(height_a, parent_key, value_b, value_a, value_a);
-        } else {
-          _smt_merge(height_a, parent_key, value_a, value_b, value_a);
+        // 2 keys must be on different sides
+        if (_smt_get_bit(key_a, height_a) == _smt_get_bit(key_b, height_b)) {
+          return ERROR_INVALID_PROOF;
         }
-        // push key
-        _smt_fast_memcpy(key_a, parent_key, SMT_KEY_BYTES);
+        // push value and key, the key of the non-zero side is kept
+        _SMT_TIMED(hash_cycles,
+                   _smt_merge((uint8_t)height_a, parent_key, key_a, value_a,
+                              key_b, value_b));
         // push height
         *height_a_ptr = height_a + 1;
         stack_top++;
@@ -680,31 +859,23 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
         if (base_height > 255) {
           return ERROR_INVALID_PROOF;
         }
-        uint8_t parent_key[SMT_KEY_BYTES];
-        _smt_fast_memcpy(parent_key, key, SMT_KEY_BYTES);
-        uint16_t height_u16 = base_height;
-        for (uint16_t idx = 0; idx < zero_count; idx++) {
-          height_u16 = base_height + idx;
-          if (height_u16 > 255) {
-            return ERROR_INVALID_PROOF;
-          }
-          // the following code can be omitted:
-          // _smt_fast_memcpy(parent_key, key, SMT_KEY_BYTES);
-          // A key's parent's parent can be calculated from parent.
-          // it's not needed to do it from scratch.
-          // Make sure height_u16 is in increase order
-          _smt_parent_path(parent_key, (uint8_t)height_u16);
-          // push value
-          if (_smt_get_bit(key, (uint8_t)height_u16)) {
-            _smt_merge((uint8_t)height_u16, parent_key, &SMT_ZERO, value, value);
-          } else {
-            _smt_merge((uint8_t)height_u16, parent_key, value, &SMT_ZERO, value);
-          }
+        if (base_height + zero_count > 256) {
+          return ERROR_INVALID_PROOF;
+        }
+        // only the first merge of a plain value needs the parent key,
+        // after that it merely counts zeros
+        if (value->t == _SMT_MERGE_VALUE_VALUE) {
+          uint8_t parent_key[SMT_KEY_BYTES];
+          _smt_fast_memcpy(parent_key, key, SMT_KEY_BYTES);
+          _smt_parent_path(parent_key, (uint8_t)base_height);
+          _SMT_TIMED(hash_cycles,
+                     _smt_merge_with_zero((uint8_t)base_height, parent_key, value));
+          value->zero_count += zero_count - 1;
+        } else if (value->t == _SMT_MERGE_VALUE_MERGE_WITH_ZERO) {
+          value->zero_count += zero_count;
         }
-        // push key
-        _smt_fast_memcpy(key, parent_key, SMT_KEY_BYTES);
         // push height
-        *base_height_ptr = height_u16 + 1;
+        *base_height_ptr = base_height + zero_count;
       } break;
       default:
         return ERROR_INVALID_PROOF;
@@ -713,7 +884,7 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
   if (stack_top != 1) {
     return ERROR_INVALID_STACK;
   }
-  if (stack_heights[0] != 256) {
+  if (stack_heights[0] != SMT_TREE_DEPTH) {
     return ERROR_INVALID_PROOF;
   }
   /* All leaves must be used */
@@ -721,10 +892,16 @@ int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
     return ERROR_INVALID_PROOF;
   }
 
-  _smt_merge_value_hash(&stack_values[0], buffer);
+  _SMT_TIMED(hash_cycles,
+             _smt_depth_root(&stack_values[0], stack_keys[0], buffer));
   return 0;
 }
 
+int smt_calculate_root(uint8_t *buffer, const smt_state_t *pairs,
+                       const uint8_t *proof, uint32_t proof_length) {
+  return _smt_calculate_root(buffer, pairs, proof, proof_length, NULL);
+}
+
 int smt_verify(const uint8_t *hash, const smt_state_t *state,
                const uint8_t *proof, uint32_t proof_length) {
   uint8_t buffer[32];
@@ -738,4 +915,202 @@ int smt_verify(const uint8_t *hash, const smt_state_t *state,
   return 0;
 }
 
+/*
+ * Hexary (16-ary) tree, see HexarySparseMerkleTree in Rust. Every level
+ * consumes 4 key bits, a subtree holding a single leaf is represented by
+ * the leaf hash.
+ */
+#define SMT_HEXARY_LEVELS 64
+
+const uint8_t _SMT_HEXARY_LEAF = 5;
+const uint8_t _SMT_HEXARY_NODE = 6;
+
+void _smt_hexary_hash_leaf(const uint8_t *key, const uint8_t *value,
+                           uint8_t *out) {
+  blake2b_state blake2b_ctx;
+  ckb_blake2b_init(&blake2b_ctx, SMT_VALUE_BYTES);
+
+  blake2b_update(&blake2b_ctx, &_SMT_HEXARY_LEAF, 1);
+  blake2b_update(&blake2b_ctx, key, SMT_KEY_BYTES);
+  blake2b_update(&blake2b_ctx, value, SMT_VALUE_BYTES);
+  blake2b_final(&blake2b_ctx, out, SMT_VALUE_BYTES);
+}
+
+/* nibble of key at level */
+uint8_t _smt_hexary_nibble(const uint8_t *key, int level) {
+  return (key[level / 2] >> ((level % 2) * 4)) & 0x0F;
+}
+
+/*
+ * Verify a single key proof of a hexary tree, a zero value proves the key
+ * does not exist. The proof starts with a u64 mask of levels with siblings,
+ * each of those levels carries a u16 sibling bitmap, a u16 bitmap of
+ * siblings which are single leaf subtrees and the sibling hashes. When the
+ * subtree of the key is empty and the only sibling is a single leaf
+ * subtree, the bit of the key is set in the leaf bitmap and the leaf key and
+ * value hash are given instead, the key must lie below the sibling index.
+ */
+int smt_hexary_verify(const uint8_t *root, const uint8_t *key,
+                      const uint8_t *value, const uint8_t *proof,
+                      uint32_t proof_length) {
+  if (proof_length < 8) {
+    return ERROR_INVALID_PROOF;
+  }
+  uint64_t levels_mask = 0;
+  for (int i = 7; i >= 0; i--) {
+    levels_mask = (levels_mask << 8) | proof[i];
+  }
+  uint32_t proof_index = 8;
+
+  uint8_t current[SMT_VALUE_BYTES];
+  int is_leaf = 0;
+  if (_smt_is_zero_hash(value)) {
+    _smt_fast_memset(current, 0, SMT_VALUE_BYTES);
+  } else {
+    _smt_hexary_hash_leaf(key, value, current);
+    is_leaf = 1;
+  }
+
+  for (int level = 0; level < SMT_HEXARY_LEVELS; level++) {
+    uint8_t index = _smt_hexary_nibble(key, level);
+    uint16_t own = (uint16_t)(1 << index);
+    uint16_t bitmap = 0;
+    uint16_t leaf_bits = 0;
+    const uint8_t *siblings = NULL;
+    uint8_t lone_leaf[SMT_VALUE_BYTES];
+    if ((levels_mask >> level) & 1) {
+      if (proof_index + 4 > proof_length) {
+        return ERROR_INVALID_PROOF;
+      }
+      bitmap = proof[proof_index] | (proof[proof_index + 1] << 8);
+      leaf_bits = proof[proof_index + 2] | (proof[proof_index + 3] << 8);
+      proof_index += 4;
+      /* the own bit of the leaf bits marks a lone leaf given by key */
+      int lone = (leaf_bits & own) != 0;
+      leaf_bits &= (uint16_t)~own;
+      if (bitmap == 0 || (bitmap & own) || (leaf_bits & ~bitmap)) {
+        return ERROR_INVALID_PROOF;
+      }
+      if (lone) {
+        if (leaf_bits != bitmap || (bitmap & (bitmap - 1)) != 0 ||
+            proof_index + SMT_KEY_BYTES + SMT_VALUE_BYTES > proof_length) {
+          return ERROR_INVALID_PROOF;
+        }
+        const uint8_t *leaf_key = &proof[proof_index];
+        uint8_t sibling_index = 0;
+        while (!((bitmap >> sibling_index) & 1)) {
+          sibling_index++;
+        }
+        if (_smt_hexary_nibble(leaf_key, level) != sibling_index) {
+          return ERROR_INVALID_PROOF;
+        }
+        for (int upper = level + 1; upper < SMT_HEXARY_LEVELS; upper++) {
+          if (_smt_hexary_nibble(leaf_key, upper) !=
+              _smt_hexary_nibble(key, upper)) {
+            return ERROR_INVALID_PROOF;
+          }
+        }
+        _smt_hexary_hash_leaf(leaf_key, &proof[proof_index + SMT_KEY_BYTES],
+                              lone_leaf);
+        proof_index += SMT_KEY_BYTES + SMT_VALUE_BYTES;
+        siblings = lone_leaf;
+      } else {
+        siblings = &proof[proof_index];
+        uint32_t count = 0;
+        for (uint16_t bits = bitmap; bits; bits &= bits - 1) {
+          count++;
+        }
+        if (proof_index + count * 32 > proof_length) {
+          return ERROR_INVALID_PROOF;
+        }
+        proof_index += count * 32;
+        if (_smt_is_zero_hash(current)) {
+          /* a leaf hash not given by key must not collapse the node, the
+           * hash of the full node matches no tree */
+          leaf_bits = 0;
+        }
+      }
+    }
+    int current_zero = _smt_is_zero_hash(current);
+    if (!current_zero) {
+      bitmap |= own;
+      if (is_leaf) {
+        leaf_bits |= own;
+      }
+    }
+    if (bitmap == 0) {
+      is_leaf = 0;
+      continue;
+    }
+    if ((bitmap & (bitmap - 1)) == 0 && leaf_bits == bitmap) {
+      /* a single leaf subtree keeps the leaf hash */
+      if (current_zero) {
+        _smt_fast_memcpy(current, siblings, SMT_VALUE_BYTES);
+      }
+      is_leaf = 1;
+      continue;
+    }
+    uint8_t bitmap_bytes[2] = {(uint8_t)bitmap, (uint8_t)(bitmap >> 8)};
+    uint8_t height = (uint8_t)level;
+    blake2b_state blake2b_ctx;
+    ckb_blake2b_init(&blake2b_ctx, SMT_VALUE_BYTES);
+    blake2b_update(&blake2b_ctx, &_SMT_HEXARY_NODE, 1);
+    blake2b_update(&blake2b_ctx, &height, 1);
+    blake2b_update(&blake2b_ctx, bitmap_bytes, 2);
+    for (uint8_t i = 0; i < 16; i++) {
+      if (!((bitmap >> i) & 1)) {
+        continue;
+      }
+      if (i == index && !current_zero) {
+        blake2b_update(&blake2b_ctx, current, SMT_VALUE_BYTES);
+      } else {
+        blake2b_update(&blake2b_ctx, siblings, SMT_VALUE_BYTES);
+        siblings += SMT_VALUE_BYTES;
+      }
+    }
+    blake2b_final(&blake2b_ctx, current, SMT_VALUE_BYTES);
+    is_leaf = 0;
+  }
+  if (proof_index != proof_length) {
+    return ERROR_INVALID_PROOF;
+  }
+  if (memcmp(current, root, SMT_VALUE_BYTES) != 0) {
+    return ERROR_INVALID_PROOF;
+  }
+  return 0;
+}
+
+#ifdef SMT_ENABLE_TIMING
+void smt_state_normalize_timed(smt_state_t *state, smt_timing_t *timing) {
+  uint64_t start = SMT_TIMING_NOW();
+  smt_state_normalize(state);
+  timing->normalize_cycles += SMT_TIMING_NOW() - start;
+  timing->normalize_calls++;
+}
+
+int smt_verify_timed(const uint8_t *hash, const smt_state_t *state,
+                     const uint8_t *proof, uint32_t proof_length,
+                     smt_timing_t *timing) {
+  uint8_t buffer[32];
+  uint64_t hash_cycles = 0;
+  uint64_t start = SMT_TIMING_NOW();
+  int ret = _smt_calculate_root(buffer, state, proof, proof_length,
+                                &hash_cycles);
+  uint64_t end = SMT_TIMING_NOW();
+  timing->verify_calls++;
+  timing->hash_cycles += hash_cycles;
+  timing->decode_cycles += (end - start) - hash_cycles;
+  if (ret != 0) {
+    return ret;
+  }
+  start = SMT_TIMING_NOW();
+  ret = memcmp(buffer, hash, 32);
+  timing->compare_cycles += SMT_TIMING_NOW() - start;
+  if (ret != 0) {
+    return ERROR_INVALID_PROOF;
+  }
+  return 0;
+}
+#endif
+
 #endif
@@ -0,0 +1,473 @@
+use crate::{
+    collections::{BTreeMap, BTreeSet},
+    compact_store::{decode_branch, encode_branch},
+    error::{Error, Result},
+    export::checksum,
+    merge::{depth_root, merge, MergeValue},
+    snapshot::{read_h256, read_u32, read_u64},
+    traits::{ForkHashes, Hasher, Store, Value, ValueCodec},
+    tree::{rebuild_leaf_counts, BranchKey, BranchNode, SparseMerkleTree},
+    vec,
+    vec::Vec,
+    H256,
+};
+
+// Layout of a checkpoint, integers are little endian:
+//
+// header: magic | depth u16 | base root | root | records u64
+//         | checksum u64 | data size u64
+// record: kind u8 | height u8 | key | len u32 | bytes
+//
+// A record is a compact encoded branch or an encoded leaf value written
+// since the checkpoint of `base root`, a length of u32::MAX removes the
+// item. A base checkpoint has a zero base root and holds the whole tree.
+const MAGIC: &[u8; 8] = b"SMTCKPT1";
+const HEADER_SIZE: usize = 8 + 2 + 32 + 32 + 8 + 8 + 8;
+const KIND_BRANCH: u8 = 0;
+const KIND_LEAF: u8 = 1;
+const REMOVED: u32 = u32::MAX;
+
+fn corrupted() -> Error {
+    Error::Store("corrupted checkpoint".into())
+}
+
+/// A store adapter remembers the branches and leaves written since the
+/// last checkpoint, so a checkpoint only reads and writes the churn.
+#[derive(Debug, Clone, Default)]
+pub struct CheckpointStore<S> {
+    inner: S,
+    // root of the last checkpoint
+    base_root: H256,
+    dirty_branches: BTreeSet<BranchKey>,
+    dirty_leaves: BTreeSet<H256>,
+}
+
+impl<S> CheckpointStore<S> {
+    /// Wrap an empty store
+    pub fn new(inner: S) -> Self {
+        CheckpointStore {
+            inner,
+            base_root: H256::zero(),
+            dirty_branches: BTreeSet::new(),
+            dirty_leaves: BTreeSet::new(),
+        }
+    }
+
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+
+    /// Root of the last checkpoint, zero before the first one
+    pub fn base_root(&self) -> &H256 {
+        &self.base_root
+    }
+
+    /// Number of branches and leaves written since the last checkpoint
+    pub fn dirty_len(&self) -> (usize, usize) {
+        (self.dirty_branches.len(), self.dirty_leaves.len())
+    }
+}
+
+impl<V, S: Store<V>> Store<V> for CheckpointStore<S> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>> {
+        self.inner.get_branch(branch_key)
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>> {
+        self.inner.get_leaf(leaf_key)
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<()> {
+        self.dirty_branches.insert(branch_key.clone());
+        self.inner.insert_branch(branch_key, branch)
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<()> {
+        self.dirty_leaves.insert(leaf_key);
+        self.inner.insert_leaf(leaf_key, leaf)
+    }
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, hash: H256) -> Result<()> {
+        self.dirty_leaves.insert(leaf_key);
+        self.inner.insert_leaf_with_hash(leaf_key, leaf, hash)
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<()> {
+        self.dirty_branches.insert(branch_key.clone());
+        self.inner.remove_branch(branch_key)
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<()> {
+        self.dirty_leaves.insert(*leaf_key);
+        self.inner.remove_leaf(leaf_key)
+    }
+    fn keeps_leaf_counts(&self) -> bool {
+        self.inner.keeps_leaf_counts()
+    }
+    fn get_leaf_count(&self, branch_key: &BranchKey) -> Result<u64> {
+        self.inner.get_leaf_count(branch_key)
+    }
+    fn insert_leaf_count(&mut self, branch_key: BranchKey, count: u64) -> Result<()> {
+        self.inner.insert_leaf_count(branch_key, count)
+    }
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>> {
+        self.inner.get_branch_with_hashes(branch_key)
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<()> {
+        self.dirty_branches.insert(branch_key.clone());
+        self.inner
+            .insert_branch_with_hashes(branch_key, branch, hashes)
+    }
+}
+
+/// Kind, height and key of a record
+type RecordKey = (u8, u8, H256);
+/// Records of a checkpoint, None removes the item
+type Records<'a> = BTreeMap<RecordKey, Option<&'a [u8]>>;
+/// Records encoded from a store
+type EncodedRecords = Vec<(RecordKey, Option<Vec<u8>>)>;
+
+fn encode_checkpoint<'a>(
+    depth: usize,
+    base_root: &H256,
+    root: &H256,
+    records: impl Iterator<Item = (RecordKey, Option<&'a [u8]>)>,
+) -> Vec<u8> {
+    let mut data = Vec::new();
+    let mut count = 0u64;
+    for ((kind, height, key), bytes) in records {
+        data.push(kind);
+        data.push(height);
+        data.extend_from_slice(key.as_slice());
+        match bytes {
+            Some(bytes) => {
+                data.extend_from_slice(&(bytes.len() as u32).to_le_bytes());
+                data.extend_from_slice(bytes);
+            }
+            None => data.extend_from_slice(&REMOVED.to_le_bytes()),
+        }
+        count += 1;
+    }
+    let mut buf = Vec::with_capacity(HEADER_SIZE + data.len());
+    buf.extend_from_slice(MAGIC);
+    buf.extend_from_slice(&(depth as u16).to_le_bytes());
+    buf.extend_from_slice(base_root.as_slice());
+    buf.extend_from_slice(root.as_slice());
+    buf.extend_from_slice(&count.to_le_bytes());
+    buf.extend_from_slice(&checksum(&data).to_le_bytes());
+    buf.extend_from_slice(&(data.len() as u64).to_le_bytes());
+    buf.extend_from_slice(&data);
+    buf
+}
+
+/// A decoded checkpoint
+struct Checkpoint<'a> {
+    depth: usize,
+    base_root: H256,
+    root: H256,
+    records: Vec<(RecordKey, Option<&'a [u8]>)>,
+}
+
+fn decode_checkpoint(bytes: &[u8]) -> Result<Checkpoint<'_>> {
+    if bytes.len() < HEADER_SIZE || &bytes[..8] != MAGIC {
+        return Err(corrupted());
+    }
+    let depth = u16::from_le_bytes([bytes[8], bytes[9]]) as usize;
+    let base_root = read_h256(&bytes[10..]);
+    let root = read_h256(&bytes[42..]);
+    let count = read_u64(&bytes[74..]);
+    let data = &bytes[HEADER_SIZE..];
+    if read_u64(&bytes[90..]) != data.len() as u64 || read_u64(&bytes[82..]) != checksum(data) {
+        return Err(corrupted());
+    }
+    let mut records = Vec::new();
+    let mut pos = 0;
+    while pos < data.len() {
+        let header = data.get(pos..pos + 38).ok_or_else(corrupted)?;
+        let (kind, height, key) = (header[0], header[1], read_h256(&header[2..]));
+        let len = read_u32(&header[34..]);
+        pos += 38;
+        let bytes = if len == REMOVED {
+            None
+        } else {
+            let bytes = data.get(pos..pos + len as usize).ok_or_else(corrupted)?;
+            pos += len as usize;
+            Some(bytes)
+        };
+        if kind != KIND_BRANCH && kind != KIND_LEAF {
+            return Err(corrupted());
+        }
+        records.push(((kind, height, key), bytes));
+    }
+    if records.len() as u64 != count {
+        return Err(corrupted());
+    }
+    Ok(Checkpoint {
+        depth,
+        base_root,
+        root,
+        records,
+    })
+}
+
+/// Merge a chain of checkpoints into one from the base of the first to the
+/// root of the last, later writes of an item replace earlier ones. Merging
+/// from a base checkpoint drops removals, the result is a new base.
+pub fn compact<I, C>(chain: I) -> Result<Vec<u8>>
+where
+    I: IntoIterator<Item = C>,
+    C: AsRef<[u8]>,
+{
+    let chain: Vec<C> = chain.into_iter().collect();
+    let mut merged: Records = BTreeMap::new();
+    let mut header: Option<(usize, H256, H256)> = None;
+    for bytes in &chain {
+        let checkpoint = decode_checkpoint(bytes.as_ref())?;
+        header = match header {
+            None => Some((checkpoint.depth, checkpoint.base_root, checkpoint.root)),
+            Some((depth, base_root, root)) => {
+                if checkpoint.depth != depth {
+                    return Err(corrupted());
+                }
+                if checkpoint.base_root != root {
+                    return Err(Error::RootMismatch {
+                        expected: checkpoint.base_root,
+                        actual: root,
+                    });
+                }
+                Some((depth, base_root, checkpoint.root))
+            }
+        };
+        merged.extend(checkpoint.records);
+    }
+    let (depth, base_root, root) = header.ok_or_else(corrupted)?;
+    if base_root.is_zero() {
+        merged.retain(|_, bytes| bytes.is_some());
+    }
+    Ok(encode_checkpoint(
+        depth,
+        &base_root,
+        &root,
+        merged.into_iter(),
+    ))
+}
+
+impl<H, V, S, const DEPTH: usize> SparseMerkleTree<H, V, CheckpointStore<S>, DEPTH>
+where
+    H: Hasher + Default,
+    V: Value + ValueCodec,
+    S: Store<V>,
+{
+    /// Write the branches and leaves changed since the last checkpoint, the
+    /// first checkpoint of a new tree is a base.
+    pub fn checkpoint(&mut self) -> Result<Vec<u8>> {
+        let store = self.store();
+        let mut encoded: EncodedRecords = Vec::new();
+        for branch_key in &store.dirty_branches {
+            let bytes = store
+                .inner
+                .get_branch(branch_key)?
+                .map(|b| encode_branch(&b));
+            encoded.push(((KIND_BRANCH, branch_key.height, branch_key.node_key), bytes));
+        }
+        for leaf_key in &store.dirty_leaves {
+            let bytes = store.inner.get_leaf(leaf_key)?.map(|leaf| {
+                let mut buf = Vec::new();
+                leaf.encode(&mut buf);
+                buf
+            });
+            encoded.push(((KIND_LEAF, 0, *leaf_key), bytes));
+        }
+        let base_root = store.base_root;
+        Ok(self.finish_checkpoint(base_root, encoded))
+    }
+
+    /// Write a base checkpoint of the whole tree, e.g. to start a new chain
+    pub fn base_checkpoint(&mut self) -> Result<Vec<u8>> {
+        let mut encoded: EncodedRecords = Vec::new();
+        if !self.is_empty() {
+            let store = &self.store().inner;
+            let mut pending = vec![(Self::ROOT_HEIGHT, H256::zero())];
+            while let Some((height, node_key)) = pending.pop() {
+                let branch = store
+                    .get_branch(&BranchKey::new(height, node_key))?
+                    .ok_or(Error::MissingBranch(height, node_key))?;
+                let mut right_key = node_key;
+                right_key.set_bit(height);
+                for (child, child_key) in
+                    [(&branch.left, node_key), (&branch.right, right_key)].iter()
+                {
+                    if child.is_zero() {
+                        continue;
+                    }
+                    if height == 0 {
+                        let leaf = store
+                            .get_leaf(child_key)?
+                            .ok_or(Error::MissingLeaf(*child_key))?;
+                        let mut buf = Vec::new();
+                        leaf.encode(&mut buf);
+                        encoded.push(((KIND_LEAF, 0, *child_key), Some(buf)));
+                    } else {
+                        pending.push((height - 1, *child_key));
+                    }
+                }
+                encoded.push((
+                    (KIND_BRANCH, height, node_key),
+                    Some(encode_branch(&branch)),
+                ));
+            }
+        }
+        Ok(self.finish_checkpoint(H256::zero(), encoded))
+    }
+
+    /// Encode the records in key order, so the same changes always give the
+    /// same bytes, and start the next delta from the current root
+    fn finish_checkpoint(&mut self, base_root: H256, mut encoded: EncodedRecords) -> Vec<u8> {
+        encoded.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+        let checkpoint = encode_checkpoint(
+            DEPTH,
+            &base_root,
+            self.root(),
+            encoded.iter().map(|(key, bytes)| (*key, bytes.as_deref())),
+        );
+        let root = *self.root();
+        let store = self.store_mut();
+        store.base_root = root;
+        store.dirty_branches.clear();
+        store.dirty_leaves.clear();
+        checkpoint
+    }
+
+    /// Restore a tree from a base checkpoint and the deltas after it, each
+    /// checkpoint must start from the root of the previous one. After each
+    /// checkpoint the branches it wrote and their parents must hold the
+    /// hashes of their children and the root branch must give its root, so
+    /// the check costs as much as the churn. Leaf counts are rebuilt for a
+    /// store keeping them. The restored tree continues the chain.
+    pub fn restore<I, C>(chain: I) -> Result<Self>
+    where
+        S: Default,
+        I: IntoIterator<Item = C>,
+        C: AsRef<[u8]>,
+    {
+        let mut store = CheckpointStore::new(S::default());
+        for bytes in chain {
+            let checkpoint = decode_checkpoint(bytes.as_ref())?;
+            if checkpoint.depth != DEPTH {
+                return Err(corrupted());
+            }
+            if checkpoint.base_root != store.base_root {
+                return Err(Error::RootMismatch {
+                    expected: checkpoint.base_root,
+                    actual: store.base_root,
+                });
+            }
+            // branches to check, the written ones and the parents of writes
+            let mut touched = BTreeSet::new();
+            for ((kind, height, key), bytes) in checkpoint.records {
+                if height > Self::ROOT_HEIGHT {
+                    return Err(corrupted());
+                }
+                if kind == KIND_BRANCH {
+                    touched.insert(BranchKey::new(height, key));
+                    if height < Self::ROOT_HEIGHT {
+                        touched.insert(BranchKey::new(height + 1, key.parent_path(height + 1)));
+                    }
+                } else {
+                    touched.insert(BranchKey::new(0, key.parent_path(0)));
+                }
+                match (kind, bytes) {
+                    (KIND_BRANCH, Some(bytes)) => {
+                        let branch = decode_branch(bytes).ok_or_else(corrupted)?;
+                        store
+                            .inner
+                            .insert_branch(BranchKey::new(height, key), branch)?;
+                    }
+                    (KIND_BRANCH, None) => {
+                        store.inner.remove_branch(&BranchKey::new(height, key))?;
+                    }
+                    (_, Some(bytes)) => {
+                        let leaf = V::decode(bytes).ok_or_else(corrupted)?;
+                        store.inner.insert_leaf(key, leaf)?;
+                    }
+                    (_, None) => store.inner.remove_leaf(&key)?,
+                }
+            }
+            for branch_key in &touched {
+                Self::check_branch(&store.inner, branch_key)?;
+            }
+            let root = Self::stored_root(&store.inner)?;
+            if root != checkpoint.root {
+                return Err(Error::RootMismatch {
+                    expected: checkpoint.root,
+                    actual: root,
+                });
+            }
+            store.base_root = checkpoint.root;
+        }
+        if store.inner.keeps_leaf_counts() && !store.base_root.is_zero() {
+            rebuild_leaf_counts(&mut store.inner, Self::ROOT_HEIGHT, H256::zero())?;
+        }
+        Ok(Self::new(store.base_root, store))
+    }
+
+    /// Check a branch holds the hashes of its children, a missing branch
+    /// must have no children
+    fn check_branch(store: &S, branch_key: &BranchKey) -> Result<()> {
+        let height = branch_key.height;
+        let node_key = branch_key.node_key;
+        let mut right_key = node_key;
+        right_key.set_bit(height);
+        let children = [
+            Self::stored_child(store, height, &node_key)?,
+            Self::stored_child(store, height, &right_key)?,
+        ];
+        let expected = match store.get_branch(branch_key)? {
+            Some(branch) => [branch.left, branch.right],
+            None => [MergeValue::zero(), MergeValue::zero()],
+        };
+        if children != expected {
+            return Err(corrupted());
+        }
+        Ok(())
+    }
+
+    /// Hash of the child of a branch at `height` hashed from the store
+    fn stored_child(store: &S, height: u8, child_key: &H256) -> Result<MergeValue> {
+        if height == 0 {
+            return Ok(match store.get_leaf(child_key)? {
+                Some(leaf) => MergeValue::from_h256(leaf.to_h256()),
+                None => MergeValue::zero(),
+            });
+        }
+        Ok(
+            match store.get_branch(&BranchKey::new(height - 1, *child_key))? {
+                Some(branch) => merge::<H>(height - 1, child_key, &branch.left, &branch.right),
+                None => MergeValue::zero(),
+            },
+        )
+    }
+
+    /// Root hashed from the root branch of a store
+    fn stored_root(store: &S) -> Result<H256> {
+        let root_key = BranchKey::new(Self::ROOT_HEIGHT, H256::zero());
+        Ok(match store.get_branch(&root_key)? {
+            Some(branch) => {
+                let top = merge::<H>(
+                    Self::ROOT_HEIGHT,
+                    &H256::zero(),
+                    &branch.left,
+                    &branch.right,
+                );
+                depth_root::<H>(DEPTH, &top)
+            }
+            None => H256::zero(),
+        })
+    }
+}
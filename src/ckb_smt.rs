@@ -18,6 +18,18 @@ struct smt_state_t {
     capacity: u32,
 }
 
+/// Cycles spent in each phase of the C verifier, accumulated over calls
+#[repr(C)]
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct SMTTiming {
+    pub normalize_calls: u64,
+    pub verify_calls: u64,
+    pub normalize_cycles: u64,
+    pub decode_cycles: u64,
+    pub hash_cycles: u64,
+    pub compare_cycles: u64,
+}
+
 #[link(name = "smt-c-impl", kind = "static")]
 extern "C" {
     fn smt_state_init(state: *mut smt_state_t, buffer: *const smt_pair_t, capacity: u32);
@@ -30,6 +42,23 @@ extern "C" {
         proof: *const u8,
         proof_length: u32,
     ) -> i32;
+
+    fn smt_hexary_verify(
+        root: *const u8,
+        key: *const u8,
+        value: *const u8,
+        proof: *const u8,
+        proof_length: u32,
+    ) -> i32;
+
+    fn smt_state_normalize_timed(state: *mut smt_state_t, timing: *mut SMTTiming);
+    fn smt_verify_timed(
+        hash: *const u8,
+        state: *const smt_state_t,
+        proof: *const u8,
+        proof_length: u32,
+        timing: *mut SMTTiming,
+    ) -> i32;
 }
 
 #[derive(Default)]
@@ -54,6 +83,15 @@ impl SMTBuilder {
     }
 
     pub fn build(self) -> Result<SMT, i32> {
+        self.build_inner(None)
+    }
+
+    /// Build and add the cycles spent normalizing leaves into `timing`
+    pub fn build_with_timing(self, timing: &mut SMTTiming) -> Result<SMT, i32> {
+        self.build_inner(Some(timing))
+    }
+
+    fn build_inner(self, timing: Option<&mut SMTTiming>) -> Result<SMT, i32> {
         let capacity = self.data.len();
         let mut smt = SMT {
             state: Box::new(smt_state_t {
@@ -77,7 +115,10 @@ impl SMTBuilder {
                 }
             }
 
-            smt_state_normalize(smt.state.as_mut());
+            match timing {
+                Some(timing) => smt_state_normalize_timed(smt.state.as_mut(), timing),
+                None => smt_state_normalize(smt.state.as_mut()),
+            }
         }
         Ok(smt)
     }
@@ -98,4 +139,44 @@ impl SMT {
         }
         Ok(())
     }
+
+    /// Verify and add the cycles spent in each phase into `timing`
+    pub fn verify_with_timing(
+        &self,
+        root: &H256,
+        proof: &[u8],
+        timing: &mut SMTTiming,
+    ) -> Result<(), i32> {
+        unsafe {
+            let verify_ret = smt_verify_timed(
+                root.as_slice().as_ptr(),
+                self.state.as_ref(),
+                proof.as_ptr(),
+                proof.len() as u32,
+                timing,
+            );
+            if 0 != verify_ret {
+                return Err(verify_ret);
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Verify a `HexaryProof` of a single key with the C verifier,
+/// a zero value proves the key does not exist
+pub fn hexary_verify(root: &H256, key: &H256, value: &H256, proof: &[u8]) -> Result<(), i32> {
+    let verify_ret = unsafe {
+        smt_hexary_verify(
+            root.as_slice().as_ptr(),
+            key.as_slice().as_ptr(),
+            value.as_slice().as_ptr(),
+            proof.as_ptr(),
+            proof.len() as u32,
+        )
+    };
+    if 0 != verify_ret {
+        return Err(verify_ret);
+    }
+    Ok(())
 }
@@ -0,0 +1,248 @@
+use crate::{
+    boxed::Box,
+    default_store::Map,
+    error::Error,
+    merge::MergeValue,
+    traits::{ForkHashes, Store},
+    tree::{BranchKey, BranchNode},
+    vec::Vec,
+    H256,
+};
+
+const KIND_ZERO: u8 = 0;
+const KIND_VALUE: u8 = 1;
+const KIND_MERGE_WITH_ZERO: u8 = 2;
+// MergeWithZero followed by its cached hash
+const KIND_MERGE_WITH_ZERO_HASHED: u8 = 3;
+const KIND_BITS: u8 = 2;
+const KIND_MASK: u8 = 0b11;
+
+fn kind(value: &MergeValue, hash: Option<H256>) -> u8 {
+    match value {
+        v if v.is_zero() => KIND_ZERO,
+        MergeValue::Value(_) => KIND_VALUE,
+        MergeValue::MergeWithZero { .. } if hash.is_some() => KIND_MERGE_WITH_ZERO_HASHED,
+        MergeValue::MergeWithZero { .. } => KIND_MERGE_WITH_ZERO,
+    }
+}
+
+fn encode_value(value: &MergeValue, hash: Option<H256>, buf: &mut Vec<u8>) {
+    match value {
+        v if v.is_zero() => {}
+        MergeValue::Value(v) => buf.extend_from_slice(v.as_slice()),
+        MergeValue::MergeWithZero {
+            base_node,
+            zero_bits,
+            zero_count,
+        } => {
+            buf.push(*zero_count);
+            buf.extend_from_slice(base_node.as_slice());
+            // only keep the non-zero bytes of zero_bits, a short chain sets a few bits
+            let bits = zero_bits.as_slice();
+            match bits.iter().position(|b| *b != 0) {
+                Some(start) => {
+                    let end = bits.iter().rposition(|b| *b != 0).unwrap() + 1;
+                    buf.push(start as u8);
+                    buf.push((end - start) as u8);
+                    buf.extend_from_slice(&bits[start..end]);
+                }
+                None => {
+                    buf.push(0);
+                    buf.push(0);
+                }
+            }
+            if let Some(hash) = hash {
+                buf.extend_from_slice(hash.as_slice());
+            }
+        }
+    }
+}
+
+fn read_h256(data: &[u8], offset: &mut usize) -> Option<H256> {
+    let bytes = data.get(*offset..*offset + 32)?;
+    *offset += 32;
+    let mut inner = [0u8; 32];
+    inner.copy_from_slice(bytes);
+    Some(inner.into())
+}
+
+/// Decode a child, along with its kept hash
+fn decode_value(kind: u8, data: &[u8], offset: &mut usize) -> Option<(MergeValue, Option<H256>)> {
+    match kind {
+        KIND_ZERO => Some((MergeValue::zero(), None)),
+        KIND_VALUE => read_h256(data, offset).map(|v| (MergeValue::Value(v), None)),
+        KIND_MERGE_WITH_ZERO | KIND_MERGE_WITH_ZERO_HASHED => {
+            let zero_count = *data.get(*offset)?;
+            *offset += 1;
+            let base_node = read_h256(data, offset)?;
+            let start = *data.get(*offset)? as usize;
+            let len = *data.get(*offset + 1)? as usize;
+            *offset += 2;
+            if start + len > 32 {
+                return None;
+            }
+            let mut zero_bits = [0u8; 32];
+            zero_bits[start..start + len].copy_from_slice(data.get(*offset..*offset + len)?);
+            *offset += len;
+            let hash = if kind == KIND_MERGE_WITH_ZERO_HASHED {
+                Some(read_h256(data, offset)?)
+            } else {
+                None
+            };
+            let value = MergeValue::MergeWithZero {
+                base_node,
+                zero_bits: zero_bits.into(),
+                zero_count,
+            };
+            Some((value, hash))
+        }
+        _ => None,
+    }
+}
+
+/// Encode a branch with a tagged layout:
+/// one header byte holds the kind of both children, zero children take no bytes,
+/// and the zero_bits of MergeWithZero children are trimmed to their non-zero bytes.
+pub fn encode_branch(branch: &BranchNode) -> Vec<u8> {
+    encode_branch_with_hashes(branch, [None, None])
+}
+
+/// Encode a branch along with the kept hashes of its MergeWithZero children,
+/// a child with a hash is tagged with its own kind
+pub(crate) fn encode_branch_with_hashes(branch: &BranchNode, hashes: ForkHashes) -> Vec<u8> {
+    let mut buf = Vec::with_capacity(1 + 32 * 2);
+    buf.push(kind(&branch.left, hashes[0]) | (kind(&branch.right, hashes[1]) << KIND_BITS));
+    encode_value(&branch.left, hashes[0], &mut buf);
+    encode_value(&branch.right, hashes[1], &mut buf);
+    buf
+}
+
+/// Decode a branch encoded by `encode_branch`, return None if the data is corrupted
+pub fn decode_branch(data: &[u8]) -> Option<BranchNode> {
+    match decode_branch_prefix(data)? {
+        (branch, len) if len == data.len() => Some(branch),
+        _ => None,
+    }
+}
+
+/// Decode a branch at the start of data, return it with its encoded length
+pub(crate) fn decode_branch_prefix(data: &[u8]) -> Option<(BranchNode, usize)> {
+    decode_branch_with_hashes(data).map(|(branch, _hashes, len)| (branch, len))
+}
+
+/// Decode a branch at the start of data along with its kept hashes
+fn decode_branch_with_hashes(data: &[u8]) -> Option<(BranchNode, ForkHashes, usize)> {
+    let header = *data.first()?;
+    let mut offset = 1;
+    let (left, left_hash) = decode_value(header & KIND_MASK, data, &mut offset)?;
+    let (right, right_hash) = decode_value((header >> KIND_BITS) & KIND_MASK, data, &mut offset)?;
+    Some((BranchNode { left, right }, [left_hash, right_hash], offset))
+}
+
+/// Read the header of a branch at the start of data without decoding it,
+/// return whether its left and right children are non-zero and its encoded length
+pub(crate) fn branch_shape(data: &[u8]) -> Option<(bool, bool, usize)> {
+    let header = *data.first()?;
+    let mut offset = 1;
+    let mut non_zero = [false; 2];
+    for (i, kind) in [header & KIND_MASK, (header >> KIND_BITS) & KIND_MASK]
+        .iter()
+        .enumerate()
+    {
+        non_zero[i] = *kind != KIND_ZERO;
+        match *kind {
+            KIND_ZERO => {}
+            KIND_VALUE => offset += 32,
+            _ => {
+                // zero count, base node, then the trimmed zero bits
+                let len = *data.get(offset + 1 + 32 + 1)? as usize;
+                offset += 1 + 32 + 2 + len;
+                if *kind == KIND_MERGE_WITH_ZERO_HASHED {
+                    offset += 32;
+                }
+            }
+        }
+    }
+    if offset > data.len() {
+        return None;
+    }
+    Some((non_zero[0], non_zero[1], offset))
+}
+
+/// A memory store keeps branches in the compact encoding
+#[derive(Debug, Clone, Default)]
+pub struct CompactStore<V> {
+    branches_map: Map<BranchKey, Box<[u8]>>,
+    leaves_map: Map<H256, V>,
+}
+
+impl<V> CompactStore<V> {
+    pub fn branches_map(&self) -> &Map<BranchKey, Box<[u8]>> {
+        &self.branches_map
+    }
+    pub fn leaves_map(&self) -> &Map<H256, V> {
+        &self.leaves_map
+    }
+    /// Total bytes of encoded branches
+    pub fn branches_bytes(&self) -> usize {
+        self.branches_map.values().map(|b| b.len()).sum()
+    }
+    pub fn clear(&mut self) {
+        self.branches_map.clear();
+        self.leaves_map.clear();
+    }
+}
+
+impl<V: Clone> Store<V> for CompactStore<V> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        match self.branches_map.get(branch_key) {
+            Some(data) => decode_branch(data)
+                .map(Some)
+                .ok_or_else(|| Error::Store("corrupted compact branch".into())),
+            None => Ok(None),
+        }
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>, Error> {
+        Ok(self.leaves_map.get(leaf_key).map(Clone::clone))
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        self.branches_map
+            .insert(branch_key, encode_branch(&branch).into_boxed_slice());
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error> {
+        self.leaves_map.insert(leaf_key, leaf);
+        Ok(())
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
+        self.branches_map.remove(branch_key);
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        self.leaves_map.remove(leaf_key);
+        Ok(())
+    }
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>, Error> {
+        match self.branches_map.get(branch_key) {
+            Some(data) => match decode_branch_with_hashes(data) {
+                Some((branch, hashes, len)) if len == data.len() => Ok(Some((branch, hashes))),
+                _ => Err(Error::Store("corrupted compact branch".into())),
+            },
+            None => Ok(None),
+        }
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<(), Error> {
+        let data = encode_branch_with_hashes(&branch, hashes);
+        self.branches_map
+            .insert(branch_key, data.into_boxed_slice());
+        Ok(())
+    }
+}
@@ -1,7 +1,7 @@
 use crate::{
     collections,
     error::Error,
-    traits::Store,
+    traits::{ForkHashes, Store},
     tree::{BranchKey, BranchNode},
     H256,
 };
@@ -10,6 +10,8 @@ use crate::{
 pub struct DefaultStore<V> {
     branches_map: Map<BranchKey, BranchNode>,
     leaves_map: Map<H256, V>,
+    // kept hashes of the MergeWithZero children of forks
+    fork_hashes: Map<BranchKey, ForkHashes>,
 }
 
 impl<V> DefaultStore<V> {
@@ -22,6 +24,7 @@ impl<V> DefaultStore<V> {
     pub fn clear(&mut self) {
         self.branches_map.clear();
         self.leaves_map.clear();
+        self.fork_hashes.clear();
     }
 }
 
@@ -33,6 +36,9 @@ impl<V: Clone> Store<V> for DefaultStore<V> {
         Ok(self.leaves_map.get(leaf_key).map(Clone::clone))
     }
     fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        if !self.fork_hashes.is_empty() {
+            self.fork_hashes.remove(&branch_key);
+        }
         self.branches_map.insert(branch_key, branch);
         Ok(())
     }
@@ -42,12 +48,42 @@ impl<V: Clone> Store<V> for DefaultStore<V> {
     }
     fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
         self.branches_map.remove(branch_key);
+        if !self.fork_hashes.is_empty() {
+            self.fork_hashes.remove(branch_key);
+        }
         Ok(())
     }
     fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
         self.leaves_map.remove(leaf_key);
         Ok(())
     }
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>, Error> {
+        Ok(self.branches_map.get(branch_key).map(|branch| {
+            let hashes = self
+                .fork_hashes
+                .get(branch_key)
+                .copied()
+                .unwrap_or([None, None]);
+            (branch.clone(), hashes)
+        }))
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<(), Error> {
+        if hashes == [None, None] {
+            self.fork_hashes.remove(&branch_key);
+        } else {
+            self.fork_hashes.insert(branch_key.clone(), hashes);
+        }
+        self.branches_map.insert(branch_key, branch);
+        Ok(())
+    }
 }
 
 cfg_if::cfg_if! {
@@ -0,0 +1,198 @@
+use crate::{
+    collections::BTreeMap,
+    default_store::Map,
+    error::Error,
+    traits::{ForkHashes, Store},
+    tree::{remove_subtree, BranchKey, BranchNode},
+    vec,
+    vec::Vec,
+    H256,
+};
+
+/// A store adapter lets `SparseMerkleTree::delete_prefix` drop a subtree in
+/// one step, other stores remove the subtree at once.
+///
+/// A detached subtree is hidden from reads as soon as it is detached. Its
+/// branches and leaves stay in the inner store until `reclaim` removes them,
+/// or until a write lands inside it, which reclaims it first. Detached
+/// subtrees are indexed by their top branch, a read probes one key per
+/// height holding detached subtrees.
+///
+/// Wrap the other adapters with this one, so that reclaimed nodes are
+/// removed through them.
+#[derive(Debug, Clone, Default)]
+pub struct DetachStore<S> {
+    inner: S,
+    // top branch of a detached subtree, to its branches still to remove
+    detached: Map<BranchKey, Vec<(u8, H256)>>,
+    // number of detached subtrees by the height of their top branch
+    heights: BTreeMap<u8, usize>,
+}
+
+impl<S> DetachStore<S> {
+    pub fn new(inner: S) -> Self {
+        DetachStore {
+            inner,
+            detached: Map::default(),
+            heights: BTreeMap::new(),
+        }
+    }
+
+    /// The inner store, nodes of detached subtrees are still in it
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+
+    /// Return the inner store, call `reclaim(usize::MAX)` on the tree first
+    /// to leave no detached node in it
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+
+    /// Number of detached subtrees left to reclaim
+    pub fn detached_len(&self) -> usize {
+        self.detached.len()
+    }
+
+    /// Top branch of a detached subtree containing the branch at `height`
+    /// on the path of `key`
+    fn detached_top(&self, height: u8, key: &H256) -> Option<BranchKey> {
+        if self.detached.is_empty() {
+            return None;
+        }
+        self.heights
+            .range(height..)
+            .map(|(top_height, _count)| BranchKey::new(*top_height, key.parent_path(*top_height)))
+            .find(|top| self.detached.contains_key(top))
+    }
+
+    fn forget(&mut self, top: &BranchKey) {
+        if self.detached.remove(top).is_none() {
+            return;
+        }
+        if let Some(count) = self.heights.get_mut(&top.height) {
+            *count -= 1;
+            if *count == 0 {
+                self.heights.remove(&top.height);
+            }
+        }
+    }
+
+    /// Reclaim the detached subtrees containing the branch at `height` on
+    /// the path of `key`, before it is written
+    fn reclaim_containing<V>(&mut self, height: u8, key: &H256) -> Result<(), Error>
+    where
+        S: Store<V>,
+    {
+        while let Some(top) = self.detached_top(height, key) {
+            if let Some(mut pending) = self.detached.get_mut(&top).map(core::mem::take) {
+                remove_subtree(&mut self.inner, &mut pending, usize::MAX)?;
+            }
+            self.forget(&top);
+        }
+        Ok(())
+    }
+}
+
+impl<V, S: Store<V>> Store<V> for DetachStore<S> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        if self
+            .detached_top(branch_key.height, &branch_key.node_key)
+            .is_some()
+        {
+            return Ok(None);
+        }
+        self.inner.get_branch(branch_key)
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>, Error> {
+        if self.detached_top(0, leaf_key).is_some() {
+            return Ok(None);
+        }
+        self.inner.get_leaf(leaf_key)
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        self.reclaim_containing(branch_key.height, &branch_key.node_key)?;
+        self.inner.insert_branch(branch_key, branch)
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error> {
+        self.reclaim_containing(0, &leaf_key)?;
+        self.inner.insert_leaf(leaf_key, leaf)
+    }
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, hash: H256) -> Result<(), Error> {
+        self.reclaim_containing(0, &leaf_key)?;
+        self.inner.insert_leaf_with_hash(leaf_key, leaf, hash)
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
+        self.reclaim_containing(branch_key.height, &branch_key.node_key)?;
+        self.inner.remove_branch(branch_key)
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        self.reclaim_containing(0, leaf_key)?;
+        self.inner.remove_leaf(leaf_key)
+    }
+    fn keeps_leaf_counts(&self) -> bool {
+        self.inner.keeps_leaf_counts()
+    }
+    fn get_leaf_count(&self, branch_key: &BranchKey) -> Result<u64, Error> {
+        if self
+            .detached_top(branch_key.height, &branch_key.node_key)
+            .is_some()
+        {
+            return Ok(0);
+        }
+        self.inner.get_leaf_count(branch_key)
+    }
+    fn insert_leaf_count(&mut self, branch_key: BranchKey, count: u64) -> Result<(), Error> {
+        self.reclaim_containing(branch_key.height, &branch_key.node_key)?;
+        self.inner.insert_leaf_count(branch_key, count)
+    }
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>, Error> {
+        if self
+            .detached_top(branch_key.height, &branch_key.node_key)
+            .is_some()
+        {
+            return Ok(None);
+        }
+        self.inner.get_branch_with_hashes(branch_key)
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<(), Error> {
+        self.reclaim_containing(branch_key.height, &branch_key.node_key)?;
+        self.inner
+            .insert_branch_with_hashes(branch_key, branch, hashes)
+    }
+    // a detached subtree inside the new one is kept, its parent no longer
+    // points to it, so it is reclaimed on its own
+    fn detach_branch(&mut self, branch_key: &BranchKey) -> Result<bool, Error> {
+        let pending = vec![(branch_key.height, branch_key.node_key)];
+        if self.detached.insert(branch_key.clone(), pending).is_none() {
+            *self.heights.entry(branch_key.height).or_insert(0) += 1;
+        }
+        Ok(true)
+    }
+    fn reclaim_detached(&mut self, budget: usize) -> Result<bool, Error> {
+        let mut budget = budget;
+        while budget > 0 {
+            let top = match self.detached.keys().next() {
+                Some(top) => top.clone(),
+                None => break,
+            };
+            let pending = self.detached.get_mut(&top).expect("detached subtree");
+            budget -= remove_subtree(&mut self.inner, pending, budget)?;
+            if pending.is_empty() {
+                self.forget(&top);
+            }
+        }
+        Ok(self.detached.is_empty())
+    }
+    fn has_detached(&self) -> bool {
+        !self.detached.is_empty()
+    }
+}
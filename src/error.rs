@@ -15,6 +15,14 @@ pub enum Error {
     NonSiblings,
     InvalidCode(u8),
     NonMergableRange,
+    KeyOutOfRange(H256),
+    HeightOutOfRange(u8),
+    NonEmptySubtree(u8, H256),
+    GraftOutOfRange,
+    MissingLeafCounts,
+    VersionOutOfRange(u64),
+    InvalidChunk(u8, H256),
+    RootMismatch { expected: H256, actual: H256 },
 }
 
 impl core::fmt::Display for Error {
@@ -61,6 +69,38 @@ impl core::fmt::Display for Error {
             Error::NonMergableRange => {
                 write!(f, "Ranges can not be merged")?;
             }
+            Error::KeyOutOfRange(key) => {
+                write!(f, "Key {:?} is out of the tree depth", key)?;
+            }
+            Error::HeightOutOfRange(height) => {
+                write!(f, "Height {} is out of the tree depth", height)?;
+            }
+            Error::NonEmptySubtree(height, key) => {
+                write!(f, "Subtree height:{}, key:{:?} is not empty", height, key)?;
+            }
+            Error::GraftOutOfRange => {
+                write!(f, "Grafted tree has leaves out of the subtree")?;
+            }
+            Error::MissingLeafCounts => {
+                write!(f, "Store does not keep leaf counts")?;
+            }
+            Error::VersionOutOfRange(version) => {
+                write!(f, "Version {} is pruned or not written yet", version)?;
+            }
+            Error::InvalidChunk(height, key) => {
+                write!(
+                    f,
+                    "Chunk height:{}, key:{:?} does not match its subtree",
+                    height, key
+                )?;
+            }
+            Error::RootMismatch { expected, actual } => {
+                write!(
+                    f,
+                    "Root mismatch, expected {:?} actual {:?}",
+                    expected, actual
+                )?;
+            }
         }
         Ok(())
     }
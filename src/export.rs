@@ -0,0 +1,351 @@
+use crate::{
+    error::{Error, Result},
+    merge::merge,
+    snapshot::{read_h256, read_u32, read_u64},
+    traits::{Hasher, Store, Value, ValueCodec},
+    tree::{BranchKey, SparseMerkleTree},
+    vec,
+    vec::Vec,
+    H256,
+};
+
+// An export is a header followed by chunks, integers are little endian:
+//
+// header: magic | depth u16 | root
+// chunk: magic | height u8 | node_key | subtree hash | leaves u64
+//        | checksum u64 | data size u64 | data
+// data: (key | len u32 | value) sorted by key
+//
+// A chunk holds all leaves of the subtree at `height` on the path of
+// `node_key`. The subtree hash ties the chunk to its place in the tree, the
+// checksum only detects damaged bytes before the chunk is built.
+const HEADER_MAGIC: &[u8; 8] = b"SMTEXPT1";
+const HEADER_SIZE: usize = 8 + 2 + 32;
+const CHUNK_MAGIC: &[u8; 8] = b"SMTCHNK1";
+const CHUNK_HEADER_SIZE: usize = 8 + 1 + 32 + 32 + 8 + 8 + 8;
+
+fn corrupted() -> Error {
+    Error::Store("corrupted export".into())
+}
+
+/// FNV-1a of the chunk data
+pub(crate) fn checksum(data: &[u8]) -> u64 {
+    let mut hash = 0xcbf2_9ce4_8422_2325u64;
+    for byte in data {
+        hash ^= *byte as u64;
+        hash = hash.wrapping_mul(0x0100_0000_01b3);
+    }
+    hash
+}
+
+/// A streaming export of a tree, see `SparseMerkleTree::export`.
+///
+/// Iterating yields the chunks in key order, each one read from the store
+/// when it is reached.
+pub struct Export<'a, H, V, S, const DEPTH: usize> {
+    tree: &'a SparseMerkleTree<H, V, S, DEPTH>,
+    chunk_height: u8,
+    // branches above the chunks still to visit
+    pending: Vec<(u8, H256)>,
+}
+
+impl<'a, H, V, S, const DEPTH: usize> Export<'a, H, V, S, DEPTH>
+where
+    H: Hasher + Default,
+    V: Value + ValueCodec,
+    S: Store<V>,
+{
+    /// The header to send before the chunks
+    pub fn header(&self) -> Vec<u8> {
+        let mut buf = Vec::with_capacity(HEADER_SIZE);
+        buf.extend_from_slice(HEADER_MAGIC);
+        buf.extend_from_slice(&(DEPTH as u16).to_le_bytes());
+        buf.extend_from_slice(self.tree.root().as_slice());
+        buf
+    }
+
+    /// Encode the chunk of the subtree at height on the path of node_key
+    fn chunk(&self, height: u8, node_key: H256) -> Result<Vec<u8>> {
+        let store = self.tree.store();
+        let top = store
+            .get_branch(&BranchKey::new(height, node_key))?
+            .ok_or(Error::MissingBranch(height, node_key))?;
+        let subtree_hash = merge::<H>(height, &node_key, &top.left, &top.right).hash::<H>();
+
+        let mut data = Vec::new();
+        let mut leaves = 0u64;
+        // left children are popped first, leaves come out sorted
+        let mut pending = vec![(height, node_key)];
+        while let Some((height, node_key)) = pending.pop() {
+            let branch = store
+                .get_branch(&BranchKey::new(height, node_key))?
+                .ok_or(Error::MissingBranch(height, node_key))?;
+            let mut right_key = node_key;
+            right_key.set_bit(height);
+            if height == 0 {
+                for (child, child_key) in
+                    [(&branch.left, node_key), (&branch.right, right_key)].iter()
+                {
+                    if child.is_zero() {
+                        continue;
+                    }
+                    let leaf = store
+                        .get_leaf(child_key)?
+                        .ok_or(Error::MissingLeaf(*child_key))?;
+                    data.extend_from_slice(child_key.as_slice());
+                    let start = data.len();
+                    data.extend_from_slice(&[0u8; 4]);
+                    leaf.encode(&mut data);
+                    let len = (data.len() - start - 4) as u32;
+                    data[start..start + 4].copy_from_slice(&len.to_le_bytes());
+                    leaves += 1;
+                }
+                continue;
+            }
+            if !branch.right.is_zero() {
+                pending.push((height - 1, right_key));
+            }
+            if !branch.left.is_zero() {
+                pending.push((height - 1, node_key));
+            }
+        }
+
+        let mut buf = Vec::with_capacity(CHUNK_HEADER_SIZE + data.len());
+        buf.extend_from_slice(CHUNK_MAGIC);
+        buf.push(height);
+        buf.extend_from_slice(node_key.as_slice());
+        buf.extend_from_slice(subtree_hash.as_slice());
+        buf.extend_from_slice(&leaves.to_le_bytes());
+        buf.extend_from_slice(&checksum(&data).to_le_bytes());
+        buf.extend_from_slice(&(data.len() as u64).to_le_bytes());
+        buf.extend_from_slice(&data);
+        Ok(buf)
+    }
+}
+
+impl<'a, H, V, S, const DEPTH: usize> Iterator for Export<'a, H, V, S, DEPTH>
+where
+    H: Hasher + Default,
+    V: Value + ValueCodec,
+    S: Store<V>,
+{
+    type Item = Result<Vec<u8>>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while let Some((height, node_key)) = self.pending.pop() {
+            if height == self.chunk_height {
+                return Some(self.chunk(height, node_key));
+            }
+            let branch = match self
+                .tree
+                .store()
+                .get_branch(&BranchKey::new(height, node_key))
+            {
+                Ok(Some(branch)) => branch,
+                Ok(None) => return Some(Err(Error::MissingBranch(height, node_key))),
+                Err(err) => return Some(Err(err)),
+            };
+            let mut right_key = node_key;
+            right_key.set_bit(height);
+            if !branch.right.is_zero() {
+                self.pending.push((height - 1, right_key));
+            }
+            if !branch.left.is_zero() {
+                self.pending.push((height - 1, node_key));
+            }
+        }
+        None
+    }
+}
+
+/// A decoded chunk
+struct Chunk<V> {
+    height: u8,
+    node_key: H256,
+    subtree_hash: H256,
+    leaves: Vec<(H256, V)>,
+}
+
+fn decode_chunk<V: ValueCodec>(bytes: &[u8]) -> Result<Chunk<V>> {
+    if bytes.len() < CHUNK_HEADER_SIZE || &bytes[..8] != CHUNK_MAGIC {
+        return Err(corrupted());
+    }
+    let height = bytes[8];
+    let node_key = read_h256(&bytes[9..]);
+    let subtree_hash = read_h256(&bytes[41..]);
+    let count = read_u64(&bytes[73..]);
+    let data = &bytes[CHUNK_HEADER_SIZE..];
+    if read_u64(&bytes[89..]) != data.len() as u64 || read_u64(&bytes[81..]) != checksum(data) {
+        return Err(corrupted());
+    }
+    let mut leaves = Vec::new();
+    let mut pos = 0;
+    while pos < data.len() {
+        let key = data
+            .get(pos..pos + 32)
+            .map(read_h256)
+            .ok_or_else(corrupted)?;
+        let len = data
+            .get(pos + 32..pos + 36)
+            .map(|b| read_u32(b) as usize)
+            .ok_or_else(corrupted)?;
+        let value = data
+            .get(pos + 36..pos + 36 + len)
+            .and_then(V::decode)
+            .ok_or_else(corrupted)?;
+        // keys are sorted and unique, all under the subtree
+        if key.parent_path(height) != node_key
+            || leaves.last().is_some_and(|(last, _)| *last >= key)
+        {
+            return Err(Error::InvalidChunk(height, node_key));
+        }
+        leaves.push((key, value));
+        pos += 36 + len;
+    }
+    if leaves.len() as u64 != count {
+        return Err(corrupted());
+    }
+    Ok(Chunk {
+        height,
+        node_key,
+        subtree_hash,
+        leaves,
+    })
+}
+
+impl<H, V, S, const DEPTH: usize> SparseMerkleTree<H, V, S, DEPTH>
+where
+    H: Hasher + Default,
+    V: Value + ValueCodec,
+    S: Store<V>,
+{
+    /// Export all leaves as a header and a stream of chunks, one chunk per
+    /// non-empty subtree at `chunk_height`. With random keys a subtree at
+    /// height `h` holds about `leaves / 2^(255 - h)` leaves.
+    pub fn export(&self, chunk_height: u8) -> Result<Export<'_, H, V, S, DEPTH>> {
+        if chunk_height > Self::ROOT_HEIGHT {
+            return Err(Error::HeightOutOfRange(chunk_height));
+        }
+        let pending = if self.is_empty() {
+            Vec::new()
+        } else {
+            vec![(Self::ROOT_HEIGHT, H256::zero())]
+        };
+        Ok(Export {
+            tree: self,
+            chunk_height,
+            pending,
+        })
+    }
+
+    /// Insert the leaves of a chunk into its empty subtree and check the
+    /// subtree against the hash of the chunk, `hashes` are the `to_h256`
+    /// of the leaf values
+    fn import_chunk(&mut self, chunk: Chunk<V>, hashes: Vec<H256>) -> Result<()> {
+        let (height, node_key) = (chunk.height, chunk.node_key);
+        if height > Self::ROOT_HEIGHT || !node_key.is_within_depth(DEPTH) {
+            return Err(Error::InvalidChunk(height, node_key));
+        }
+        let top_key = BranchKey::new(height, node_key);
+        if self.store().get_branch(&top_key)?.is_some() {
+            return Err(Error::NonEmptySubtree(height, node_key));
+        }
+        // leaves are sorted, unique and under the subtree, see decode_chunk
+        self.update_sorted(chunk.leaves, hashes)?;
+        let top = self
+            .store()
+            .get_branch(&top_key)?
+            .ok_or(Error::InvalidChunk(height, node_key))?;
+        if merge::<H>(height, &node_key, &top.left, &top.right).hash::<H>() != chunk.subtree_hash {
+            return Err(Error::InvalidChunk(height, node_key));
+        }
+        Ok(())
+    }
+
+    /// Check the header of an export, return an empty tree and the expected root
+    fn import_header(header: &[u8]) -> Result<(Self, H256)>
+    where
+        S: Default,
+    {
+        if header.len() != HEADER_SIZE || &header[..8] != HEADER_MAGIC {
+            return Err(corrupted());
+        }
+        if u16::from_le_bytes([header[8], header[9]]) as usize != DEPTH {
+            return Err(corrupted());
+        }
+        Ok((
+            Self::new(H256::zero(), S::default()),
+            read_h256(&header[10..]),
+        ))
+    }
+
+    fn check_imported_root(self, expected: H256) -> Result<Self> {
+        if self.root() != &expected {
+            return Err(Error::RootMismatch {
+                expected,
+                actual: *self.root(),
+            });
+        }
+        Ok(self)
+    }
+
+    /// Rebuild a tree from an export. The leaves of each chunk are written
+    /// into its subtree in one batch and the subtree is checked against the
+    /// hash of the chunk, the result must match the exported root.
+    pub fn import<I, C>(header: &[u8], chunks: I) -> Result<Self>
+    where
+        S: Default,
+        I: IntoIterator<Item = C>,
+        C: AsRef<[u8]>,
+    {
+        let (mut tree, root) = Self::import_header(header)?;
+        for chunk in chunks {
+            let chunk = decode_chunk::<V>(chunk.as_ref())?;
+            let hashes = chunk.leaves.iter().map(|(_, v)| v.to_h256()).collect();
+            tree.import_chunk(chunk, hashes)?;
+        }
+        tree.check_imported_root(root)
+    }
+
+    /// Same as `import`, chunks are decoded, checksummed and their values
+    /// hashed on `threads` threads, `threads` chunks at a time. The tree is
+    /// still merged on the calling thread, as in `update_all_parallel`.
+    #[cfg(feature = "std")]
+    pub fn import_parallel<I, C>(header: &[u8], chunks: I, threads: usize) -> Result<Self>
+    where
+        S: Default,
+        V: Send,
+        I: IntoIterator<Item = C>,
+        C: AsRef<[u8]> + Send,
+    {
+        let (mut tree, root) = Self::import_header(header)?;
+        let threads = core::cmp::max(threads, 1);
+        let mut chunks = chunks.into_iter().peekable();
+        while chunks.peek().is_some() {
+            let round: Vec<C> = chunks.by_ref().take(threads).collect();
+            let decoded = std::thread::scope(|scope| {
+                let handles: Vec<_> = round
+                    .into_iter()
+                    .map(|chunk| {
+                        scope.spawn(move || {
+                            decode_chunk::<V>(chunk.as_ref()).map(|chunk| {
+                                let hashes: Vec<H256> =
+                                    chunk.leaves.iter().map(|(_, v)| v.to_h256()).collect();
+                                (chunk, hashes)
+                            })
+                        })
+                    })
+                    .collect();
+                handles
+                    .into_iter()
+                    .map(|handle| handle.join().expect("import thread"))
+                    .collect::<Vec<_>>()
+            });
+            for chunk in decoded {
+                let (chunk, hashes) = chunk?;
+                tree.import_chunk(chunk, hashes)?;
+            }
+        }
+        tree.check_imported_root(root)
+    }
+}
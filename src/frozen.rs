@@ -0,0 +1,227 @@
+use crate::{
+    compact_store::{branch_shape, decode_branch_prefix, encode_branch},
+    error::{Error, Result},
+    merkle_proof::MerkleProof,
+    snapshot::{read_h256, read_u32, read_u64},
+    traits::{Hasher, Store, Value, ValueCodec},
+    tree::{merkle_proof_from_siblings, BranchKey, SparseMerkleTree},
+    vec,
+    vec::Vec,
+    H256,
+};
+use core::marker::PhantomData;
+
+// Layout of a frozen tree, integers are little endian:
+//
+// header: magic | depth u16 | root | data size u64
+// data: one record per branch in depth first order, left subtree first
+//
+// record: compact encoded branch
+//         | offset of the right child u64, only if both children are non-zero
+//         | values of the non-zero children (len u32 | value), only at height 0
+//
+// The first child of a branch always starts right after its record, so the
+// path of a key is read forward, jumping only at the forks. Below the top
+// levels most branches have a single child, the path to a leaf is then one
+// contiguous run of records.
+const MAGIC: &[u8; 8] = b"SMTFROZ1";
+const HEADER_SIZE: usize = 8 + 2 + 32 + 8;
+
+fn corrupted() -> Error {
+    Error::Store("corrupted frozen tree".into())
+}
+
+/// An immutable tree over a buffer written by `SparseMerkleTree::freeze`.
+///
+/// Reads walk the records from the root and never allocate or copy the
+/// buffer, which may be a mapping of a file written by `snapshot::publish`.
+#[derive(Debug, Clone, Copy)]
+pub struct FrozenTree<'a, H, V, const DEPTH: usize = 256> {
+    root: H256,
+    data: &'a [u8],
+    phantom: PhantomData<(H, V)>,
+}
+
+impl<'a, H: Hasher + Default, V: Value + ValueCodec, const DEPTH: usize>
+    FrozenTree<'a, H, V, DEPTH>
+{
+    /// Height of the root branch
+    pub const ROOT_HEIGHT: u8 = {
+        assert!(DEPTH > 0 && DEPTH <= 256, "tree depth must be 1..=256");
+        (DEPTH - 1) as u8
+    };
+
+    /// Attach to a frozen tree, only the header and the total size are checked
+    pub fn new(bytes: &'a [u8]) -> Result<Self> {
+        if bytes.len() < HEADER_SIZE || &bytes[..8] != MAGIC {
+            return Err(corrupted());
+        }
+        let depth = u16::from_le_bytes([bytes[8], bytes[9]]) as usize;
+        let root = read_h256(&bytes[10..]);
+        let data_size = read_u64(&bytes[42..]);
+        if depth != DEPTH || (bytes.len() - HEADER_SIZE) as u64 != data_size {
+            return Err(corrupted());
+        }
+        Ok(FrozenTree {
+            root,
+            data: &bytes[HEADER_SIZE..],
+            phantom: PhantomData,
+        })
+    }
+
+    /// Merkle root
+    pub fn root(&self) -> &H256 {
+        &self.root
+    }
+
+    /// Check empty of the tree
+    pub fn is_empty(&self) -> bool {
+        self.root.is_zero()
+    }
+
+    /// Get value of a leaf
+    /// return zero value if leaf not exists
+    pub fn get(&self, key: &H256) -> Result<V> {
+        if !key.is_within_depth(DEPTH) {
+            return Err(Error::KeyOutOfRange(*key));
+        }
+        match self.walk(key, |_, _, _| Ok(()))? {
+            Some(bytes) => V::decode(bytes).ok_or_else(corrupted),
+            None => Ok(V::zero()),
+        }
+    }
+
+    /// Generate merkle proof, the same proof as the tree it is frozen from
+    pub fn merkle_proof(&self, keys: Vec<H256>) -> Result<MerkleProof> {
+        merkle_proof_from_siblings(DEPTH, keys, |key| {
+            let mut siblings = Vec::new();
+            self.walk(key, |height, (left, right), record| {
+                // only decode the branches with a sibling on the path
+                let is_right = key.is_right(height);
+                if (is_right && left) || (!is_right && right) {
+                    let (branch, _len) = decode_branch_prefix(record).ok_or_else(corrupted)?;
+                    let sibling = if is_right { branch.left } else { branch.right };
+                    siblings.push((height, sibling));
+                }
+                Ok(())
+            })?;
+            siblings.reverse();
+            Ok(siblings)
+        })
+    }
+
+    /// Visit the records of the branches on the path of key from the root,
+    /// along with whether their children are non-zero, return the encoded value of the leaf if it exists
+    fn walk<F>(&self, key: &H256, mut visit: F) -> Result<Option<&'a [u8]>>
+    where
+        F: FnMut(u8, (bool, bool), &[u8]) -> Result<()>,
+    {
+        if self.is_empty() {
+            return Ok(None);
+        }
+        let data = self.data;
+        let mut pos = 0;
+        for height in (0..=Self::ROOT_HEIGHT).rev() {
+            let record = data.get(pos..).ok_or_else(corrupted)?;
+            let (left, right, len) = branch_shape(record).ok_or_else(corrupted)?;
+            visit(height, (left, right), record)?;
+            let is_right = key.is_right(height);
+            if !(if is_right { right } else { left }) {
+                return Ok(None);
+            }
+            let fork = left && right;
+            pos += len;
+            if height == 0 {
+                if is_right && fork {
+                    pos += 4 + read_len(data, pos)?;
+                }
+                let value_len = read_len(data, pos)?;
+                return data
+                    .get(pos + 4..pos + 4 + value_len)
+                    .map(Some)
+                    .ok_or_else(corrupted);
+            }
+            if fork {
+                let right_offset = data.get(pos..pos + 8).ok_or_else(corrupted)?;
+                pos += 8;
+                if is_right {
+                    pos = read_u64(right_offset) as usize;
+                }
+            }
+        }
+        Err(corrupted())
+    }
+}
+
+fn read_len(data: &[u8], pos: usize) -> Result<usize> {
+    data.get(pos..pos + 4)
+        .map(|bytes| read_u32(bytes) as usize)
+        .ok_or_else(corrupted)
+}
+
+impl<H, V, S, const DEPTH: usize> SparseMerkleTree<H, V, S, DEPTH>
+where
+    H: Hasher + Default,
+    V: Value + ValueCodec,
+    S: Store<V>,
+{
+    /// Serialize the current version into the read-only layout of
+    /// `FrozenTree`, proofs and reads of the frozen tree follow the path of
+    /// a key through one buffer instead of a store lookup per level
+    pub fn freeze(&self) -> Result<Vec<u8>> {
+        let mut data = Vec::new();
+        if !self.is_empty() {
+            // (height, node key, where to patch the offset of a right child)
+            let mut pending = vec![(Self::ROOT_HEIGHT, H256::zero(), None)];
+            while let Some((height, node_key, patch)) = pending.pop() {
+                if let Some(patch) = patch {
+                    let offset = (data.len() as u64).to_le_bytes();
+                    data[patch..patch + 8].copy_from_slice(&offset);
+                }
+                let branch = self
+                    .store()
+                    .get_branch(&BranchKey::new(height, node_key))?
+                    .ok_or(Error::MissingBranch(height, node_key))?;
+                data.extend_from_slice(&encode_branch(&branch));
+                let mut right_key = node_key;
+                right_key.set_bit(height);
+                if height == 0 {
+                    for (child, child_key) in
+                        [(&branch.left, node_key), (&branch.right, right_key)].iter()
+                    {
+                        if !child.is_zero() {
+                            let leaf = self
+                                .store()
+                                .get_leaf(child_key)?
+                                .ok_or(Error::MissingLeaf(*child_key))?;
+                            let start = data.len();
+                            data.extend_from_slice(&[0u8; 4]);
+                            leaf.encode(&mut data);
+                            let len = (data.len() - start - 4) as u32;
+                            data[start..start + 4].copy_from_slice(&len.to_le_bytes());
+                        }
+                    }
+                    continue;
+                }
+                let (left, right) = (!branch.left.is_zero(), !branch.right.is_zero());
+                if left && right {
+                    pending.push((height - 1, right_key, Some(data.len())));
+                    data.extend_from_slice(&[0u8; 8]);
+                } else if right {
+                    pending.push((height - 1, right_key, None));
+                }
+                if left {
+                    pending.push((height - 1, node_key, None));
+                }
+            }
+        }
+
+        let mut buf = Vec::with_capacity(HEADER_SIZE + data.len());
+        buf.extend_from_slice(MAGIC);
+        buf.extend_from_slice(&(DEPTH as u16).to_le_bytes());
+        buf.extend_from_slice(self.root().as_slice());
+        buf.extend_from_slice(&(data.len() as u64).to_le_bytes());
+        buf.extend_from_slice(&data);
+        Ok(buf)
+    }
+}
@@ -68,6 +68,12 @@ impl H256 {
         }
     }
 
+    /// Treat H256 as a path in a tree of `depth` levels
+    /// return true if no bit at or above `depth` is set
+    pub fn is_within_depth(&self, depth: usize) -> bool {
+        depth >= 256 || self.parent_path((depth - 1) as u8).is_zero()
+    }
+
     /// Copy bits and return a new H256
     pub fn copy_bits(&self, start: u8) -> Self {
         let mut target = H256::zero();
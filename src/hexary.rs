@@ -0,0 +1,526 @@
+use crate::{
+    default_store::Map,
+    error::{Error, Result},
+    trace_store::{timed, TraceOp, TraceStore},
+    traits::{Hasher, Value},
+    tree::BranchKey,
+    vec::Vec,
+    H256,
+};
+use core::marker::PhantomData;
+
+/// Number of levels of a hexary tree, each level consumes 4 key bits
+pub const HEXARY_LEVELS: usize = 64;
+
+const HEXARY_LEAF: u8 = 5;
+const HEXARY_NODE: u8 = 6;
+
+/// Hash a leaf, a subtree holding a single leaf is represented by this hash
+pub fn hash_hexary_leaf<H: Hasher + Default>(key: &H256, value: &H256) -> H256 {
+    let mut hasher = H::default();
+    hasher.write_byte(HEXARY_LEAF);
+    hasher.write_h256(key);
+    hasher.write_h256(value);
+    hasher.finish()
+}
+
+/// Hash of a hexary node from its non-zero children.
+/// returns the hash and whether the node is a single leaf subtree
+fn hash_hexary_node<H: Hasher + Default>(
+    level: u8,
+    bitmap: u16,
+    leaf_bits: u16,
+    children: &[H256],
+) -> (H256, bool) {
+    if bitmap == 0 {
+        return (H256::zero(), false);
+    }
+    if bitmap.count_ones() == 1 && leaf_bits == bitmap {
+        return (children[0], true);
+    }
+    let mut hasher = H::default();
+    hasher.write_byte(HEXARY_NODE);
+    hasher.write_byte(level);
+    hasher.write_byte(bitmap as u8);
+    hasher.write_byte((bitmap >> 8) as u8);
+    for child in children {
+        hasher.write_h256(child);
+    }
+    (hasher.finish(), false)
+}
+
+/// Child index of key at level
+pub fn nibble(key: &H256, level: u8) -> u8 {
+    let byte = key.as_slice()[level as usize / 2];
+    (byte >> ((level % 2) * 4)) & 0x0f
+}
+
+/// Node key of the node at level which key belongs to
+pub fn hexary_node_key(key: &H256, level: u8) -> H256 {
+    key.parent_path(level * 4 + 3)
+}
+
+fn set_nibble(key: &mut H256, level: u8, index: u8) {
+    for bit in 0..4 {
+        if index & (1 << bit) != 0 {
+            key.set_bit(level * 4 + bit);
+        } else {
+            key.clear_bit(level * 4 + bit);
+        }
+    }
+}
+
+/// A node in the hexary tree, only non-zero children are kept
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct HexaryNode {
+    /// non-zero children
+    bitmap: u16,
+    /// children which are single leaf subtrees
+    leaf_bits: u16,
+    /// hashes of non-zero children, ordered by index
+    children: Vec<H256>,
+}
+
+impl HexaryNode {
+    pub fn bitmap(&self) -> u16 {
+        self.bitmap
+    }
+
+    pub fn leaf_bits(&self) -> u16 {
+        self.leaf_bits
+    }
+
+    /// Hashes of non-zero children, ordered by index
+    pub fn children(&self) -> &[H256] {
+        &self.children
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.bitmap == 0
+    }
+
+    fn position(&self, index: u8) -> usize {
+        (self.bitmap & ((1u16 << index) - 1)).count_ones() as usize
+    }
+
+    /// Return the child at index, zero if not exists
+    pub fn child(&self, index: u8) -> H256 {
+        if self.bitmap & (1 << index) == 0 {
+            return H256::zero();
+        }
+        self.children[self.position(index)]
+    }
+
+    /// Set the child at index, a zero hash removes it
+    pub fn set_child(&mut self, index: u8, hash: H256, is_leaf: bool) {
+        let bit = 1u16 << index;
+        let position = self.position(index);
+        let exists = self.bitmap & bit != 0;
+        if hash.is_zero() {
+            if exists {
+                self.children.remove(position);
+            }
+            self.bitmap &= !bit;
+            self.leaf_bits &= !bit;
+            return;
+        }
+        if exists {
+            self.children[position] = hash;
+        } else {
+            self.children.insert(position, hash);
+        }
+        self.bitmap |= bit;
+        if is_leaf {
+            self.leaf_bits |= bit;
+        } else {
+            self.leaf_bits &= !bit;
+        }
+    }
+
+    /// Hash of the node, and whether it is a single leaf subtree
+    pub fn hash<H: Hasher + Default>(&self, level: u8) -> (H256, bool) {
+        hash_hexary_node::<H>(level, self.bitmap, self.leaf_bits, &self.children)
+    }
+}
+
+/// Trait for customize backend storage of hexary trees
+pub trait HexaryStore<V> {
+    fn get_node(&self, node_key: &BranchKey) -> Result<Option<HexaryNode>>;
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>>;
+    fn insert_node(&mut self, node_key: BranchKey, node: HexaryNode) -> Result<()>;
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<()>;
+    fn remove_node(&mut self, node_key: &BranchKey) -> Result<()>;
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<()>;
+}
+
+#[derive(Debug, Clone, Default)]
+pub struct DefaultHexaryStore<V> {
+    nodes_map: Map<BranchKey, HexaryNode>,
+    leaves_map: Map<H256, V>,
+}
+
+impl<V> DefaultHexaryStore<V> {
+    pub fn nodes_map(&self) -> &Map<BranchKey, HexaryNode> {
+        &self.nodes_map
+    }
+    pub fn leaves_map(&self) -> &Map<H256, V> {
+        &self.leaves_map
+    }
+    pub fn clear(&mut self) {
+        self.nodes_map.clear();
+        self.leaves_map.clear();
+    }
+}
+
+impl<V: Clone> HexaryStore<V> for DefaultHexaryStore<V> {
+    fn get_node(&self, node_key: &BranchKey) -> Result<Option<HexaryNode>> {
+        Ok(self.nodes_map.get(node_key).map(Clone::clone))
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>> {
+        Ok(self.leaves_map.get(leaf_key).map(Clone::clone))
+    }
+    fn insert_node(&mut self, node_key: BranchKey, node: HexaryNode) -> Result<()> {
+        self.nodes_map.insert(node_key, node);
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<()> {
+        self.leaves_map.insert(leaf_key, leaf);
+        Ok(())
+    }
+    fn remove_node(&mut self, node_key: &BranchKey) -> Result<()> {
+        self.nodes_map.remove(node_key);
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<()> {
+        self.leaves_map.remove(leaf_key);
+        Ok(())
+    }
+}
+
+// nodes are traced as branches, the level is recorded as height
+impl<V, S: HexaryStore<V>> HexaryStore<V> for TraceStore<S> {
+    fn get_node(&self, node_key: &BranchKey) -> Result<Option<HexaryNode>> {
+        let (ret, latency) = timed(|| self.inner().get_node(node_key));
+        let hit = matches!(ret, Ok(Some(_)));
+        self.record(
+            TraceOp::GetBranch,
+            Some(node_key.height),
+            &node_key.node_key,
+            hit,
+            latency,
+        );
+        ret
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>> {
+        let (ret, latency) = timed(|| self.inner().get_leaf(leaf_key));
+        let hit = matches!(ret, Ok(Some(_)));
+        self.record(TraceOp::GetLeaf, None, leaf_key, hit, latency);
+        ret
+    }
+    fn insert_node(&mut self, node_key: BranchKey, node: HexaryNode) -> Result<()> {
+        let (height, key) = (node_key.height, node_key.node_key);
+        let inner = self.inner_mut();
+        let (ret, latency) = timed(|| inner.insert_node(node_key, node));
+        self.record(TraceOp::InsertBranch, Some(height), &key, true, latency);
+        ret
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<()> {
+        let inner = self.inner_mut();
+        let (ret, latency) = timed(|| inner.insert_leaf(leaf_key, leaf));
+        self.record(TraceOp::InsertLeaf, None, &leaf_key, true, latency);
+        ret
+    }
+    fn remove_node(&mut self, node_key: &BranchKey) -> Result<()> {
+        let inner = self.inner_mut();
+        let (ret, latency) = timed(|| inner.remove_node(node_key));
+        self.record(
+            TraceOp::RemoveBranch,
+            Some(node_key.height),
+            &node_key.node_key,
+            true,
+            latency,
+        );
+        ret
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<()> {
+        let inner = self.inner_mut();
+        let (ret, latency) = timed(|| inner.remove_leaf(leaf_key));
+        self.record(TraceOp::RemoveLeaf, None, leaf_key, true, latency);
+        ret
+    }
+}
+
+/// Sparse merkle tree with 16 children per node.
+///
+/// Every level consumes 4 key bits, so a path has 64 nodes instead of 256
+/// branches. Nodes only keep their non-zero children, and a subtree holding
+/// a single leaf is represented by the leaf hash, so sparse paths cost no
+/// hashing. Roots are not compatible with `SparseMerkleTree`.
+#[derive(Default, Debug)]
+pub struct HexarySparseMerkleTree<H, V, S> {
+    store: S,
+    root: H256,
+    phantom: PhantomData<(H, V)>,
+}
+
+impl<H: Hasher + Default, V: Value, S: HexaryStore<V>> HexarySparseMerkleTree<H, V, S> {
+    /// Build a merkle tree from root and store
+    pub fn new(root: H256, store: S) -> HexarySparseMerkleTree<H, V, S> {
+        HexarySparseMerkleTree {
+            root,
+            store,
+            phantom: PhantomData,
+        }
+    }
+
+    /// Merkle root
+    pub fn root(&self) -> &H256 {
+        &self.root
+    }
+
+    /// Check empty of the tree
+    pub fn is_empty(&self) -> bool {
+        self.root.is_zero()
+    }
+
+    /// Destroy current tree and retake store
+    pub fn take_store(self) -> S {
+        self.store
+    }
+
+    /// Get backend store
+    pub fn store(&self) -> &S {
+        &self.store
+    }
+
+    /// Get mutable backend store
+    pub fn store_mut(&mut self) -> &mut S {
+        &mut self.store
+    }
+
+    /// Update a leaf, return new merkle root
+    /// set to zero value to delete a key
+    pub fn update(&mut self, key: H256, value: V) -> Result<&H256> {
+        let value_hash = value.to_h256();
+        let (mut current, mut is_leaf) = if value_hash.is_zero() {
+            self.store.remove_leaf(&key)?;
+            (H256::zero(), false)
+        } else {
+            self.store.insert_leaf(key, value)?;
+            (hash_hexary_leaf::<H>(&key, &value_hash), true)
+        };
+
+        for level in 0..HEXARY_LEVELS as u8 {
+            let node_key = BranchKey::new(level, hexary_node_key(&key, level));
+            let mut node = self.store.get_node(&node_key)?.unwrap_or_default();
+            node.set_child(nibble(&key, level), current, is_leaf);
+            let (hash, leaf) = node.hash::<H>(level);
+            if node.is_empty() {
+                self.store.remove_node(&node_key)?;
+            } else {
+                self.store.insert_node(node_key, node)?;
+            }
+            current = hash;
+            is_leaf = leaf;
+        }
+
+        self.root = current;
+        Ok(&self.root)
+    }
+
+    /// Get value of a leaf
+    /// return zero value if leaf not exists
+    pub fn get(&self, key: &H256) -> Result<V> {
+        if self.is_empty() {
+            return Ok(V::zero());
+        }
+        Ok(self.store.get_leaf(key)?.unwrap_or_else(V::zero))
+    }
+
+    /// Generate a proof of a single key, works for both existing and
+    /// non-existing keys
+    pub fn merkle_proof(&self, key: &H256) -> Result<HexaryProof> {
+        let mut levels_mask = 0u64;
+        let mut body = Vec::new();
+        for level in 0..HEXARY_LEVELS as u8 {
+            let node_key = BranchKey::new(level, hexary_node_key(key, level));
+            let node = match self.store.get_node(&node_key)? {
+                Some(node) => node,
+                None => continue,
+            };
+            let own = 1u16 << nibble(key, level);
+            let siblings = node.bitmap & !own;
+            if siblings == 0 {
+                continue;
+            }
+            levels_mask |= 1 << level;
+            // the node collapses to the leaf hash, which commits to neither
+            // the level nor the index, so the leaf is given
+            let lone =
+                node.leaf_bits == siblings && node.bitmap == siblings && siblings.count_ones() == 1;
+            let leaf_bits = if lone {
+                siblings | own
+            } else {
+                node.leaf_bits & siblings
+            };
+            body.extend_from_slice(&siblings.to_le_bytes());
+            body.extend_from_slice(&leaf_bits.to_le_bytes());
+            if lone {
+                let (leaf_key, value_hash) =
+                    self.lone_leaf(key, level, siblings.trailing_zeros() as u8)?;
+                body.extend_from_slice(leaf_key.as_slice());
+                body.extend_from_slice(value_hash.as_slice());
+                continue;
+            }
+            for index in 0..16u8 {
+                if siblings & (1 << index) != 0 {
+                    body.extend_from_slice(node.child(index).as_slice());
+                }
+            }
+        }
+        let mut proof = Vec::with_capacity(8 + body.len());
+        proof.extend_from_slice(&levels_mask.to_le_bytes());
+        proof.extend(body);
+        Ok(HexaryProof(proof))
+    }
+
+    /// Key and value hash of the single leaf below index of the node at
+    /// level on the path of key
+    fn lone_leaf(&self, key: &H256, level: u8, index: u8) -> Result<(H256, H256)> {
+        let mut leaf_key = *key;
+        set_nibble(&mut leaf_key, level, index);
+        for lower in (0..level).rev() {
+            let node_key = hexary_node_key(&leaf_key, lower);
+            let node = self
+                .store
+                .get_node(&BranchKey::new(lower, node_key))?
+                .ok_or(Error::MissingBranch(lower, node_key))?;
+            set_nibble(&mut leaf_key, lower, node.bitmap.trailing_zeros() as u8);
+        }
+        let leaf = self
+            .store
+            .get_leaf(&leaf_key)?
+            .ok_or(Error::MissingLeaf(leaf_key))?;
+        Ok((leaf_key, leaf.to_h256()))
+    }
+}
+
+/// Proof of a single key in a hexary tree.
+///
+/// Layout: a u64 mask of levels with non-zero siblings, then for each of
+/// those levels from the bottom, a u16 bitmap of the siblings, a u16 bitmap
+/// of siblings which are single leaf subtrees and the sibling hashes
+/// ordered by index. Integers are little endian.
+///
+/// When the subtree of the key is empty and the only sibling is a single
+/// leaf subtree, the node collapses to the leaf hash. The bit of the key is
+/// then set in the leaf bitmap and the leaf key and value hash are given
+/// instead of the hash, the leaf key must lie below the sibling index, so a
+/// leaf can not be moved to another level or index.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct HexaryProof(pub Vec<u8>);
+
+impl HexaryProof {
+    /// Compute root from proof, a zero value proves the key does not exist
+    pub fn compute_root<H: Hasher + Default>(&self, key: &H256, value: &H256) -> Result<H256> {
+        let data = &self.0;
+        if data.len() < 8 {
+            return Err(Error::CorruptedProof);
+        }
+        let mut mask = [0u8; 8];
+        mask.copy_from_slice(&data[..8]);
+        let levels_mask = u64::from_le_bytes(mask);
+        let mut offset = 8;
+
+        let (mut current, mut is_leaf) = if value.is_zero() {
+            (H256::zero(), false)
+        } else {
+            (hash_hexary_leaf::<H>(key, value), true)
+        };
+        let mut children = Vec::with_capacity(16);
+        for level in 0..HEXARY_LEVELS as u8 {
+            let own = 1u16 << nibble(key, level);
+            let (mut bitmap, mut leaf_bits) = (0u16, 0u16);
+            children.clear();
+            if levels_mask & (1 << level) != 0 {
+                if offset + 4 > data.len() {
+                    return Err(Error::CorruptedProof);
+                }
+                bitmap = u16::from_le_bytes([data[offset], data[offset + 1]]);
+                leaf_bits = u16::from_le_bytes([data[offset + 2], data[offset + 3]]);
+                offset += 4;
+                // the own bit of the leaf bits marks a lone leaf given by key
+                let lone = leaf_bits & own != 0;
+                leaf_bits &= !own;
+                if bitmap == 0 || bitmap & own != 0 || leaf_bits & !bitmap != 0 {
+                    return Err(Error::CorruptedProof);
+                }
+                if lone {
+                    if leaf_bits != bitmap || bitmap.count_ones() != 1 || offset + 64 > data.len() {
+                        return Err(Error::CorruptedProof);
+                    }
+                    let mut leaf_key = [0u8; 32];
+                    leaf_key.copy_from_slice(&data[offset..offset + 32]);
+                    let mut value_hash = [0u8; 32];
+                    value_hash.copy_from_slice(&data[offset + 32..offset + 64]);
+                    offset += 64;
+                    let leaf_key = H256::from(leaf_key);
+                    let index = bitmap.trailing_zeros() as u8;
+                    if hexary_node_key(&leaf_key, level) != hexary_node_key(key, level)
+                        || nibble(&leaf_key, level) != index
+                    {
+                        return Err(Error::CorruptedProof);
+                    }
+                    children.push(hash_hexary_leaf::<H>(&leaf_key, &value_hash.into()));
+                } else {
+                    let end = offset + bitmap.count_ones() as usize * 32;
+                    if end > data.len() {
+                        return Err(Error::CorruptedProof);
+                    }
+                    for chunk in data[offset..end].chunks(32) {
+                        let mut hash = [0u8; 32];
+                        hash.copy_from_slice(chunk);
+                        children.push(H256::from(hash));
+                    }
+                    offset = end;
+                    if current.is_zero() {
+                        // a leaf hash not given by key must not collapse the
+                        // node, the hash of the full node matches no tree
+                        leaf_bits = 0;
+                    }
+                }
+            }
+            if !current.is_zero() {
+                let position = (bitmap & (own - 1)).count_ones() as usize;
+                children.insert(position, current);
+                bitmap |= own;
+                if is_leaf {
+                    leaf_bits |= own;
+                }
+            }
+            let (hash, leaf) = hash_hexary_node::<H>(level, bitmap, leaf_bits, &children);
+            current = hash;
+            is_leaf = leaf;
+        }
+        if offset != data.len() {
+            return Err(Error::CorruptedProof);
+        }
+        Ok(current)
+    }
+
+    /// Verify proof, a zero value proves the key does not exist
+    pub fn verify<H: Hasher + Default>(
+        &self,
+        root: &H256,
+        key: &H256,
+        value: &H256,
+    ) -> Result<bool> {
+        Ok(&self.compute_root::<H>(key, value)? == root)
+    }
+}
+
+impl From<HexaryProof> for Vec<u8> {
+    fn from(proof: HexaryProof) -> Vec<u8> {
+        proof.0
+    }
+}
@@ -0,0 +1,414 @@
+use crate::{
+    blake2b::Blake2bHasher,
+    default_store::Map,
+    error::{Error, Result},
+    merge::MergeValue,
+    merkle_proof::MerkleProof,
+    traits::{ForkHashes, Hasher, Store, Value},
+    tree::{BranchKey, BranchNode, SparseMerkleTree},
+    vec::Vec,
+    H256,
+};
+use core::marker::PhantomData;
+
+/// A store adapter keeps the past versions of every leaf and branch.
+///
+/// The current items are only kept by the inner store. The first write of
+/// a key in a version records the item it supersedes, each key maps to a
+/// list of (version, item) sorted by version, where item is the one before
+/// that version. A point-in-time read is a binary search, a key not written
+/// since the version is read from the inner store. With a retention of `n`,
+/// versions older than the last `n` ones are pruned from a key when it is
+/// written again, or by `prune_history` for all keys.
+///
+/// Past branches are content addressed: a branch is kept once in `nodes`
+/// under the hash of its content, with a count of the history entries
+/// referring to it, so retained versions share identical branches and
+/// each version only adds the branches it changed.
+#[derive(Debug, Clone)]
+pub struct HistoryStore<V, S, H = Blake2bHasher> {
+    inner: S,
+    // superseded leaves, zero for an absent leaf
+    leaves_history: Map<H256, Vec<(u64, V)>>,
+    // hashes of superseded nodes, None for an absent branch
+    branches_history: Map<BranchKey, Vec<(u64, Option<H256>)>>,
+    // content hash -> (branch, reference count)
+    nodes: Map<H256, (BranchNode, u64)>,
+    // roots of sealed versions from the oldest retained one
+    roots: Vec<(u64, H256)>,
+    version: u64,
+    retention: Option<u64>,
+    phantom: PhantomData<H>,
+}
+
+impl<V, S: Default, H> Default for HistoryStore<V, S, H> {
+    fn default() -> Self {
+        HistoryStore {
+            inner: S::default(),
+            leaves_history: Map::default(),
+            branches_history: Map::default(),
+            nodes: Map::default(),
+            roots: Vec::new(),
+            version: 0,
+            retention: None,
+            phantom: PhantomData,
+        }
+    }
+}
+
+impl<V: Value + Clone, S, H: Hasher + Default> HistoryStore<V, S, H> {
+    /// Wrap an empty store, keep all versions
+    pub fn new(inner: S) -> Self {
+        HistoryStore {
+            inner,
+            leaves_history: Map::default(),
+            branches_history: Map::default(),
+            nodes: Map::default(),
+            roots: Vec::new(),
+            version: 0,
+            retention: None,
+            phantom: PhantomData,
+        }
+    }
+
+    /// Wrap an empty store, keep the last `retention` versions
+    pub fn with_retention(inner: S, retention: u64) -> Self {
+        let mut store = Self::new(inner);
+        store.retention = Some(retention);
+        store
+    }
+
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+
+    pub fn leaves_history(&self) -> &Map<H256, Vec<(u64, V)>> {
+        &self.leaves_history
+    }
+
+    pub fn branches_history(&self) -> &Map<BranchKey, Vec<(u64, Option<H256>)>> {
+        &self.branches_history
+    }
+
+    /// Past branches by content hash, with their reference counts
+    pub fn nodes(&self) -> &Map<H256, (BranchNode, u64)> {
+        &self.nodes
+    }
+
+    /// Version the next writes are recorded at
+    pub fn version(&self) -> u64 {
+        self.version
+    }
+
+    /// Oldest version still readable
+    pub fn oldest_version(&self) -> u64 {
+        match self.retention {
+            Some(retention) => self.version.saturating_sub(retention),
+            None => 0,
+        }
+    }
+
+    /// Seal the current version with the root of the tree, return it
+    pub fn commit(&mut self, root: H256) -> u64 {
+        self.roots.push((self.version, root));
+        self.version += 1;
+        let oldest = self.oldest_version();
+        let n = self.roots.partition_point(|(v, _)| *v < oldest);
+        self.roots.drain(..n);
+        self.version - 1
+    }
+
+    /// Root of a sealed version
+    pub fn root_at(&self, version: u64) -> Result<H256> {
+        let n = self.roots.partition_point(|(v, _)| *v < version);
+        match self.roots.get(n) {
+            Some((v, root)) if *v == version => Ok(*root),
+            _ => Err(Error::VersionOutOfRange(version)),
+        }
+    }
+
+    fn check_version(&self, version: u64) -> Result<()> {
+        if version < self.oldest_version() || version > self.version {
+            return Err(Error::VersionOutOfRange(version));
+        }
+        Ok(())
+    }
+
+    /// Prune versions out of the retention from all keys
+    pub fn prune_history(&mut self) {
+        let oldest = self.oldest_version();
+        if oldest == 0 {
+            return;
+        }
+        self.leaves_history.retain(|_key, history| {
+            prune(history, oldest, drop);
+            !history.is_empty()
+        });
+        let nodes = &mut self.nodes;
+        self.branches_history.retain(|_key, history| {
+            prune(history, oldest, |hash| release(nodes, hash));
+            !history.is_empty()
+        });
+    }
+
+    /// Return true if the leaf is not written yet in the current version
+    fn is_first_leaf_write(&self, leaf_key: &H256) -> bool {
+        is_first_write(self.leaves_history.get(leaf_key), self.version)
+    }
+
+    /// Return true if the branch is not written yet in the current version
+    fn is_first_branch_write(&self, branch_key: &BranchKey) -> bool {
+        is_first_write(self.branches_history.get(branch_key), self.version)
+    }
+
+    /// Record the leaf superseded by the current version
+    fn record_leaf(&mut self, leaf_key: H256, leaf: V) {
+        let oldest = self.oldest_version();
+        let history = self.leaves_history.entry(leaf_key).or_default();
+        history.push((self.version, leaf));
+        prune(history, oldest, drop);
+        if history.is_empty() {
+            self.leaves_history.remove(&leaf_key);
+        }
+    }
+
+    /// Record the branch superseded by the current version
+    fn record_branch(&mut self, branch_key: &BranchKey, branch: Option<BranchNode>) {
+        let oldest = self.oldest_version();
+        let nodes = &mut self.nodes;
+        let hash = branch.map(|branch| {
+            let hash = content_hash::<H>(&branch);
+            nodes.entry(hash).or_insert((branch, 0)).1 += 1;
+            hash
+        });
+        let history = self.branches_history.entry(branch_key.clone()).or_default();
+        history.push((self.version, hash));
+        prune(history, oldest, |hash| release(nodes, hash));
+        if history.is_empty() {
+            self.branches_history.remove(branch_key);
+        }
+    }
+}
+
+impl<V: Value + Clone, S: Store<V>, H: Hasher + Default> HistoryStore<V, S, H> {
+    /// Record the current branch before the first write in the version
+    fn supersede_branch(&mut self, branch_key: &BranchKey) -> Result<()> {
+        if self.is_first_branch_write(branch_key) {
+            let old = self.inner.get_branch(branch_key)?;
+            self.record_branch(branch_key, old);
+        }
+        Ok(())
+    }
+
+    /// Record the current leaf before the first write in the version
+    fn supersede_leaf(&mut self, leaf_key: &H256) -> Result<()> {
+        if self.is_first_leaf_write(leaf_key) {
+            let old = self.inner.get_leaf(leaf_key)?;
+            self.record_leaf(*leaf_key, old.unwrap_or_else(V::zero));
+        }
+        Ok(())
+    }
+
+    /// Value of a leaf at a version, zero if the leaf did not exist
+    pub fn get_at(&self, leaf_key: &H256, version: u64) -> Result<V> {
+        self.check_version(version)?;
+        match self
+            .leaves_history
+            .get(leaf_key)
+            .and_then(|history| lookup(history, version))
+        {
+            Some(leaf) => Ok(leaf.clone()),
+            None => Ok(self.inner.get_leaf(leaf_key)?.unwrap_or_else(V::zero)),
+        }
+    }
+
+    /// A branch at a version
+    pub fn get_branch_at(
+        &self,
+        branch_key: &BranchKey,
+        version: u64,
+    ) -> Result<Option<BranchNode>> {
+        self.check_version(version)?;
+        let hash = match self
+            .branches_history
+            .get(branch_key)
+            .and_then(|history| lookup(history, version))
+        {
+            Some(Some(hash)) => hash,
+            Some(None) => return Ok(None),
+            None => return self.inner.get_branch(branch_key),
+        };
+        match self.nodes.get(hash) {
+            Some((branch, _refs)) => Ok(Some(branch.clone())),
+            None => Err(Error::MissingBranch(branch_key.height, branch_key.node_key)),
+        }
+    }
+}
+
+/// Hash of the content of a branch, children are hashed by their fields
+fn content_hash<H: Hasher + Default>(branch: &BranchNode) -> H256 {
+    let mut hasher = H::default();
+    for child in &[&branch.left, &branch.right] {
+        match child {
+            MergeValue::Value(v) => {
+                hasher.write_byte(0);
+                hasher.write_h256(v);
+            }
+            MergeValue::MergeWithZero {
+                base_node,
+                zero_bits,
+                zero_count,
+            } => {
+                hasher.write_byte(1);
+                hasher.write_h256(base_node);
+                hasher.write_h256(zero_bits);
+                hasher.write_byte(*zero_count);
+            }
+        }
+    }
+    hasher.finish()
+}
+
+/// Drop a reference to a node, remove the node with the last one
+fn release(nodes: &mut Map<H256, (BranchNode, u64)>, hash: Option<H256>) {
+    if let Some(hash) = hash {
+        if let Some((_branch, refs)) = nodes.get_mut(&hash) {
+            *refs -= 1;
+            if *refs == 0 {
+                nodes.remove(&hash);
+            }
+        }
+    }
+}
+
+/// Return true if a key has no item superseded by the current version
+fn is_first_write<T>(history: Option<&Vec<(u64, T)>>, version: u64) -> bool {
+    history.and_then(|history| history.last()).map(|(v, _)| *v) != Some(version)
+}
+
+/// The item of a history at a version, None if the current item is
+fn lookup<T>(history: &[(u64, T)], version: u64) -> Option<&T> {
+    // the first item superseded after the version
+    let n = history.partition_point(|(v, _)| *v <= version);
+    history.get(n).map(|(_v, item)| item)
+}
+
+/// Drop entries not needed by reads at or after the oldest version,
+/// pass the dropped items to `release`
+fn prune<T>(history: &mut Vec<(u64, T)>, oldest: u64, mut release: impl FnMut(T)) {
+    // items superseded at or before the oldest version
+    let n = history.partition_point(|(v, _)| *v <= oldest);
+    for (_version, item) in history.drain(..n) {
+        release(item);
+    }
+}
+
+impl<V: Value + Clone, S: Store<V>, H: Hasher + Default> Store<V> for HistoryStore<V, S, H> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>> {
+        self.inner.get_branch(branch_key)
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>> {
+        self.inner.get_leaf(leaf_key)
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<()> {
+        self.supersede_branch(&branch_key)?;
+        self.inner.insert_branch(branch_key, branch)
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<()> {
+        self.supersede_leaf(&leaf_key)?;
+        self.inner.insert_leaf(leaf_key, leaf)
+    }
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, hash: H256) -> Result<()> {
+        self.supersede_leaf(&leaf_key)?;
+        self.inner.insert_leaf_with_hash(leaf_key, leaf, hash)
+    }
+    // removing an absent item changes nothing to record
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<()> {
+        if self.is_first_branch_write(branch_key) {
+            if let Some(old) = self.inner.get_branch(branch_key)? {
+                self.record_branch(branch_key, Some(old));
+            }
+        }
+        self.inner.remove_branch(branch_key)
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<()> {
+        if self.is_first_leaf_write(leaf_key) {
+            if let Some(old) = self.inner.get_leaf(leaf_key)? {
+                self.record_leaf(*leaf_key, old);
+            }
+        }
+        self.inner.remove_leaf(leaf_key)
+    }
+    fn keeps_leaf_counts(&self) -> bool {
+        self.inner.keeps_leaf_counts()
+    }
+    fn get_leaf_count(&self, branch_key: &BranchKey) -> Result<u64> {
+        self.inner.get_leaf_count(branch_key)
+    }
+    fn insert_leaf_count(&mut self, branch_key: BranchKey, count: u64) -> Result<()> {
+        self.inner.insert_leaf_count(branch_key, count)
+    }
+    // fork hashes are kept for the current branches only
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>> {
+        self.inner.get_branch_with_hashes(branch_key)
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<()> {
+        self.supersede_branch(&branch_key)?;
+        self.inner
+            .insert_branch_with_hashes(branch_key, branch, hashes)
+    }
+}
+
+impl<H, V, S, NH, const DEPTH: usize> SparseMerkleTree<H, V, HistoryStore<V, S, NH>, DEPTH>
+where
+    H: Hasher + Default,
+    NH: Hasher + Default,
+    V: Value + Clone,
+    S: Store<V>,
+{
+    /// Seal the current version of the tree, return it
+    pub fn commit_version(&mut self) -> Result<u64> {
+        let root = *self.root();
+        Ok(self.store_mut().commit(root))
+    }
+
+    /// Value of a leaf at a version, zero if the leaf did not exist.
+    /// The current version reads the uncommitted state
+    pub fn get_at(&self, key: &H256, version: u64) -> Result<V> {
+        if version == self.store().version() {
+            return self.get(key);
+        }
+        self.store().get_at(key, version)
+    }
+
+    /// Root of a version
+    pub fn root_at(&self, version: u64) -> Result<H256> {
+        if version == self.store().version() {
+            return Ok(*self.root());
+        }
+        self.store().root_at(version)
+    }
+
+    /// Generate merkle proof against the root of a version,
+    /// from the branches as they were at that version
+    pub fn merkle_proof_at(&self, version: u64, keys: Vec<H256>) -> Result<MerkleProof> {
+        if version == self.store().version() {
+            return self.merkle_proof(keys);
+        }
+        let store = self.store();
+        store.check_version(version)?;
+        self.merkle_proof_with(keys, |branch_key| store.get_branch_at(branch_key, version))
+    }
+}
@@ -0,0 +1,264 @@
+use crate::{
+    error::Error,
+    traits::{ForkHashes, Store},
+    tree::{BranchKey, BranchNode},
+    vec,
+    vec::Vec,
+    H256,
+};
+
+/// Deepest number of dense levels, the last one takes 2^23 slots
+pub const MAX_DENSE_LEVELS: usize = 24;
+
+/// A store adapter keeps the top levels of the tree in dense arrays.
+///
+/// Under random keys the levels near the root are almost fully populated,
+/// there a branch is found by indexing an array with the bits of its path
+/// instead of hashing its key into the inner map. Level `i` counted from the
+/// root holds `2^i` slots, the children of slot `p` are slots `2p` and
+/// `2p + 1` of the next level.
+///
+/// The store starts without dense levels, `adapt` chooses how many to keep
+/// from the occupancy of the levels and moves branches between the arrays
+/// and the inner store. `DEPTH` must be the depth of the tree.
+///
+/// Leaf counts of the dense branches stay in the inner store, they are
+/// carried over when a branch moves between the two layouts.
+#[derive(Debug, Clone, Default)]
+pub struct HybridStore<S, const DEPTH: usize = 256> {
+    inner: S,
+    // dense levels from the root
+    levels: Vec<Vec<Option<BranchNode>>>,
+    // number of branches in each dense level
+    occupied: Vec<usize>,
+}
+
+impl<S, const DEPTH: usize> HybridStore<S, DEPTH> {
+    /// Height of the root branch
+    const ROOT_HEIGHT: u8 = {
+        assert!(DEPTH > 0 && DEPTH <= 256, "tree depth must be 1..=256");
+        (DEPTH - 1) as u8
+    };
+
+    /// Wrap a store, all branches stay in the inner store until `adapt`
+    pub fn new(inner: S) -> Self {
+        HybridStore {
+            inner,
+            levels: Vec::new(),
+            occupied: Vec::new(),
+        }
+    }
+
+    /// The inner store, it does not hold the branches of the dense levels
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+
+    /// Number of levels kept in dense arrays
+    pub fn dense_levels(&self) -> usize {
+        self.levels.len()
+    }
+
+    /// Number of branches in each dense level, from the root
+    pub fn occupied(&self) -> &[usize] {
+        &self.occupied
+    }
+
+    /// Dense level and slot of a branch, None if it is in the inner store
+    fn slot(&self, branch_key: &BranchKey) -> Option<(usize, usize)> {
+        let level = Self::ROOT_HEIGHT.checked_sub(branch_key.height)? as usize;
+        if level >= self.levels.len() || !branch_key.node_key.is_within_depth(DEPTH) {
+            return None;
+        }
+        let mut index = 0;
+        for i in 0..level {
+            index = index << 1 | branch_key.node_key.get_bit(Self::ROOT_HEIGHT - i as u8) as usize;
+        }
+        Some((level, index))
+    }
+
+    /// Node key of a slot
+    fn node_key(level: usize, index: usize) -> H256 {
+        let mut node_key = H256::zero();
+        for i in 0..level {
+            if index >> (level - 1 - i) & 1 == 1 {
+                node_key.set_bit(Self::ROOT_HEIGHT - i as u8);
+            }
+        }
+        node_key
+    }
+
+    /// Move the branches of the dense levels back to the inner store and
+    /// return it
+    pub fn into_inner<V>(mut self) -> Result<S, Error>
+    where
+        S: Store<V>,
+    {
+        while !self.levels.is_empty() {
+            self.demote::<V>()?;
+        }
+        Ok(self.inner)
+    }
+
+    /// Choose the dense levels from the current occupancy: the next level
+    /// is made dense once half of its slots are used, the deepest dense
+    /// level goes back to the inner store below a quarter, so a level does
+    /// not flip between the two layouts. Return the number of dense levels.
+    pub fn adapt<V>(&mut self) -> Result<usize, Error>
+    where
+        S: Store<V>,
+    {
+        while let Some(&occupied) = self.occupied.last() {
+            if occupied * 4 >= 1 << (self.occupied.len() - 1) {
+                break;
+            }
+            self.demote::<V>()?;
+        }
+        while self.levels.len() < MAX_DENSE_LEVELS.min(DEPTH) {
+            let level = self.levels.len();
+            let keys = self.next_level_keys();
+            let count = if level == 0 {
+                let root_key = BranchKey::new(Self::ROOT_HEIGHT, H256::zero());
+                self.inner.get_branch(&root_key)?.is_some() as usize
+            } else {
+                keys.len()
+            };
+            if count * 2 < 1 << level {
+                break;
+            }
+            let mut slots = vec![None; 1 << level];
+            let mut occupied = 0;
+            for (index, node_key) in keys {
+                let branch_key = BranchKey::new(Self::ROOT_HEIGHT - level as u8, node_key);
+                if let Some(branch) = self.inner.get_branch(&branch_key)? {
+                    let count = self.inner.get_leaf_count(&branch_key)?;
+                    self.inner.remove_branch(&branch_key)?;
+                    self.inner.insert_leaf_count(branch_key, count)?;
+                    slots[index] = Some(branch);
+                    occupied += 1;
+                }
+            }
+            self.levels.push(slots);
+            self.occupied.push(occupied);
+        }
+        Ok(self.levels.len())
+    }
+
+    /// Slots and node keys of the branches of the level below the dense ones
+    fn next_level_keys(&self) -> Vec<(usize, H256)> {
+        let level = match self.levels.last() {
+            Some(level) => level,
+            None => return vec![(0, H256::zero())],
+        };
+        let child_level = self.levels.len();
+        let mut keys = Vec::new();
+        for (index, slot) in level.iter().enumerate() {
+            if let Some(branch) = slot {
+                for (right, child) in [(0, &branch.left), (1, &branch.right)].iter() {
+                    if !child.is_zero() {
+                        let child_index = index << 1 | right;
+                        keys.push((child_index, Self::node_key(child_level, child_index)));
+                    }
+                }
+            }
+        }
+        keys
+    }
+
+    /// Move the deepest dense level back to the inner store
+    fn demote<V>(&mut self) -> Result<(), Error>
+    where
+        S: Store<V>,
+    {
+        let level = self.levels.len() - 1;
+        let height = Self::ROOT_HEIGHT - level as u8;
+        let slots = self.levels.pop().expect("dense level");
+        self.occupied.pop();
+        for (index, slot) in slots.into_iter().enumerate() {
+            if let Some(branch) = slot {
+                let branch_key = BranchKey::new(height, Self::node_key(level, index));
+                let count = self.inner.get_leaf_count(&branch_key)?;
+                self.inner.insert_branch(branch_key.clone(), branch)?;
+                self.inner.insert_leaf_count(branch_key, count)?;
+            }
+        }
+        Ok(())
+    }
+}
+
+impl<V, S: Store<V>, const DEPTH: usize> Store<V> for HybridStore<S, DEPTH> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        match self.slot(branch_key) {
+            Some((level, index)) => Ok(self.levels[level][index].clone()),
+            None => self.inner.get_branch(branch_key),
+        }
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>, Error> {
+        self.inner.get_leaf(leaf_key)
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        match self.slot(&branch_key) {
+            Some((level, index)) => {
+                if self.levels[level][index].replace(branch).is_none() {
+                    self.occupied[level] += 1;
+                }
+                Ok(())
+            }
+            None => self.inner.insert_branch(branch_key, branch),
+        }
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error> {
+        self.inner.insert_leaf(leaf_key, leaf)
+    }
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, hash: H256) -> Result<(), Error> {
+        self.inner.insert_leaf_with_hash(leaf_key, leaf, hash)
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
+        match self.slot(branch_key) {
+            Some((level, index)) => {
+                if self.levels[level][index].take().is_some() {
+                    self.occupied[level] -= 1;
+                }
+                self.inner.insert_leaf_count(branch_key.clone(), 0)
+            }
+            None => self.inner.remove_branch(branch_key),
+        }
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        self.inner.remove_leaf(leaf_key)
+    }
+    fn keeps_leaf_counts(&self) -> bool {
+        self.inner.keeps_leaf_counts()
+    }
+    fn get_leaf_count(&self, branch_key: &BranchKey) -> Result<u64, Error> {
+        self.inner.get_leaf_count(branch_key)
+    }
+    fn insert_leaf_count(&mut self, branch_key: BranchKey, count: u64) -> Result<(), Error> {
+        self.inner.insert_leaf_count(branch_key, count)
+    }
+    // dense slots hold branches only, fork hashes are kept by the inner store
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>, Error> {
+        match self.slot(branch_key) {
+            Some((level, index)) => Ok(self.levels[level][index]
+                .clone()
+                .map(|branch| (branch, [None, None]))),
+            None => self.inner.get_branch_with_hashes(branch_key),
+        }
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<(), Error> {
+        match self.slot(&branch_key) {
+            Some(_) => self.insert_branch(branch_key, branch),
+            None => self
+                .inner
+                .insert_branch_with_hashes(branch_key, branch, hashes),
+        }
+    }
+}
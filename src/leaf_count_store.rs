@@ -0,0 +1,113 @@
+use crate::{
+    default_store::Map,
+    error::Error,
+    traits::{ForkHashes, Hasher, Store, Value},
+    tree::{rebuild_leaf_counts, BranchKey, BranchNode, SparseMerkleTree},
+    H256,
+};
+
+/// A store adapter keeps the number of leaves under every branch of the
+/// inner store, so `SparseMerkleTree::count_range` and `nth_key` visit one
+/// path instead of scanning the leaves.
+///
+/// Counts are kept out of the branches, the hash commitment is unchanged.
+#[derive(Debug, Clone, Default)]
+pub struct LeafCountStore<S> {
+    inner: S,
+    counts: Map<BranchKey, u64>,
+}
+
+impl<S> LeafCountStore<S> {
+    /// Wrap an empty store, counts of existing branches are not rebuilt,
+    /// see `SparseMerkleTree::with_leaf_counts` for a filled store
+    pub fn new(inner: S) -> Self {
+        LeafCountStore {
+            inner,
+            counts: Map::default(),
+        }
+    }
+
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+
+    pub fn counts(&self) -> &Map<BranchKey, u64> {
+        &self.counts
+    }
+}
+
+impl<V, S: Store<V>> Store<V> for LeafCountStore<S> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        self.inner.get_branch(branch_key)
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>, Error> {
+        self.inner.get_leaf(leaf_key)
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        self.inner.insert_branch(branch_key, branch)
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error> {
+        self.inner.insert_leaf(leaf_key, leaf)
+    }
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, hash: H256) -> Result<(), Error> {
+        self.inner.insert_leaf_with_hash(leaf_key, leaf, hash)
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
+        self.counts.remove(branch_key);
+        self.inner.remove_branch(branch_key)
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        self.inner.remove_leaf(leaf_key)
+    }
+    fn keeps_leaf_counts(&self) -> bool {
+        true
+    }
+    fn get_leaf_count(&self, branch_key: &BranchKey) -> Result<u64, Error> {
+        Ok(self.counts.get(branch_key).copied().unwrap_or(0))
+    }
+    fn insert_leaf_count(&mut self, branch_key: BranchKey, count: u64) -> Result<(), Error> {
+        if count == 0 {
+            self.counts.remove(&branch_key);
+        } else {
+            self.counts.insert(branch_key, count);
+        }
+        Ok(())
+    }
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>, Error> {
+        self.inner.get_branch_with_hashes(branch_key)
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<(), Error> {
+        self.inner
+            .insert_branch_with_hashes(branch_key, branch, hashes)
+    }
+}
+
+impl<H, V, S, const DEPTH: usize> SparseMerkleTree<H, V, LeafCountStore<S>, DEPTH>
+where
+    H: Hasher + Default,
+    V: Value,
+    S: Store<V>,
+{
+    /// Keep leaf counts for an existing tree, the leaves under every branch
+    /// are counted once
+    pub fn with_leaf_counts(tree: SparseMerkleTree<H, V, S, DEPTH>) -> Result<Self, Error> {
+        let root = *tree.root();
+        let mut store = LeafCountStore::new(tree.take_store());
+        if !root.is_zero() {
+            rebuild_leaf_counts(&mut store, Self::ROOT_HEIGHT, H256::zero())?;
+        }
+        Ok(Self::new(root, store))
+    }
+}
@@ -62,18 +62,33 @@
 #![cfg_attr(not(feature = "std"), no_std)]
 
 pub mod blake2b;
+pub mod checkpoint;
 pub mod ckb_smt;
+pub mod compact_store;
 pub mod default_store;
+pub mod detach_store;
 pub mod error;
+pub mod export;
+pub mod frozen;
 pub mod h256;
+pub mod hexary;
+pub mod history;
+pub mod hybrid_store;
+pub mod leaf_count_store;
 pub mod merge;
 pub mod merkle_proof;
+pub mod multi_tree;
+pub mod segment_store;
+pub mod snapshot;
+pub mod stats;
 #[cfg(test)]
 mod tests;
+pub mod trace_store;
 pub mod traits;
 pub mod tree;
+pub mod value_log;
 
-pub use ckb_smt::{SMTBuilder, SMT};
+pub use ckb_smt::{SMTBuilder, SMTTiming, SMT};
 pub use h256::H256;
 pub use merkle_proof::{CompiledMerkleProof, MerkleProof};
 pub use tree::SparseMerkleTree;
@@ -85,11 +100,13 @@ pub(crate) const MAX_STACK_SIZE: usize = 257;
 
 cfg_if::cfg_if! {
     if #[cfg(feature = "std")] {
+        use std::boxed;
         use std::collections;
         use std::vec;
         use std::string;
     } else {
         extern crate alloc;
+        use alloc::boxed;
         use alloc::collections;
         use alloc::vec;
         use alloc::string;
@@ -1,8 +1,9 @@
 use crate::h256::H256;
-use crate::traits::Hasher;
+use crate::traits::{ForkHashes, Hasher};
 
 const MERGE_NORMAL: u8 = 1;
 const MERGE_ZEROS: u8 = 2;
+const MERGE_DEPTH: u8 = 3;
 
 #[derive(Debug, Eq, PartialEq, Clone)]
 pub enum MergeValue {
@@ -37,18 +38,24 @@ impl MergeValue {
                 base_node,
                 zero_bits,
                 zero_count,
-            } => {
-                let mut hasher = H::default();
-                hasher.write_byte(MERGE_ZEROS);
-                hasher.write_h256(base_node);
-                hasher.write_h256(zero_bits);
-                hasher.write_byte(*zero_count);
-                hasher.finish()
-            }
+            } => hash_merge_with_zero::<H>(base_node, zero_bits, *zero_count),
         }
     }
 }
 
+fn hash_merge_with_zero<H: Hasher + Default>(
+    base_node: &H256,
+    zero_bits: &H256,
+    zero_count: u8,
+) -> H256 {
+    let mut hasher = H::default();
+    hasher.write_byte(MERGE_ZEROS);
+    hasher.write_h256(base_node);
+    hasher.write_h256(zero_bits);
+    hasher.write_byte(zero_count);
+    hasher.finish()
+}
+
 /// Hash base node into a H256
 pub fn hash_base_node<H: Hasher + Default>(
     base_height: u8,
@@ -62,6 +69,20 @@ pub fn hash_base_node<H: Hasher + Default>(
     hasher.finish()
 }
 
+/// Hash the top node of a tree of `depth` levels into the root.
+/// A tree of 256 levels keeps the top node hash as root, a shallower tree
+/// tags the root with its depth, so roots of different depths never collide.
+pub fn depth_root<H: Hasher + Default>(depth: usize, top: &MergeValue) -> H256 {
+    if depth >= 256 || top.is_zero() {
+        return top.hash::<H>();
+    }
+    let mut hasher = H::default();
+    hasher.write_byte(MERGE_DEPTH);
+    hasher.write_byte(depth as u8);
+    hasher.write_h256(&top.hash::<H>());
+    hasher.finish()
+}
+
 /// Merge two hash with node information
 /// this function optimized for ZERO_HASH
 /// if lhs and rhs both are ZERO_HASH return ZERO_HASH, otherwise hash all info.
@@ -89,6 +110,35 @@ pub fn merge<H: Hasher + Default>(
     MergeValue::Value(hasher.finish())
 }
 
+/// Merge the two non-zero children of a fork. `hashes` are the known
+/// hashes of MergeWithZero children, the others are hashed here; return the
+/// parent along with the hashes of the MergeWithZero children, to be kept
+/// beside the branch by a store keeping fork hashes
+pub(crate) fn merge_fork<H: Hasher + Default>(
+    height: u8,
+    node_key: &H256,
+    lhs: &MergeValue,
+    rhs: &MergeValue,
+    hashes: ForkHashes,
+) -> (MergeValue, ForkHashes) {
+    let child_hash = |value: &MergeValue, hash: Option<H256>| match value {
+        MergeValue::Value(v) => (*v, None),
+        MergeValue::MergeWithZero { .. } => {
+            let hash = hash.unwrap_or_else(|| value.hash::<H>());
+            (hash, Some(hash))
+        }
+    };
+    let (lhs_hash, lhs_cached) = child_hash(lhs, hashes[0]);
+    let (rhs_hash, rhs_cached) = child_hash(rhs, hashes[1]);
+    let mut hasher = H::default();
+    hasher.write_byte(MERGE_NORMAL);
+    hasher.write_byte(height);
+    hasher.write_h256(node_key);
+    hasher.write_h256(&lhs_hash);
+    hasher.write_h256(&rhs_hash);
+    (MergeValue::Value(hasher.finish()), [lhs_cached, rhs_cached])
+}
+
 fn merge_with_zero<H: Hasher + Default>(
     height: u8,
     node_key: &H256,
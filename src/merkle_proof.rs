@@ -1,6 +1,6 @@
 use crate::{
     error::{Error, Result},
-    merge::{merge, MergeValue},
+    merge::{depth_root, merge, MergeValue},
     traits::Hasher,
     vec::Vec,
     H256, MAX_STACK_SIZE,
@@ -12,6 +12,8 @@ pub struct MerkleProof {
     leaves_bitmap: Vec<H256>,
     // needed sibling node hash
     merkle_path: Vec<MergeValue>,
+    // number of levels of the tree
+    depth: usize,
 }
 
 impl MerkleProof {
@@ -19,9 +21,19 @@ impl MerkleProof {
     /// leaves_bitmap: leaf bitmap, bitmap.get_bit(height) is true means there need a non zero sibling in this height
     /// proof: needed sibling node hash
     pub fn new(leaves_bitmap: Vec<H256>, merkle_path: Vec<MergeValue>) -> Self {
+        Self::new_with_depth(256, leaves_bitmap, merkle_path)
+    }
+
+    /// Create MerkleProof of a tree with `depth` levels
+    pub fn new_with_depth(
+        depth: usize,
+        leaves_bitmap: Vec<H256>,
+        merkle_path: Vec<MergeValue>,
+    ) -> Self {
         MerkleProof {
             leaves_bitmap,
             merkle_path,
+            depth,
         }
     }
 
@@ -30,6 +42,7 @@ impl MerkleProof {
         let MerkleProof {
             leaves_bitmap,
             merkle_path,
+            ..
         } = self;
         (leaves_bitmap, merkle_path)
     }
@@ -49,6 +62,11 @@ impl MerkleProof {
         &self.merkle_path
     }
 
+    /// number of levels of the tree this proof comes from
+    pub fn depth(&self) -> usize {
+        self.depth
+    }
+
     pub fn compile(self, mut leaves_keys: Vec<H256>) -> Result<CompiledMerkleProof> {
         if leaves_keys.is_empty() {
             return Err(Error::EmptyKeys);
@@ -57,10 +75,16 @@ impl MerkleProof {
                 expected: self.leaves_count(),
                 actual: leaves_keys.len(),
             });
+        } else if self.depth == 0 || self.depth > 256 {
+            return Err(Error::CorruptedProof);
+        }
+        if let Some(key) = leaves_keys.iter().find(|k| !k.is_within_depth(self.depth)) {
+            return Err(Error::KeyOutOfRange(*key));
         }
         // sort leaves keys
         leaves_keys.sort_unstable();
 
+        let root_height = (self.depth - 1) as u8;
         let (leaves_bitmap, merkle_path) = self.take();
 
         let mut proof: Vec<u8> = Vec::with_capacity(merkle_path.len() * 33 + leaves_keys.len());
@@ -73,7 +97,7 @@ impl MerkleProof {
             let fork_height = if leaf_index + 1 < leaves_keys.len() {
                 leaf_key.fork_height(&leaves_keys[leaf_index + 1])
             } else {
-                core::u8::MAX
+                root_height
             };
             proof.push(0x4C);
             let mut zero_count = 0u16;
@@ -162,8 +186,9 @@ impl MerkleProof {
     /// return EmptyProof error when proof is empty
     /// return CorruptedProof error when proof is invalid
     pub fn compute_root<H: Hasher + Default>(self, leaves: Vec<(H256, H256)>) -> Result<H256> {
+        let depth = self.depth;
         self.compile(leaves.iter().map(|(key, _value)| *key).collect())?
-            .compute_root::<H>(leaves)
+            .compute_root_with_depth::<H>(depth, leaves)
     }
 
     /// Verify merkle proof
@@ -183,7 +208,23 @@ impl MerkleProof {
 pub struct CompiledMerkleProof(pub Vec<u8>);
 
 impl CompiledMerkleProof {
-    pub fn compute_root<H: Hasher + Default>(&self, mut leaves: Vec<(H256, H256)>) -> Result<H256> {
+    pub fn compute_root<H: Hasher + Default>(&self, leaves: Vec<(H256, H256)>) -> Result<H256> {
+        self.compute_root_with_depth::<H>(256, leaves)
+    }
+
+    /// Compute root of a tree with `depth` levels,
+    /// the proof is compiled the same way for every depth
+    pub fn compute_root_with_depth<H: Hasher + Default>(
+        &self,
+        depth: usize,
+        mut leaves: Vec<(H256, H256)>,
+    ) -> Result<H256> {
+        if depth == 0 || depth > 256 {
+            return Err(Error::CorruptedProof);
+        }
+        if let Some((key, _value)) = leaves.iter().find(|(k, _v)| !k.is_within_depth(depth)) {
+            return Err(Error::KeyOutOfRange(*key));
+        }
         leaves.sort_unstable_by_key(|(k, _v)| *k);
         let mut program_index = 0;
         let mut leaf_index = 0;
@@ -286,6 +327,10 @@ impl CompiledMerkleProof {
                     if parent_key_a != parent_key_b {
                         return Err(Error::CorruptedProof);
                     }
+                    // 2 keys must be on different sides
+                    if key_a.get_bit(height) == key_b.get_bit(height) {
+                        return Err(Error::CorruptedProof);
+                    }
                     let parent = if key_a.get_bit(height) {
                         merge::<H>(height, &parent_key_a, &value_b, &value_a)
                     } else {
@@ -332,13 +377,13 @@ impl CompiledMerkleProof {
         if stack.len() != 1 {
             return Err(Error::CorruptedStack);
         }
-        if stack[0].0 != 256 {
+        if stack[0].0 as usize != depth {
             return Err(Error::CorruptedProof);
         }
         if leaf_index != leaves.len() {
             return Err(Error::CorruptedProof);
         }
-        Ok(stack[0].2.hash::<H>())
+        Ok(depth_root::<H>(depth, &stack[0].2))
     }
 
     pub fn verify<H: Hasher + Default>(
@@ -349,6 +394,16 @@ impl CompiledMerkleProof {
         let calculated_root = self.compute_root::<H>(leaves)?;
         Ok(&calculated_root == root)
     }
+
+    pub fn verify_with_depth<H: Hasher + Default>(
+        &self,
+        depth: usize,
+        root: &H256,
+        leaves: Vec<(H256, H256)>,
+    ) -> Result<bool> {
+        let calculated_root = self.compute_root_with_depth::<H>(depth, leaves)?;
+        Ok(&calculated_root == root)
+    }
 }
 
 impl From<CompiledMerkleProof> for Vec<u8> {
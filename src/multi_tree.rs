@@ -0,0 +1,279 @@
+use crate::{
+    default_store::Map,
+    error::Result,
+    traits::{Hasher, Store, Value},
+    tree::{BranchKey, BranchNode, SparseMerkleTree},
+    vec::Vec,
+    H256,
+};
+
+/// Identifier of a tree in a `MultiTreeStore`
+pub type Namespace = H256;
+
+/// Many trees sharing one node table.
+///
+/// Nodes are keyed by the namespace of their tree, so all trees share the
+/// same maps instead of one store per tree. Updates are computed into
+/// `NamespaceStore` overlays without touching the table and written by
+/// `apply` in one step: a batch over many trees either lands entirely or not
+/// at all, and the `TreeChanges` of a batch are the single record to log
+/// before applying it.
+#[derive(Debug, Clone)]
+pub struct MultiTreeStore<V> {
+    branches_map: Map<(Namespace, BranchKey), BranchNode>,
+    leaves_map: Map<(Namespace, H256), V>,
+    roots: Map<Namespace, H256>,
+}
+
+impl<V> Default for MultiTreeStore<V> {
+    fn default() -> Self {
+        MultiTreeStore {
+            branches_map: Map::default(),
+            leaves_map: Map::default(),
+            roots: Map::default(),
+        }
+    }
+}
+
+/// Writes to one tree of a `MultiTreeStore`, None removes the item
+#[derive(Debug, Clone)]
+pub struct TreeChanges<V> {
+    pub namespace: Namespace,
+    pub root: H256,
+    pub branches: Map<BranchKey, Option<BranchNode>>,
+    pub leaves: Map<H256, Option<V>>,
+}
+
+impl<V: Value + Clone> TreeChanges<V> {
+    /// Take the writes of a tree opened by `MultiTreeStore::tree`
+    pub fn from_tree<H: Hasher + Default, const DEPTH: usize>(
+        tree: SparseMerkleTree<H, V, NamespaceStore<'_, V>, DEPTH>,
+    ) -> Result<Self> {
+        let root = *tree.root();
+        let store = tree.take_store();
+        Ok(TreeChanges {
+            namespace: store.namespace,
+            root,
+            branches: store.branches,
+            leaves: store.leaves,
+        })
+    }
+}
+
+impl<V> MultiTreeStore<V> {
+    pub fn branches_map(&self) -> &Map<(Namespace, BranchKey), BranchNode> {
+        &self.branches_map
+    }
+    pub fn leaves_map(&self) -> &Map<(Namespace, H256), V> {
+        &self.leaves_map
+    }
+    /// Roots of the non-empty trees
+    pub fn roots(&self) -> &Map<Namespace, H256> {
+        &self.roots
+    }
+
+    /// Merkle root of a tree, zero if it is empty
+    pub fn root(&self, namespace: &Namespace) -> H256 {
+        self.roots
+            .get(namespace)
+            .copied()
+            .unwrap_or_else(H256::zero)
+    }
+
+    /// Open a tree, its writes are kept in the overlay until applied
+    pub fn tree<H, const DEPTH: usize>(
+        &self,
+        namespace: Namespace,
+    ) -> SparseMerkleTree<H, V, NamespaceStore<'_, V>, DEPTH>
+    where
+        H: Hasher + Default,
+        V: Value + Clone,
+    {
+        let store = NamespaceStore {
+            base: self,
+            namespace,
+            branches: Map::default(),
+            leaves: Map::default(),
+        };
+        SparseMerkleTree::new(self.root(&namespace), store)
+    }
+
+    /// Write the changes of trees, roots are updated along with the nodes
+    pub fn apply(&mut self, changes: Vec<TreeChanges<V>>) {
+        for tree in changes {
+            let namespace = tree.namespace;
+            for (branch_key, branch) in tree.branches {
+                match branch {
+                    Some(branch) => self.branches_map.insert((namespace, branch_key), branch),
+                    None => self.branches_map.remove(&(namespace, branch_key)),
+                };
+            }
+            for (leaf_key, leaf) in tree.leaves {
+                match leaf {
+                    Some(leaf) => self.leaves_map.insert((namespace, leaf_key), leaf),
+                    None => self.leaves_map.remove(&(namespace, leaf_key)),
+                };
+            }
+            if tree.root.is_zero() {
+                self.roots.remove(&namespace);
+            } else {
+                self.roots.insert(namespace, tree.root);
+            }
+        }
+    }
+
+    /// Update the leaves of many trees atomically, return the new roots in
+    /// the order of the first appearance of each namespace. Nothing is
+    /// written if the update of any tree fails.
+    pub fn commit<H, const DEPTH: usize>(
+        &mut self,
+        batch: Vec<(Namespace, Vec<(H256, V)>)>,
+    ) -> Result<Vec<(Namespace, H256)>>
+    where
+        H: Hasher + Default,
+        V: Value + Clone,
+    {
+        let changes = group_by_namespace(batch)
+            .into_iter()
+            .map(|(namespace, leaves)| self.prepare::<H, DEPTH>(namespace, leaves))
+            .collect::<Result<Vec<_>>>()?;
+        Ok(self.apply_changes(changes))
+    }
+
+    /// Same as `commit`, the trees are updated on `threads` threads
+    #[cfg(feature = "std")]
+    pub fn commit_parallel<H, const DEPTH: usize>(
+        &mut self,
+        batch: Vec<(Namespace, Vec<(H256, V)>)>,
+        threads: usize,
+    ) -> Result<Vec<(Namespace, H256)>>
+    where
+        H: Hasher + Default,
+        V: Value + Clone + Send + Sync,
+    {
+        let mut batch = group_by_namespace(batch);
+        let threads = core::cmp::max(threads, 1);
+        let chunk_size = core::cmp::max(batch.len().div_ceil(threads), 1);
+        let mut chunks = Vec::new();
+        while batch.len() > chunk_size {
+            let rest = batch.split_off(chunk_size);
+            chunks.push(batch);
+            batch = rest;
+        }
+        chunks.push(batch);
+        let this = &*self;
+        let changes: Result<Vec<TreeChanges<V>>> = std::thread::scope(|scope| {
+            let handles: Vec<_> = chunks
+                .into_iter()
+                .map(|chunk| {
+                    scope.spawn(move || {
+                        chunk
+                            .into_iter()
+                            .map(|(namespace, leaves)| this.prepare::<H, DEPTH>(namespace, leaves))
+                            .collect::<Result<Vec<_>>>()
+                    })
+                })
+                .collect();
+            let mut changes = Vec::new();
+            for handle in handles {
+                changes.extend(handle.join().expect("commit thread")?);
+            }
+            Ok(changes)
+        });
+        Ok(self.apply_changes(changes?))
+    }
+
+    /// Compute the changes of one tree without writing them
+    fn prepare<H, const DEPTH: usize>(
+        &self,
+        namespace: Namespace,
+        leaves: Vec<(H256, V)>,
+    ) -> Result<TreeChanges<V>>
+    where
+        H: Hasher + Default,
+        V: Value + Clone,
+    {
+        let mut tree = self.tree::<H, DEPTH>(namespace);
+        tree.update_all(leaves)?;
+        TreeChanges::from_tree(tree)
+    }
+
+    fn apply_changes(&mut self, changes: Vec<TreeChanges<V>>) -> Vec<(Namespace, H256)> {
+        let roots = changes.iter().map(|c| (c.namespace, c.root)).collect();
+        self.apply(changes);
+        roots
+    }
+}
+
+/// Merge the entries of a namespace into its first one, keeping the order
+/// of the leaves so the last write of a key wins
+fn group_by_namespace<V>(
+    batch: Vec<(Namespace, Vec<(H256, V)>)>,
+) -> Vec<(Namespace, Vec<(H256, V)>)> {
+    let mut positions: Map<Namespace, usize> = Map::default();
+    let mut grouped: Vec<(Namespace, Vec<(H256, V)>)> = Vec::new();
+    for (namespace, leaves) in batch {
+        match positions.get(&namespace) {
+            Some(&i) => grouped[i].1.extend(leaves),
+            None => {
+                positions.insert(namespace, grouped.len());
+                grouped.push((namespace, leaves));
+            }
+        }
+    }
+    grouped
+}
+
+/// One tree of a `MultiTreeStore`, reads see the buffered writes first
+#[derive(Debug)]
+pub struct NamespaceStore<'a, V> {
+    base: &'a MultiTreeStore<V>,
+    namespace: Namespace,
+    branches: Map<BranchKey, Option<BranchNode>>,
+    leaves: Map<H256, Option<V>>,
+}
+
+impl<'a, V> NamespaceStore<'a, V> {
+    pub fn namespace(&self) -> &Namespace {
+        &self.namespace
+    }
+}
+
+impl<'a, V: Clone> Store<V> for NamespaceStore<'a, V> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>> {
+        match self.branches.get(branch_key) {
+            Some(branch) => Ok(branch.clone()),
+            None => Ok(self
+                .base
+                .branches_map
+                .get(&(self.namespace, branch_key.clone()))
+                .cloned()),
+        }
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>> {
+        match self.leaves.get(leaf_key) {
+            Some(leaf) => Ok(leaf.clone()),
+            None => Ok(self
+                .base
+                .leaves_map
+                .get(&(self.namespace, *leaf_key))
+                .cloned()),
+        }
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<()> {
+        self.branches.insert(branch_key, Some(branch));
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<()> {
+        self.leaves.insert(leaf_key, Some(leaf));
+        Ok(())
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<()> {
+        self.branches.insert(branch_key.clone(), None);
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<()> {
+        self.leaves.insert(*leaf_key, None);
+        Ok(())
+    }
+}
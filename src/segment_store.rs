@@ -0,0 +1,526 @@
+use crate::{
+    collections::{BTreeMap, BTreeSet},
+    compact_store::{decode_branch, encode_branch},
+    default_store::Map,
+    error::Error,
+    trace_store::timed,
+    traits::{Store, Value, ValueCodec},
+    tree::{BranchKey, BranchNode},
+    vec::Vec,
+    H256,
+};
+use core::marker::PhantomData;
+
+/// Default size a segment is sealed at
+pub const DEFAULT_SEGMENT_SIZE: usize = 4 << 20;
+
+// Records are `rank u16 | key | len u32 | bytes`, integers little endian.
+// The rank orders the items of a path: 255 - height for branches, leaves
+// come after the branches of height 0. A length of u32::MAX removes the item.
+const RECORD_HEADER: usize = 2 + 32 + 4;
+const LEAF_RANK: u16 = 256;
+const TOMBSTONE: u32 = u32::MAX;
+
+/// Key of an item, sorting keys gives the depth first order of the tree
+type PathKey = (H256, u16);
+
+fn branch_path_key(branch_key: &BranchKey) -> PathKey {
+    (branch_key.node_key, 255 - branch_key.height as u16)
+}
+
+fn corrupted() -> Error {
+    Error::Store("corrupted segment record".into())
+}
+
+/// Location of the latest record of an item
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Location {
+    pub segment: u32,
+    /// offset of the record in the segment
+    pub offset: u32,
+    /// length of the encoded branch or value
+    pub len: u32,
+}
+
+impl Location {
+    fn record_size(&self) -> usize {
+        RECORD_HEADER + self.len as usize
+    }
+}
+
+#[derive(Debug, Clone, Default)]
+struct Segment {
+    data: Vec<u8>,
+    // bytes of records referenced by the index
+    live: usize,
+}
+
+/// Cumulative metrics of compactions
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CompactionStats {
+    /// finished compactions
+    pub runs: u64,
+    /// calls of `compact_step`
+    pub steps: u64,
+    /// records moved into fresh segments
+    pub relocated: u64,
+    pub relocated_bytes: u64,
+    /// bytes of dropped segments, including the ones emptied by writes
+    pub reclaimed_bytes: u64,
+    /// nanoseconds spent in steps, always 0 without the `std` feature
+    pub busy_ns: u64,
+    /// longest step in nanoseconds, the longest pause of the readers
+    pub max_pause_ns: u64,
+}
+
+impl CompactionStats {
+    /// Relocated bytes per second of steps, 0 without the `std` feature
+    pub fn throughput(&self) -> f64 {
+        if self.busy_ns == 0 {
+            return 0.0;
+        }
+        self.relocated_bytes as f64 * 1e9 / self.busy_ns as f64
+    }
+}
+
+/// Progress of the running compaction
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct CompactionProgress {
+    /// items visited so far
+    pub done: usize,
+    /// live items when the compaction started
+    pub total: usize,
+}
+
+#[derive(Debug, Clone)]
+struct Compaction {
+    // segments from this id on were written after the compaction started
+    first_fresh: u32,
+    // keys left to relocate, in reverse path order
+    pending: Vec<PathKey>,
+    total: usize,
+    // segment receiving the relocated records
+    target: Option<u32>,
+}
+
+/// A store keeping branches and leaves in append-only segments.
+///
+/// Every write appends a record to the active segment, which is sealed once
+/// it reaches the segment size; the in-memory index points to the latest
+/// record of each item. A segment is laid out like its file, `sync` writes
+/// the segments to a directory and `open` replays them.
+///
+/// All segments are kept in memory, files are only read by `open`, so the
+/// store must fit in memory. `sync` rewrites every changed segment whole:
+/// syncing after a few writes rewrites the active segment, up to the
+/// segment size.
+///
+/// Overwrites and removals leave holes, and the records of a path end up
+/// scattered over the segments written since. A compaction started by
+/// `start_compaction` copies the live records, in path order, into fresh
+/// segments in steps of a bounded number of records, so reads and writes
+/// go on between the steps. Segments are dropped once they are empty, from
+/// the oldest, so a removal is never dropped before the records it hides.
+#[derive(Debug, Clone)]
+pub struct SegmentStore<V> {
+    segments: BTreeMap<u32, Segment>,
+    index: Map<PathKey, Location>,
+    segment_size: usize,
+    next_id: u32,
+    // segment receiving the writes
+    active: Option<u32>,
+    compaction: Option<Compaction>,
+    stats: CompactionStats,
+    // segments changed or dropped since the last sync
+    unsynced: BTreeSet<u32>,
+    dropped: Vec<u32>,
+    buf: Vec<u8>,
+    phantom: PhantomData<V>,
+}
+
+impl<V> Default for SegmentStore<V> {
+    fn default() -> Self {
+        Self::new(DEFAULT_SEGMENT_SIZE)
+    }
+}
+
+impl<V> SegmentStore<V> {
+    pub fn new(segment_size: usize) -> Self {
+        SegmentStore {
+            segments: BTreeMap::new(),
+            index: Map::default(),
+            segment_size,
+            next_id: 0,
+            active: None,
+            compaction: None,
+            stats: CompactionStats::default(),
+            unsynced: BTreeSet::new(),
+            dropped: Vec::new(),
+            buf: Vec::new(),
+            phantom: PhantomData,
+        }
+    }
+
+    /// Number of segments
+    pub fn segments_len(&self) -> usize {
+        self.segments.len()
+    }
+
+    /// Number of live branches and leaves
+    pub fn len(&self) -> usize {
+        self.index.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.index.is_empty()
+    }
+
+    /// Location of the latest record of a branch
+    pub fn branch_location(&self, branch_key: &BranchKey) -> Option<Location> {
+        self.index.get(&branch_path_key(branch_key)).copied()
+    }
+
+    /// Bytes of all segments
+    pub fn size(&self) -> usize {
+        self.segments.values().map(|s| s.data.len()).sum()
+    }
+
+    /// Bytes of the segments no longer referenced by the index
+    pub fn garbage_bytes(&self) -> usize {
+        self.segments.values().map(|s| s.data.len() - s.live).sum()
+    }
+
+    pub fn stats(&self) -> &CompactionStats {
+        &self.stats
+    }
+
+    /// Progress of the running compaction, None if there is none
+    pub fn progress(&self) -> Option<CompactionProgress> {
+        self.compaction.as_ref().map(|c| CompactionProgress {
+            done: c.total - c.pending.len(),
+            total: c.total,
+        })
+    }
+
+    /// Start relocating the live records into fresh segments, does nothing
+    /// if a compaction is running. The keys are sorted once here, which
+    /// takes a copy of the index keys until the compaction finishes.
+    pub fn start_compaction(&mut self) {
+        if self.compaction.is_some() {
+            return;
+        }
+        let mut pending: Vec<PathKey> = self.index.keys().copied().collect();
+        pending.sort_unstable_by(|a, b| b.cmp(a));
+        // later writes go to fresh segments
+        self.active = None;
+        self.compaction = Some(Compaction {
+            first_fresh: self.next_id,
+            total: pending.len(),
+            pending,
+            target: None,
+        });
+    }
+
+    /// Relocate up to `budget` items of the running compaction, the old
+    /// segments are dropped after the last step. Return true if no
+    /// compaction is left running.
+    pub fn compact_step(&mut self, budget: usize) -> Result<bool, Error> {
+        if self.compaction.is_none() {
+            return Ok(true);
+        }
+        let (ret, elapsed) = timed(|| self.relocate(budget));
+        self.stats.steps += 1;
+        self.stats.busy_ns += elapsed;
+        self.stats.max_pause_ns = core::cmp::max(self.stats.max_pause_ns, elapsed);
+        ret
+    }
+
+    fn relocate(&mut self, budget: usize) -> Result<bool, Error> {
+        let mut compaction = self.compaction.take().expect("running compaction");
+        for _ in 0..budget {
+            let path_key = match compaction.pending.pop() {
+                Some(path_key) => path_key,
+                None => break,
+            };
+            let old = match self.index.get(&path_key) {
+                // removed, or written again since the compaction started
+                None => continue,
+                Some(location) if location.segment >= compaction.first_fresh => continue,
+                Some(location) => *location,
+            };
+            let mut buf = core::mem::take(&mut self.buf);
+            buf.clear();
+            match self.record(&old) {
+                Some(bytes) => buf.extend_from_slice(bytes),
+                None => {
+                    compaction.pending.push(path_key);
+                    self.compaction = Some(compaction);
+                    return Err(corrupted());
+                }
+            }
+            let target = self.segment_with_room(compaction.target);
+            compaction.target = Some(target);
+            let new = self.append_to(target, &path_key, Some(&buf));
+            self.buf = buf;
+            self.index.insert(path_key, new);
+            self.unlink(&old);
+            self.stats.relocated += 1;
+            self.stats.relocated_bytes += new.record_size() as u64;
+        }
+        if !compaction.pending.is_empty() {
+            self.compaction = Some(compaction);
+            return Ok(false);
+        }
+        // every live record of the old segments is relocated
+        let old: Vec<u32> = self
+            .segments
+            .range(..compaction.first_fresh)
+            .map(|(id, _)| *id)
+            .collect();
+        for id in old {
+            self.drop_segment(id);
+        }
+        // a segment started by writes between the steps is below the last
+        // target, later writes must land after the relocated copies
+        if self.active < compaction.target {
+            self.active = None;
+        }
+        self.stats.runs += 1;
+        Ok(true)
+    }
+
+    /// Id of a segment with room for a record: current if it is not sealed,
+    /// a new one otherwise
+    fn segment_with_room(&mut self, current: Option<u32>) -> u32 {
+        if let Some(id) = current {
+            if self.segments[&id].data.len() < self.segment_size {
+                return id;
+            }
+        }
+        let id = self.next_id;
+        self.next_id += 1;
+        self.segments.insert(id, Segment::default());
+        id
+    }
+
+    fn append_to(&mut self, id: u32, path_key: &PathKey, bytes: Option<&[u8]>) -> Location {
+        let segment = self.segments.get_mut(&id).expect("segment");
+        let offset = segment.data.len();
+        segment.data.extend_from_slice(&path_key.1.to_le_bytes());
+        segment.data.extend_from_slice(path_key.0.as_slice());
+        let len = match bytes {
+            Some(bytes) => {
+                segment
+                    .data
+                    .extend_from_slice(&(bytes.len() as u32).to_le_bytes());
+                segment.data.extend_from_slice(bytes);
+                segment.live += RECORD_HEADER + bytes.len();
+                bytes.len() as u32
+            }
+            None => {
+                segment.data.extend_from_slice(&TOMBSTONE.to_le_bytes());
+                0
+            }
+        };
+        self.unsynced.insert(id);
+        Location {
+            segment: id,
+            offset: offset as u32,
+            len,
+        }
+    }
+
+    /// Append the latest record of an item, None removes it
+    fn write(&mut self, path_key: PathKey, bytes: Option<&[u8]>) {
+        // a write must land after the relocated copies of the item, which
+        // are replayed in the order of the segment ids
+        let mut active = self.active;
+        if let (Some(id), Some(target)) = (active, self.compaction.as_ref().and_then(|c| c.target))
+        {
+            if id < target {
+                active = None;
+            }
+        }
+        let id = self.segment_with_room(active);
+        self.active = Some(id);
+        let new = self.append_to(id, &path_key, bytes);
+        let old = match bytes {
+            Some(_) => self.index.insert(path_key, new),
+            None => self.index.remove(&path_key),
+        };
+        if let Some(old) = old {
+            self.unlink(&old);
+        }
+    }
+
+    /// Mark a record as garbage and drop the oldest segments once empty
+    fn unlink(&mut self, location: &Location) {
+        if let Some(segment) = self.segments.get_mut(&location.segment) {
+            segment.live -= location.record_size();
+        }
+        while let Some((&id, segment)) = self.segments.iter().next() {
+            let in_use = Some(id) == self.active
+                || Some(id) == self.compaction.as_ref().and_then(|c| c.target);
+            if segment.live > 0 || in_use {
+                break;
+            }
+            self.drop_segment(id);
+        }
+    }
+
+    fn drop_segment(&mut self, id: u32) {
+        if let Some(segment) = self.segments.remove(&id) {
+            self.stats.reclaimed_bytes += segment.data.len() as u64;
+            self.unsynced.remove(&id);
+            self.dropped.push(id);
+        }
+    }
+
+    /// Encoded branch or value of a record
+    fn record(&self, location: &Location) -> Option<&[u8]> {
+        let begin = location.offset as usize + RECORD_HEADER;
+        self.segments
+            .get(&location.segment)?
+            .data
+            .get(begin..begin + location.len as usize)
+    }
+}
+
+#[cfg(feature = "std")]
+impl<V> SegmentStore<V> {
+    fn segment_path(dir: &std::path::Path, id: u32) -> std::path::PathBuf {
+        dir.join(format!("{:08}.seg", id))
+    }
+
+    /// Write the segments changed since the last sync into `dir` and delete
+    /// the files of the dropped ones. New files are written first, so a
+    /// crash in between leaves stale copies that `open` replaces.
+    pub fn sync(&mut self, dir: &std::path::Path) -> std::io::Result<()> {
+        for id in &self.unsynced {
+            crate::snapshot::publish(&Self::segment_path(dir, *id), &self.segments[id].data)?;
+        }
+        self.unsynced.clear();
+        for id in self.dropped.drain(..) {
+            match std::fs::remove_file(Self::segment_path(dir, id)) {
+                Err(err) if err.kind() != std::io::ErrorKind::NotFound => return Err(err),
+                _ => {}
+            }
+        }
+        Ok(())
+    }
+
+    /// Replay the records of a segment, later records replace the index
+    /// entries of earlier ones
+    fn replay(&mut self, id: u32, data: Vec<u8>) -> Result<(), Error> {
+        self.segments.insert(id, Segment { data, live: 0 });
+        self.next_id = core::cmp::max(self.next_id, id + 1);
+        let mut offset = 0;
+        loop {
+            let data = &self.segments[&id].data;
+            if offset == data.len() {
+                return Ok(());
+            }
+            let header = data
+                .get(offset..offset + RECORD_HEADER)
+                .ok_or_else(corrupted)?;
+            let path_key = (
+                crate::snapshot::read_h256(&header[2..]),
+                u16::from_le_bytes([header[0], header[1]]),
+            );
+            let len = crate::snapshot::read_u32(&header[34..]);
+            let (new, old) = if len == TOMBSTONE {
+                offset += RECORD_HEADER;
+                (None, self.index.remove(&path_key))
+            } else {
+                let location = Location {
+                    segment: id,
+                    offset: offset as u32,
+                    len,
+                };
+                offset += location.record_size();
+                if offset > data.len() {
+                    return Err(corrupted());
+                }
+                (Some(location), self.index.insert(path_key, location))
+            };
+            if let Some(new) = new {
+                self.segments.get_mut(&id).expect("segment").live += new.record_size();
+            }
+            if let Some(old) = old {
+                if let Some(segment) = self.segments.get_mut(&old.segment) {
+                    segment.live -= old.record_size();
+                }
+            }
+        }
+    }
+
+    /// Open the segments written by `sync` into `dir`, writes go to a new
+    /// segment
+    pub fn open(dir: &std::path::Path, segment_size: usize) -> Result<Self, Error> {
+        let io_error = |err: std::io::Error| Error::Store(err.to_string());
+        let mut ids = Vec::new();
+        for entry in std::fs::read_dir(dir).map_err(io_error)? {
+            let name = entry.map_err(io_error)?.file_name();
+            let name = name.to_string_lossy();
+            if let Some(id) = name.strip_suffix(".seg").and_then(|id| id.parse().ok()) {
+                ids.push(id);
+            }
+        }
+        ids.sort_unstable();
+        let mut store = Self::new(segment_size);
+        for id in ids {
+            let data = std::fs::read(Self::segment_path(dir, id)).map_err(io_error)?;
+            store.replay(id, data)?;
+        }
+        Ok(store)
+    }
+}
+
+impl<V: Value + ValueCodec> Store<V> for SegmentStore<V> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        match self.index.get(&branch_path_key(branch_key)) {
+            Some(location) => self
+                .record(location)
+                .and_then(decode_branch)
+                .map(Some)
+                .ok_or_else(corrupted),
+            None => Ok(None),
+        }
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>, Error> {
+        match self.index.get(&(*leaf_key, LEAF_RANK)) {
+            Some(location) => self
+                .record(location)
+                .and_then(V::decode)
+                .map(Some)
+                .ok_or_else(corrupted),
+            None => Ok(None),
+        }
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        self.write(branch_path_key(&branch_key), Some(&encode_branch(&branch)));
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error> {
+        let mut buf = core::mem::take(&mut self.buf);
+        buf.clear();
+        leaf.encode(&mut buf);
+        self.write((leaf_key, LEAF_RANK), Some(&buf));
+        self.buf = buf;
+        Ok(())
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
+        let path_key = branch_path_key(branch_key);
+        if self.index.contains_key(&path_key) {
+            self.write(path_key, None);
+        }
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        let path_key = (*leaf_key, LEAF_RANK);
+        if self.index.contains_key(&path_key) {
+            self.write(path_key, None);
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,319 @@
+use crate::{
+    compact_store::{decode_branch, encode_branch},
+    error::{Error, Result},
+    traits::{Hasher, Store, Value, ValueCodec},
+    tree::{BranchKey, BranchNode, SparseMerkleTree},
+    vec,
+    vec::Vec,
+    H256,
+};
+use core::marker::PhantomData;
+
+// Layout of a snapshot, integers are little endian:
+//
+// header: magic | depth u16 | root | branches u64 | leaves u64 | data size u64
+// branch index: (height u8 | node_key | offset u64 | len u32) sorted by BranchKey
+// leaf index: (key | offset u64 | len u32) sorted by key
+// data: compact encoded branches and encoded values, offsets are relative to it
+//
+// Keys in the indexes are stored from the most significant byte, so the
+// byte order of entries is the order of `BranchKey` and `H256`.
+const MAGIC: &[u8; 8] = b"SMTSNAP1";
+const HEADER_SIZE: usize = 8 + 2 + 32 + 8 + 8 + 8;
+const BRANCH_ENTRY_SIZE: usize = 1 + 32 + 8 + 4;
+const LEAF_ENTRY_SIZE: usize = 32 + 8 + 4;
+
+fn corrupted() -> Error {
+    Error::Store("corrupted snapshot".into())
+}
+
+pub(crate) fn read_u64(bytes: &[u8]) -> u64 {
+    let mut buf = [0u8; 8];
+    buf.copy_from_slice(&bytes[..8]);
+    u64::from_le_bytes(buf)
+}
+
+pub(crate) fn read_u32(bytes: &[u8]) -> u32 {
+    let mut buf = [0u8; 4];
+    buf.copy_from_slice(&bytes[..4]);
+    u32::from_le_bytes(buf)
+}
+
+pub(crate) fn read_h256(bytes: &[u8]) -> H256 {
+    let mut buf = [0u8; 32];
+    buf.copy_from_slice(&bytes[..32]);
+    buf.into()
+}
+
+/// A read-only store over a serialized snapshot.
+///
+/// Reads binary search the sorted indexes and decode items in place, the
+/// snapshot is never copied, so any number of views, e.g. over a shared
+/// mapping of a published snapshot file, share one copy of the tree.
+#[derive(Debug, Clone, Copy)]
+pub struct SnapshotView<'a, V> {
+    depth: usize,
+    root: H256,
+    branch_index: &'a [u8],
+    leaf_index: &'a [u8],
+    data: &'a [u8],
+    phantom: PhantomData<V>,
+}
+
+impl<'a, V> SnapshotView<'a, V> {
+    /// Attach to a snapshot, only the header and the total size are checked
+    pub fn new(bytes: &'a [u8]) -> Result<Self> {
+        if bytes.len() < HEADER_SIZE || &bytes[..8] != MAGIC {
+            return Err(corrupted());
+        }
+        let depth = u16::from_le_bytes([bytes[8], bytes[9]]) as usize;
+        let root = read_h256(&bytes[10..]);
+        let branches = read_u64(&bytes[42..]) as usize;
+        let leaves = read_u64(&bytes[50..]) as usize;
+        let data_size = read_u64(&bytes[58..]) as usize;
+        let leaf_start = branches
+            .checked_mul(BRANCH_ENTRY_SIZE)
+            .and_then(|size| size.checked_add(HEADER_SIZE))
+            .ok_or_else(corrupted)?;
+        let data_start = leaves
+            .checked_mul(LEAF_ENTRY_SIZE)
+            .and_then(|size| size.checked_add(leaf_start))
+            .ok_or_else(corrupted)?;
+        if depth == 0 || depth > 256 || Some(bytes.len()) != data_start.checked_add(data_size) {
+            return Err(corrupted());
+        }
+        Ok(SnapshotView {
+            depth,
+            root,
+            branch_index: &bytes[HEADER_SIZE..leaf_start],
+            leaf_index: &bytes[leaf_start..data_start],
+            data: &bytes[data_start..],
+            phantom: PhantomData,
+        })
+    }
+
+    /// Depth of the tree
+    pub fn depth(&self) -> usize {
+        self.depth
+    }
+
+    /// Merkle root of the tree
+    pub fn root(&self) -> &H256 {
+        &self.root
+    }
+
+    pub fn branches_len(&self) -> usize {
+        self.branch_index.len() / BRANCH_ENTRY_SIZE
+    }
+
+    pub fn leaves_len(&self) -> usize {
+        self.leaf_index.len() / LEAF_ENTRY_SIZE
+    }
+
+    /// Open a read-only tree over the snapshot
+    pub fn into_tree<H: Hasher + Default, const DEPTH: usize>(
+        self,
+    ) -> Result<SparseMerkleTree<H, V, Self, DEPTH>>
+    where
+        V: Value + ValueCodec,
+    {
+        if self.depth != DEPTH {
+            return Err(corrupted());
+        }
+        Ok(SparseMerkleTree::new(self.root, self))
+    }
+
+    // binary search an index of fixed size entries by their key bytes
+    fn find(&self, index: &[u8], entry_size: usize, key: &[u8]) -> Result<Option<&'a [u8]>> {
+        let entries = index.len() / entry_size;
+        let (mut lo, mut hi) = (0, entries);
+        while lo < hi {
+            let mid = lo + (hi - lo) / 2;
+            let entry = &index[mid * entry_size..(mid + 1) * entry_size];
+            match entry[..key.len()].cmp(key) {
+                core::cmp::Ordering::Less => lo = mid + 1,
+                core::cmp::Ordering::Greater => hi = mid,
+                core::cmp::Ordering::Equal => {
+                    let offset = read_u64(&entry[key.len()..]) as usize;
+                    let len = read_u32(&entry[key.len() + 8..]) as usize;
+                    let end = offset.checked_add(len).ok_or_else(corrupted)?;
+                    return self.data.get(offset..end).map(Some).ok_or_else(corrupted);
+                }
+            }
+        }
+        Ok(None)
+    }
+}
+
+fn leaf_index_key(leaf_key: &H256) -> [u8; 32] {
+    let mut key = [0u8; 32];
+    key.copy_from_slice(leaf_key.as_slice());
+    key.reverse();
+    key
+}
+
+fn branch_index_key(branch_key: &BranchKey) -> [u8; 33] {
+    let mut key = [0u8; 33];
+    key[0] = branch_key.height;
+    key[1..].copy_from_slice(&leaf_index_key(&branch_key.node_key));
+    key
+}
+
+impl<'a, V: ValueCodec> Store<V> for SnapshotView<'a, V> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>> {
+        let key = branch_index_key(branch_key);
+        match self.find(self.branch_index, BRANCH_ENTRY_SIZE, &key)? {
+            Some(bytes) => decode_branch(bytes).map(Some).ok_or_else(corrupted),
+            None => Ok(None),
+        }
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>> {
+        let key = leaf_index_key(leaf_key);
+        match self.find(self.leaf_index, LEAF_ENTRY_SIZE, &key)? {
+            Some(bytes) => V::decode(bytes).map(Some).ok_or_else(corrupted),
+            None => Ok(None),
+        }
+    }
+    fn insert_branch(&mut self, _branch_key: BranchKey, _branch: BranchNode) -> Result<()> {
+        Err(Error::Store("snapshot is read-only".into()))
+    }
+    fn insert_leaf(&mut self, _leaf_key: H256, _leaf: V) -> Result<()> {
+        Err(Error::Store("snapshot is read-only".into()))
+    }
+    fn remove_branch(&mut self, _branch_key: &BranchKey) -> Result<()> {
+        Err(Error::Store("snapshot is read-only".into()))
+    }
+    fn remove_leaf(&mut self, _leaf_key: &H256) -> Result<()> {
+        Err(Error::Store("snapshot is read-only".into()))
+    }
+}
+
+impl<H, V, S, const DEPTH: usize> SparseMerkleTree<H, V, S, DEPTH>
+where
+    H: Hasher + Default,
+    V: Value + ValueCodec,
+    S: Store<V>,
+{
+    /// Serialize every branch and leaf reachable from the root into an
+    /// immutable snapshot, see `SnapshotView`
+    pub fn snapshot(&self) -> Result<Vec<u8>> {
+        let mut branches: Vec<(BranchKey, Vec<u8>)> = Vec::new();
+        let mut leaves: Vec<(H256, Vec<u8>)> = Vec::new();
+        if !self.is_empty() {
+            let mut pending = vec![(Self::ROOT_HEIGHT, H256::zero())];
+            while let Some((height, node_key)) = pending.pop() {
+                let branch_key = BranchKey::new(height, node_key);
+                let branch = self
+                    .store()
+                    .get_branch(&branch_key)?
+                    .ok_or(Error::MissingBranch(height, node_key))?;
+                let mut right_key = node_key;
+                right_key.set_bit(height);
+                for (child, child_key) in
+                    [(&branch.left, node_key), (&branch.right, right_key)].iter()
+                {
+                    if child.is_zero() {
+                        continue;
+                    }
+                    if height == 0 {
+                        let leaf = self
+                            .store()
+                            .get_leaf(child_key)?
+                            .ok_or(Error::MissingLeaf(*child_key))?;
+                        let mut buf = Vec::new();
+                        leaf.encode(&mut buf);
+                        leaves.push((*child_key, buf));
+                    } else {
+                        pending.push((height - 1, *child_key));
+                    }
+                }
+                branches.push((branch_key, encode_branch(&branch)));
+            }
+        }
+        branches.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+        leaves.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+
+        let data_size: usize = branches.iter().map(|(_, b)| b.len()).sum::<usize>()
+            + leaves.iter().map(|(_, l)| l.len()).sum::<usize>();
+        let mut buf = Vec::with_capacity(
+            HEADER_SIZE
+                + branches.len() * BRANCH_ENTRY_SIZE
+                + leaves.len() * LEAF_ENTRY_SIZE
+                + data_size,
+        );
+        buf.extend_from_slice(MAGIC);
+        buf.extend_from_slice(&(DEPTH as u16).to_le_bytes());
+        buf.extend_from_slice(self.root().as_slice());
+        buf.extend_from_slice(&(branches.len() as u64).to_le_bytes());
+        buf.extend_from_slice(&(leaves.len() as u64).to_le_bytes());
+        buf.extend_from_slice(&(data_size as u64).to_le_bytes());
+        let mut offset = 0u64;
+        for (branch_key, bytes) in &branches {
+            buf.extend_from_slice(&branch_index_key(branch_key));
+            buf.extend_from_slice(&offset.to_le_bytes());
+            buf.extend_from_slice(&(bytes.len() as u32).to_le_bytes());
+            offset += bytes.len() as u64;
+        }
+        for (key, bytes) in &leaves {
+            buf.extend_from_slice(&leaf_index_key(key));
+            buf.extend_from_slice(&offset.to_le_bytes());
+            buf.extend_from_slice(&(bytes.len() as u32).to_le_bytes());
+            offset += bytes.len() as u64;
+        }
+        for (_, bytes) in &branches {
+            buf.extend_from_slice(bytes);
+        }
+        for (_, bytes) in &leaves {
+            buf.extend_from_slice(bytes);
+        }
+        Ok(buf)
+    }
+}
+
+/// Publish a snapshot at `path`, readers opening the path see either the
+/// previous snapshot or the new one: it is written to a temporary file
+/// next to `path` then renamed over it. Every call writes its own temporary
+/// file, and the directory is synced, so the rename survives a crash
+#[cfg(feature = "std")]
+pub fn publish(path: &std::path::Path, snapshot: &[u8]) -> std::io::Result<()> {
+    use std::io::Write;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    static NEXT_TMP: AtomicUsize = AtomicUsize::new(0);
+    let mut tmp_path = path.as_os_str().to_owned();
+    tmp_path.push(format!(
+        ".{}.{}.tmp",
+        std::process::id(),
+        NEXT_TMP.fetch_add(1, Ordering::Relaxed)
+    ));
+    let written = std::fs::OpenOptions::new()
+        .write(true)
+        .create_new(true)
+        .open(&tmp_path)
+        .and_then(|mut file| {
+            file.write_all(snapshot)?;
+            file.sync_all()
+        })
+        .and_then(|_| std::fs::rename(&tmp_path, path));
+    if let Err(err) = written {
+        let _ = std::fs::remove_file(&tmp_path);
+        return Err(err);
+    }
+    sync_parent(path)
+}
+
+/// Sync the directory holding `path`, making a rename into it durable
+#[cfg(all(feature = "std", unix))]
+fn sync_parent(path: &std::path::Path) -> std::io::Result<()> {
+    let dir = match path.parent() {
+        Some(dir) if !dir.as_os_str().is_empty() => dir,
+        _ => std::path::Path::new("."),
+    };
+    std::fs::File::open(dir)?.sync_all()
+}
+
+// directories can not be opened for syncing
+#[cfg(all(feature = "std", not(unix)))]
+fn sync_parent(_path: &std::path::Path) -> std::io::Result<()> {
+    Ok(())
+}
@@ -0,0 +1,160 @@
+use crate::{merge::MergeValue, tree::BranchNode, vec, vec::Vec, H256};
+
+/// Shape statistics of a tree
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct TreeStats {
+    /// number of stored branches, indexed by height
+    pub branches: Vec<u64>,
+    /// number of real forks (both children are non-zero), indexed by height
+    pub forks: Vec<u64>,
+    /// number of MergeWithZero chains, indexed by chain length (1..=256)
+    pub zero_chains: Vec<u64>,
+    /// number of leaves visited
+    pub leaves: u64,
+    /// sum of non-zero siblings on the merkle path of every visited leaf
+    pub siblings: u64,
+}
+
+impl Default for TreeStats {
+    fn default() -> Self {
+        TreeStats {
+            branches: vec![0; 256],
+            forks: vec![0; 256],
+            zero_chains: vec![0; 257],
+            leaves: 0,
+            siblings: 0,
+        }
+    }
+}
+
+impl TreeStats {
+    /// Average number of non-zero siblings in a single leaf merkle proof
+    pub fn avg_siblings_per_proof(&self) -> f64 {
+        if self.leaves == 0 {
+            return 0.0;
+        }
+        self.siblings as f64 / self.leaves as f64
+    }
+
+    /// Accumulate another statistics into self
+    pub fn merge(&mut self, other: &TreeStats) {
+        for (a, b) in self.branches.iter_mut().zip(&other.branches) {
+            *a += b;
+        }
+        for (a, b) in self.forks.iter_mut().zip(&other.forks) {
+            *a += b;
+        }
+        for (a, b) in self.zero_chains.iter_mut().zip(&other.zero_chains) {
+            *a += b;
+        }
+        self.leaves += other.leaves;
+        self.siblings += other.siblings;
+    }
+
+    fn record_zero_chain(&mut self, value: &MergeValue, extra: usize) {
+        if let MergeValue::MergeWithZero { zero_count, .. } = value {
+            // zero_count wraps to 0 when a chain covers all 256 heights
+            let len = if *zero_count == 0 {
+                256
+            } else {
+                *zero_count as usize
+            };
+            self.zero_chains[core::cmp::min(len + extra, 256)] += 1;
+        }
+    }
+
+    /// Record a branch visited by the collector,
+    /// returns the non-zero flags of (left, right) children
+    pub(crate) fn record_branch(
+        &mut self,
+        height: u8,
+        is_root: bool,
+        branch: &BranchNode,
+    ) -> (bool, bool) {
+        let has_left = !branch.left.is_zero();
+        let has_right = !branch.right.is_zero();
+        self.branches[height as usize] += 1;
+        if has_left && has_right {
+            self.forks[height as usize] += 1;
+            // a chain ends where it is merged with a non-zero sibling
+            self.record_zero_chain(&branch.left, 0);
+            self.record_zero_chain(&branch.right, 0);
+        } else if is_root {
+            // the root merge extends the chain by one more zero
+            self.record_zero_chain(&branch.left, 1);
+            self.record_zero_chain(&branch.right, 1);
+        }
+        (has_left, has_right)
+    }
+}
+
+/// An incremental statistics pass over a tree.
+///
+/// The collector walks the tree from the root in depth-first order and
+/// can be driven in small steps via `SparseMerkleTree::collect_stats`,
+/// so a large tree is never scanned in one go. Updates between steps are
+/// tolerated but make the result approximate.
+#[derive(Debug, Clone, Default)]
+pub struct StatsCollector {
+    // pending branches: (height, node_key, non-zero siblings above)
+    stack: Vec<(u8, H256, u64)>,
+    root_height: u8,
+    started: bool,
+    stats: TreeStats,
+}
+
+impl StatsCollector {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Return true if the whole tree has been visited
+    pub fn is_finished(&self) -> bool {
+        self.started && self.stack.is_empty()
+    }
+
+    /// Statistics collected so far
+    pub fn stats(&self) -> &TreeStats {
+        &self.stats
+    }
+
+    /// Destruct the collector and take the statistics
+    pub fn take_stats(self) -> TreeStats {
+        self.stats
+    }
+
+    pub(crate) fn start(&mut self, root_height: u8) {
+        if !self.started {
+            self.started = true;
+            self.root_height = root_height;
+            self.stack.push((root_height, H256::zero(), 0));
+        }
+    }
+
+    pub(crate) fn pop(&mut self) -> Option<(u8, H256, u64)> {
+        self.stack.pop()
+    }
+
+    pub(crate) fn visit(&mut self, height: u8, node_key: H256, siblings: u64, branch: &BranchNode) {
+        let is_root = height == self.root_height;
+        let (has_left, has_right) = self.stats.record_branch(height, is_root, branch);
+        let mut right_key = node_key;
+        right_key.set_bit(height);
+        let children = [
+            (has_left, node_key, siblings + has_right as u64),
+            (has_right, right_key, siblings + has_left as u64),
+        ];
+        // push right first so leaves are visited in key order
+        for (exists, child_key, child_siblings) in children.iter().rev() {
+            if !exists {
+                continue;
+            }
+            if height == 0 {
+                self.stats.leaves += 1;
+                self.stats.siblings += child_siblings;
+            } else {
+                self.stack.push((height - 1, *child_key, *child_siblings));
+            }
+        }
+    }
+}
@@ -0,0 +1,140 @@
+use super::smt::CkbBlake2bHasher;
+use crate::*;
+use crate::{
+    blake2b::Blake2bHasher,
+    ckb_smt::hexary_verify,
+    hexary::{hash_hexary_leaf, nibble, DefaultHexaryStore, HexaryProof, HexarySparseMerkleTree},
+};
+use rand::{seq::SliceRandom, Rng};
+
+type HexarySMT = HexarySparseMerkleTree<Blake2bHasher, H256, DefaultHexaryStore<H256>>;
+type CkbHexarySMT = HexarySparseMerkleTree<CkbBlake2bHasher, H256, DefaultHexaryStore<H256>>;
+
+#[test]
+fn test_hexary_tree() {
+    let mut rng = rand::thread_rng();
+    let mut pairs: Vec<(H256, H256)> = (0..100)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    // keys sharing a long prefix fork deep in the tree
+    let mut neighbor = pairs[0].0;
+    if neighbor.get_bit(0) {
+        neighbor.clear_bit(0);
+    } else {
+        neighbor.set_bit(0);
+    }
+    pairs.push((neighbor, rng.gen::<[u8; 32]>().into()));
+
+    let mut tree = HexarySMT::default();
+    for (key, value) in &pairs {
+        tree.update(*key, *value).expect("update");
+    }
+    // the root does not depend on the insert order
+    pairs.shuffle(&mut rng);
+    let mut tree2 = HexarySMT::default();
+    for (key, value) in &pairs {
+        tree2.update(*key, *value).expect("update");
+    }
+    assert_eq!(tree.root(), tree2.root());
+    // a path has 64 nodes
+    assert!(tree.store().nodes_map().len() <= pairs.len() * 64);
+
+    let absent: H256 = rng.gen::<[u8; 32]>().into();
+    for (key, value) in pairs.iter().cloned().chain(Some((absent, H256::zero()))) {
+        assert_eq!(tree.get(&key).expect("get"), value);
+        let proof = tree.merkle_proof(&key).expect("proof");
+        assert!(proof
+            .verify::<Blake2bHasher>(tree.root(), &key, &value)
+            .expect("verify"));
+        assert!(!proof
+            .verify::<Blake2bHasher>(tree.root(), &key, &[1u8; 32].into())
+            .expect("verify"));
+    }
+
+    let proof = tree.merkle_proof(&pairs[0].0).expect("proof");
+    let mut corrupted = proof.0.clone();
+    corrupted.pop();
+    assert!(HexaryProof(corrupted)
+        .compute_root::<Blake2bHasher>(&pairs[0].0, &pairs[0].1)
+        .is_err());
+
+    for (key, _value) in &pairs {
+        tree.update(*key, H256::zero()).expect("update");
+    }
+    assert!(tree.is_empty());
+    assert!(tree.store().nodes_map().is_empty());
+}
+
+#[test]
+fn test_hexary_c_verify() {
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..50)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut tree = CkbHexarySMT::default();
+    for (key, value) in &pairs {
+        tree.update(*key, *value).expect("update");
+    }
+    let absent: H256 = rng.gen::<[u8; 32]>().into();
+    for (key, value) in pairs.iter().cloned().chain(Some((absent, H256::zero()))) {
+        let proof: Vec<u8> = tree.merkle_proof(&key).expect("proof").into();
+        hexary_verify(tree.root(), &key, &value, &proof).expect("verify with c");
+        assert!(hexary_verify(tree.root(), &key, &[1u8; 32].into(), &proof).is_err());
+    }
+
+    // a tree of one leaf, the non-existing key only has a leaf sibling
+    let mut tree = CkbHexarySMT::default();
+    let (key, value) = pairs[0];
+    tree.update(key, value).expect("update");
+    let proof: Vec<u8> = tree.merkle_proof(&absent).expect("proof").into();
+    hexary_verify(tree.root(), &absent, &H256::zero(), &proof).expect("verify with c");
+    let proof: Vec<u8> = tree.merkle_proof(&key).expect("proof").into();
+    assert_eq!(proof.len(), 8);
+    hexary_verify(tree.root(), &key, &value, &proof).expect("verify with c");
+}
+
+#[test]
+fn test_hexary_relocated_leaf() {
+    let mut rng = rand::thread_rng();
+    let key: H256 = rng.gen::<[u8; 32]>().into();
+    let value: H256 = rng.gen::<[u8; 32]>().into();
+    let mut tree = CkbHexarySMT::default();
+    tree.update(key, value).expect("update");
+
+    // keys next to the leaf at the bottom and far from it at the top
+    let mut neighbor = key;
+    if neighbor.get_bit(0) {
+        neighbor.clear_bit(0);
+    } else {
+        neighbor.set_bit(0);
+    }
+    let absent: H256 = rng.gen::<[u8; 32]>().into();
+    for other in &[neighbor, absent] {
+        let proof = tree.merkle_proof(other).expect("proof");
+        assert!(proof
+            .verify::<CkbBlake2bHasher>(tree.root(), other, &H256::zero())
+            .expect("verify"));
+        hexary_verify(tree.root(), other, &H256::zero(), &proof.0).expect("verify with c");
+        // the proof reads the same against any value
+        assert!(!proof
+            .verify::<CkbBlake2bHasher>(tree.root(), other, &value)
+            .expect("verify"));
+    }
+
+    // the leaf moved beside its own key must not prove the key absent
+    let (index, own) = ((nibble(&key, 0) + 1) % 16, 1u16 << nibble(&key, 0));
+    let mut forged = 1u64.to_le_bytes().to_vec();
+    forged.extend_from_slice(&(1u16 << index).to_le_bytes());
+    let mut relocated = forged.clone();
+    forged.extend_from_slice(&(1u16 << index).to_le_bytes());
+    forged.extend_from_slice(hash_hexary_leaf::<CkbBlake2bHasher>(&key, &value).as_slice());
+    relocated.extend_from_slice(&(1u16 << index | own).to_le_bytes());
+    relocated.extend_from_slice(key.as_slice());
+    relocated.extend_from_slice(value.as_slice());
+    for proof in [forged, relocated] {
+        assert!(!HexaryProof(proof.clone())
+            .verify::<CkbBlake2bHasher>(tree.root(), &key, &H256::zero())
+            .unwrap_or(false));
+        assert!(hexary_verify(tree.root(), &key, &H256::zero(), &proof).is_err());
+    }
+}
@@ -0,0 +1,233 @@
+use crate::*;
+use crate::{
+    blake2b::Blake2bHasher, default_store::DefaultStore, error::Error, history::HistoryStore,
+    traits::Store,
+};
+use rand::Rng;
+
+type HistorySMT = SparseMerkleTree<Blake2bHasher, H256, HistoryStore<H256, DefaultStore<H256>>>;
+
+#[test]
+fn test_get_at() {
+    let mut rng = rand::thread_rng();
+    let keys: Vec<H256> = (0..20).map(|_| rng.gen::<[u8; 32]>().into()).collect();
+    let mut tree = HistorySMT::default();
+    // expected values of every key after each version
+    let mut snapshots: Vec<Vec<H256>> = Vec::new();
+    let mut current = vec![H256::zero(); keys.len()];
+    for version in 0..30u64 {
+        for _ in 0..5 {
+            let i = rng.gen_range(0, keys.len());
+            let value: H256 = if rng.gen_range(0, 4) == 0 {
+                H256::zero()
+            } else {
+                rng.gen::<[u8; 32]>().into()
+            };
+            tree.update(keys[i], value).expect("update");
+            current[i] = value;
+        }
+        if version % 10 == 9 {
+            // detached leaves are deleted in the version they are dropped in
+            tree.delete_prefix(255, H256::zero())
+                .expect("delete prefix");
+            current = vec![H256::zero(); keys.len()];
+        }
+        assert_eq!(tree.commit_version(), Ok(version));
+        snapshots.push(current.clone());
+    }
+    for (version, snapshot) in snapshots.iter().enumerate() {
+        for (key, value) in keys.iter().zip(snapshot) {
+            assert_eq!(tree.get_at(key, version as u64), Ok(*value));
+        }
+    }
+    // the current version reads the uncommitted state
+    let value: H256 = rng.gen::<[u8; 32]>().into();
+    tree.update(keys[0], value).expect("update");
+    assert_eq!(tree.get_at(&keys[0], 30), Ok(value));
+    assert_eq!(tree.get_at(&keys[0], 29), Ok(snapshots[29][0]));
+    assert_eq!(tree.get_at(&keys[0], 31), Err(Error::VersionOutOfRange(31)));
+}
+
+#[test]
+fn test_history_retention() {
+    let mut rng = rand::thread_rng();
+    let keys: Vec<H256> = (0..10).map(|_| rng.gen::<[u8; 32]>().into()).collect();
+    let mut tree = HistorySMT::new(
+        H256::zero(),
+        HistoryStore::with_retention(DefaultStore::default(), 5),
+    );
+    let mut snapshots: Vec<Vec<H256>> = Vec::new();
+    for version in 0..20u64 {
+        let values: Vec<H256> = keys.iter().map(|_| rng.gen::<[u8; 32]>().into()).collect();
+        // only every other version writes all keys
+        if version % 2 == 0 {
+            tree.update_all(keys.iter().cloned().zip(values.iter().cloned()).collect())
+                .expect("update_all");
+            snapshots.push(values);
+        } else {
+            snapshots.push(snapshots[version as usize - 1].clone());
+        }
+        tree.commit_version().expect("commit");
+    }
+    tree.store_mut().prune_history();
+    assert_eq!(tree.store().oldest_version(), 15);
+    assert_eq!(tree.get_at(&keys[0], 14), Err(Error::VersionOutOfRange(14)));
+    for (version, snapshot) in snapshots.iter().enumerate().skip(15) {
+        for (key, value) in keys.iter().zip(snapshot) {
+            assert_eq!(tree.get_at(key, version as u64), Ok(*value));
+        }
+    }
+    // versions 15..=20 need at most 3 writes per key
+    assert!(tree
+        .store()
+        .leaves_history()
+        .values()
+        .all(|history| history.len() <= 3));
+}
+
+#[test]
+fn test_merkle_proof_at() {
+    let mut rng = rand::thread_rng();
+    let keys: Vec<H256> = (0..30).map(|_| rng.gen::<[u8; 32]>().into()).collect();
+    let mut tree = HistorySMT::new(
+        H256::zero(),
+        HistoryStore::with_retention(DefaultStore::default(), 8),
+    );
+    // a plain tree rebuilt at every version to compare proofs
+    let mut replica = SparseMerkleTree::<Blake2bHasher, H256, DefaultStore<H256>>::default();
+    let mut snapshots = Vec::new();
+    for version in 0..12u64 {
+        let leaves: Vec<(H256, H256)> = (0..8)
+            .map(|_| {
+                let value = if rng.gen_range(0, 4) == 0 {
+                    H256::zero()
+                } else {
+                    rng.gen::<[u8; 32]>().into()
+                };
+                (keys[rng.gen_range(0, keys.len())], value)
+            })
+            .collect();
+        tree.update_all(leaves.clone()).expect("update_all");
+        replica.update_all(leaves).expect("update_all");
+        let proof_keys: Vec<H256> = keys.iter().take(5).cloned().collect();
+        let proof = replica.merkle_proof(proof_keys.clone()).expect("proof");
+        let values: Vec<H256> = proof_keys
+            .iter()
+            .map(|k| replica.get(k).expect("get"))
+            .collect();
+        snapshots.push((*replica.root(), proof_keys, values, proof));
+        assert_eq!(tree.commit_version(), Ok(version));
+    }
+    tree.store_mut().prune_history();
+
+    for (version, (root, proof_keys, values, proof)) in snapshots.iter().enumerate() {
+        let version = version as u64;
+        if version < tree.store().oldest_version() {
+            assert_eq!(
+                tree.merkle_proof_at(version, proof_keys.clone()),
+                Err(Error::VersionOutOfRange(version))
+            );
+            continue;
+        }
+        assert_eq!(tree.root_at(version), Ok(*root));
+        let proof_at = tree
+            .merkle_proof_at(version, proof_keys.clone())
+            .expect("proof");
+        assert_eq!(&proof_at, proof);
+        let leaves: Vec<(H256, H256)> = proof_keys
+            .iter()
+            .cloned()
+            .zip(values.iter().cloned())
+            .collect();
+        assert!(proof_at
+            .verify::<Blake2bHasher>(root, leaves)
+            .expect("verify"));
+    }
+    assert_eq!(tree.root_at(12), Ok(*tree.root()));
+}
+
+#[test]
+fn test_history_shares_nodes() {
+    fn check_refs(tree: &HistorySMT) {
+        // every node is referred by as many history entries as its count
+        let mut refs: Vec<H256> = tree
+            .store()
+            .branches_history()
+            .values()
+            .flat_map(|history| history.iter().filter_map(|(_v, hash)| *hash))
+            .collect();
+        refs.sort();
+        let nodes = tree.store().nodes();
+        let mut counted: Vec<H256> = nodes
+            .iter()
+            .flat_map(|(hash, (_branch, count))| (0..*count).map(move |_| *hash))
+            .collect();
+        counted.sort();
+        assert_eq!(refs, counted);
+    }
+
+    let mut rng = rand::thread_rng();
+    let keys: Vec<H256> = (0..20).map(|_| rng.gen::<[u8; 32]>().into()).collect();
+    let mut tree = HistorySMT::new(
+        H256::zero(),
+        HistoryStore::with_retention(DefaultStore::default(), 4),
+    );
+    tree.update_all(
+        keys.iter()
+            .map(|k| (*k, rng.gen::<[u8; 32]>().into()))
+            .collect(),
+    )
+    .expect("update_all");
+    let old_value = tree.get(&keys[0]).expect("get");
+    tree.commit_version().expect("commit");
+    // the current branches are only kept by the inner store
+    assert!(tree.store().nodes().is_empty());
+
+    // a version only adds the branches its changed path supersedes
+    let new_value: H256 = rng.gen::<[u8; 32]>().into();
+    tree.update(keys[0], new_value).expect("update");
+    tree.commit_version().expect("commit");
+    let changed = tree.store().nodes().len();
+    assert!(changed > 0 && changed <= 256);
+    tree.update(keys[0], old_value).expect("update");
+    tree.commit_version().expect("commit");
+    assert_eq!(tree.store().nodes().len(), changed * 2);
+    assert_eq!(tree.root_at(2), tree.root_at(0));
+    // superseding the branches of the first version again shares them
+    tree.update(keys[0], new_value).expect("update");
+    tree.commit_version().expect("commit");
+    assert_eq!(tree.store().nodes().len(), changed * 2);
+    assert_eq!(tree.root_at(3), tree.root_at(1));
+    check_refs(&tree);
+    // the inner store keeps the fork hashes of the current branches
+    let inner = tree.store().inner();
+    let cached = inner
+        .branches_map()
+        .keys()
+        .filter(|branch_key| {
+            matches!(inner.get_branch_with_hashes(branch_key),
+                Ok(Some((_branch, hashes))) if hashes != [None, None])
+        })
+        .count();
+    assert!(cached > 0);
+
+    // pruned versions release their nodes
+    for _ in 0..10 {
+        let i = rng.gen_range(0, keys.len());
+        tree.update(keys[i], rng.gen::<[u8; 32]>().into())
+            .expect("update");
+        tree.commit_version().expect("commit");
+    }
+    tree.store_mut().prune_history();
+    check_refs(&tree);
+    for version in tree.store().oldest_version()..tree.store().version() {
+        let proof = tree.merkle_proof_at(version, keys.clone()).expect("proof");
+        let leaves: Vec<(H256, H256)> = keys
+            .iter()
+            .map(|k| (*k, tree.get_at(k, version).expect("get_at")))
+            .collect();
+        assert!(proof
+            .verify::<Blake2bHasher>(&tree.root_at(version).expect("root"), leaves)
+            .expect("verify"));
+    }
+}
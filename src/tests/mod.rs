@@ -1,4 +1,7 @@
 // FIXME: fix fixtures tests later
 // mod fixtures;
+mod hexary;
+mod history;
 mod smt;
+mod store;
 mod tree;
@@ -63,6 +63,32 @@ fn test_ckb_smt_verify3() {
     assert!(smt.verify(&root_hash, &proof).is_ok());
 }
 
+#[test]
+fn test_ckb_smt_verify_with_timing() {
+    let key = str_to_h256("381dc5391dab099da5e28acd1ad859a051cf18ace804d037f12819c6fbc0e18b");
+    let val = str_to_h256("9158ce9b0e11dd150ba2ae5d55c1db04b1c5986ec626f2e38a93fe8ad0b2923b");
+    let root_hash = str_to_h256("ebe0fab376cd802d364eeb44af20c67a74d6183a33928fead163120ef12e6e06");
+    let proof = str_to_vec(
+        "4c4fff51ff322de8a89fe589987f97220cfcb6820bd798b31a0b56ffea221093d35f909e580b00000000000000000000000000000000000000000000000000000000000000");
+
+    let mut timing = SMTTiming::default();
+    let builder = SMTBuilder::new();
+    let builder = builder.insert(&key, &val).unwrap();
+    let smt = builder.build_with_timing(&mut timing).unwrap();
+    for _ in 0..2 {
+        assert!(smt
+            .verify_with_timing(&root_hash, &proof, &mut timing)
+            .is_ok());
+    }
+    assert_eq!(timing.normalize_calls, 1);
+    assert_eq!(timing.verify_calls, 2);
+    assert!(timing.hash_cycles > 0);
+    assert!(smt
+        .verify_with_timing(&H256::zero(), &proof, &mut timing)
+        .is_err());
+    assert_eq!(timing.verify_calls, 3);
+}
+
 #[test]
 fn test_ckb_smt_verify_invalid() {
     let key = str_to_h256("e8c0265680a02b680b6cbc880348f062b825b28e237da7169aded4bcac0a04e5");
@@ -136,3 +162,95 @@ proptest! {
         }
     }
 }
+
+#[test]
+fn test_ckb_smt_verify_multi_leaves() {
+    use rand::Rng;
+
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..50)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut tree = CkbSMT::default();
+    tree.update_all(pairs.clone()).expect("update");
+
+    // absent keys next to existing ones: the first merges with a plain sibling,
+    // the second with a sibling merged with zeros
+    let mut neighbor = pairs[0].0;
+    if neighbor.get_bit(0) {
+        neighbor.clear_bit(0);
+    } else {
+        neighbor.set_bit(0);
+    }
+    let mut distant = pairs[1].0;
+    if distant.get_bit(100) {
+        distant.clear_bit(100);
+    } else {
+        distant.set_bit(100);
+    }
+    let absent: Vec<H256> = vec![neighbor, distant, rng.gen::<[u8; 32]>().into()];
+
+    let cases: Vec<Vec<H256>> = vec![
+        pairs.iter().map(|(k, _v)| *k).collect(),
+        pairs.iter().take(7).map(|(k, _v)| *k).collect(),
+        absent.clone(),
+        pairs
+            .iter()
+            .skip(10)
+            .take(3)
+            .map(|(k, _v)| *k)
+            .chain(absent.iter().cloned())
+            .collect(),
+    ];
+    for keys in cases {
+        let proof = tree.merkle_proof(keys.clone()).expect("proof");
+        let compiled_proof: Vec<u8> = proof.compile(keys.clone()).expect("compile").into();
+        let mut builder = SMTBuilder::new();
+        for key in &keys {
+            let value = tree.get(key).expect("get");
+            builder = builder.insert(key, &value).unwrap();
+        }
+        let smt = builder.build().unwrap();
+        smt.verify(tree.root(), &compiled_proof)
+            .expect("verify with c");
+    }
+
+    // zero bits of a sibling must lie below its height
+    let key = str_to_h256("381dc5391dab099da5e28acd1ad859a051cf18ace804d037f12819c6fbc0e18b");
+    let val = str_to_h256("9158ce9b0e11dd150ba2ae5d55c1db04b1c5986ec626f2e38a93fe8ad0b2923b");
+    let root_hash = str_to_h256("ebe0fab376cd802d364eeb44af20c67a74d6183a33928fead163120ef12e6e06");
+    let mut proof = str_to_vec(
+        "4c4fff51ff322de8a89fe589987f97220cfcb6820bd798b31a0b56ffea221093d35f909e580b00000000000000000000000000000000000000000000000000000000000000");
+    let smt = SMTBuilder::new()
+        .insert(&key, &val)
+        .unwrap()
+        .build()
+        .unwrap();
+    assert!(smt.verify(&root_hash, &proof).is_ok());
+    let last = proof.len() - 1;
+    proof[last] = 0x80;
+    assert!(smt.verify(&root_hash, &proof).is_err());
+}
+
+#[test]
+fn test_ckb_smt_verify_same_side_merge() {
+    // two keys differing only in bit 0 are lifted to height 1 and merged
+    // there, both on the same side of their parent
+    let key_a = str_to_h256("381dc5391dab099da5e28acd1ad859a051cf18ace804d037f12819c6fbc0e18b");
+    let key_b = str_to_h256("391dc5391dab099da5e28acd1ad859a051cf18ace804d037f12819c6fbc0e18b");
+    let val = str_to_h256("9158ce9b0e11dd150ba2ae5d55c1db04b1c5986ec626f2e38a93fe8ad0b2923b");
+    let proof = str_to_vec("4c4f014c4f01484ffe");
+    let leaves = vec![(key_a, val), (key_b, val)];
+
+    let compiled_proof = CompiledMerkleProof(proof.clone());
+    assert!(compiled_proof
+        .compute_root::<CkbBlake2bHasher>(leaves.clone())
+        .is_err());
+
+    let mut builder = SMTBuilder::new();
+    for (key, value) in &leaves {
+        builder = builder.insert(key, value).unwrap();
+    }
+    let smt = builder.build().unwrap();
+    assert!(smt.verify(&H256::zero(), &proof).is_err());
+}
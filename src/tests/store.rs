@@ -0,0 +1,836 @@
+use crate::*;
+use crate::{
+    blake2b::Blake2bHasher,
+    checkpoint::{compact, CheckpointStore},
+    compact_store::{decode_branch, encode_branch, CompactStore},
+    default_store::DefaultStore,
+    detach_store::DetachStore,
+    error::Error,
+    export::checksum,
+    hybrid_store::HybridStore,
+    leaf_count_store::LeafCountStore,
+    multi_tree::{MultiTreeStore, Namespace, TreeChanges},
+    segment_store::SegmentStore,
+    snapshot::{publish, read_h256, read_u32, SnapshotView},
+    trace_store::{TraceEvent, TraceOp, TraceStore, TraceSummary},
+    traits::{Store, Value, ValueCodec},
+    tree::{BranchKey, BranchNode},
+    value_log::ValueLogStore,
+};
+use rand::Rng;
+
+#[allow(clippy::upper_case_acronyms)]
+type SMT = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>>;
+type CompactSMT = SparseMerkleTree<Blake2bHasher, H256, CompactStore<H256>>;
+
+type TracedSMT = SparseMerkleTree<Blake2bHasher, H256, TraceStore<DefaultStore<H256>>>;
+
+#[test]
+fn test_trace_store() {
+    let mut tree = TracedSMT::new(H256::zero(), TraceStore::new(DefaultStore::default(), 4096));
+    let key: H256 = [1u8; 32].into();
+    tree.update(key, [2u8; 32].into()).expect("update");
+    let events = tree.store().take_events();
+    // one leaf write, then a branch read and a branch write for every height
+    assert_eq!(events.len(), 1 + 256 * 2);
+    assert_eq!(events[0].op, TraceOp::InsertLeaf);
+    assert!(events
+        .iter()
+        .filter(|e| e.op == TraceOp::GetBranch)
+        .all(|e| !e.hit));
+
+    tree.update(key, [3u8; 32].into()).expect("update");
+    tree.get(&key).expect("get");
+    let events = tree.store().take_events();
+    let summary = TraceSummary::analyze(&events);
+    let leaves = &summary.levels[TraceSummary::LEAVES];
+    assert_eq!((leaves.reads, leaves.hits, leaves.writes), (1, 1, 1));
+    assert_eq!(leaves.working_set, 1);
+    for level in &summary.levels[..256] {
+        assert_eq!((level.reads, level.hits, level.misses()), (1, 1, 0));
+        assert_eq!(level.working_set, 1);
+        // each branch is written right after it is read
+        assert_eq!(level.reuses, 1);
+        assert_eq!(level.avg_reuse_distance(), 0.0);
+    }
+    assert_eq!(summary.key_ranges.iter().sum::<u64>(), events.len() as u64);
+
+    // leaf reads a b c a b b: a and b come back after 2 distinct keys, then b after 0
+    let event = |key: u8| TraceEvent {
+        op: TraceOp::GetLeaf,
+        height: None,
+        key: [key; 32].into(),
+        hit: true,
+        latency_ns: 0,
+    };
+    let events: Vec<TraceEvent> = [1, 2, 3, 1, 2, 2].iter().map(|k| event(*k)).collect();
+    let leaves = &TraceSummary::analyze(&events).levels[TraceSummary::LEAVES];
+    assert_eq!((leaves.working_set, leaves.reuses), (3, 3));
+    assert_eq!(leaves.reuse_distance_sum, 4);
+
+    // the ring buffer keeps only the latest events
+    let store = TraceStore::new(DefaultStore::<H256>::default(), 8);
+    let mut tree: TracedSMT = SparseMerkleTree::new(H256::zero(), store);
+    tree.update(key, [2u8; 32].into()).expect("update");
+    let events = tree.store().take_events();
+    assert_eq!(events.len(), 8);
+    assert_eq!(events[7].height, Some(255));
+
+    // the inner store still detaches subtrees, one removal is traced
+    type TracedDetachSMT =
+        SparseMerkleTree<Blake2bHasher, H256, TraceStore<DetachStore<DefaultStore<H256>>>>;
+    let store = TraceStore::new(DetachStore::default(), 4096);
+    let mut tree = TracedDetachSMT::new(H256::zero(), store);
+    tree.update(key, [2u8; 32].into()).expect("update");
+    tree.store().take_events();
+    tree.delete_prefix(255, H256::zero())
+        .expect("delete prefix");
+    assert!(tree.is_empty() && !tree.is_reclaimed());
+    let events = tree.store().take_events();
+    let removals = events.iter().filter(|e| e.op == TraceOp::RemoveBranch);
+    assert_eq!(removals.count(), 1);
+    assert!(tree.reclaim(usize::MAX).expect("reclaim"));
+    assert!(tree.store().inner().inner().branches_map().is_empty());
+}
+
+#[test]
+fn test_compact_store() {
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..100)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut tree = SMT::default();
+    let mut compact_tree = CompactSMT::default();
+    tree.update_all(pairs.clone()).expect("update");
+    compact_tree.update_all(pairs.clone()).expect("update");
+    assert_eq!(tree.root(), compact_tree.root());
+
+    let branches = tree.store().branches_map();
+    assert_eq!(branches.len(), compact_tree.store().branches_map().len());
+    for (key, branch) in branches {
+        let data = encode_branch(branch);
+        assert_eq!(decode_branch(&data).as_ref(), Some(branch));
+        assert_eq!(
+            compact_tree.store().get_branch(key),
+            Ok(Some(branch.clone()))
+        );
+    }
+    // one child of most branches is zero, the other merged with zeros
+    let full_size = branches.len() * core::mem::size_of::<BranchNode>();
+    assert!(compact_tree.store().branches_bytes() * 2 < full_size);
+
+    let (key, _value) = pairs[0];
+    let proof = compact_tree.merkle_proof(vec![key]).expect("proof");
+    assert_eq!(proof, tree.merkle_proof(vec![key]).expect("proof"));
+    for (key, _value) in pairs {
+        compact_tree.update(key, H256::zero()).expect("update");
+    }
+    assert!(compact_tree.is_empty());
+    assert!(compact_tree.store().branches_map().is_empty());
+
+    assert_eq!(decode_branch(&[]), None);
+    // a value child must be followed by 32 bytes
+    assert_eq!(decode_branch(&[1, 0]), None);
+}
+
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+struct Blob(Vec<u8>);
+
+impl Value for Blob {
+    fn to_h256(&self) -> H256 {
+        if self.0.is_empty() {
+            return H256::zero();
+        }
+        let mut hasher = blake2b::Blake2bHasher::default();
+        for chunk in self.0.chunks(32) {
+            let mut buf = [0u8; 32];
+            buf[..chunk.len()].copy_from_slice(chunk);
+            traits::Hasher::write_h256(&mut hasher, &buf.into());
+        }
+        traits::Hasher::finish(hasher)
+    }
+    fn zero() -> Self {
+        Default::default()
+    }
+}
+
+impl ValueCodec for Blob {
+    fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.0);
+    }
+    fn decode(bytes: &[u8]) -> Option<Self> {
+        Some(Blob(bytes.to_vec()))
+    }
+}
+
+#[test]
+fn test_value_log_store() {
+    type BlobSMT = SparseMerkleTree<Blake2bHasher, Blob, DefaultStore<Blob>>;
+    type LogSMT = SparseMerkleTree<Blake2bHasher, Blob, ValueLogStore<Blob>>;
+
+    let mut rng = rand::thread_rng();
+    fn random_blob<R: Rng>(rng: &mut R) -> Blob {
+        let mut data = vec![0u8; rng.gen_range(1, 4096)];
+        rng.fill(&mut data[..]);
+        Blob(data)
+    }
+    let keys: Vec<H256> = (0..50).map(|_| rng.gen::<[u8; 32]>().into()).collect();
+    let mut tree = BlobSMT::default();
+    let mut log_tree = LogSMT::default();
+    for _round in 0..3 {
+        for key in &keys {
+            let blob = random_blob(&mut rng);
+            tree.update(*key, blob.clone()).expect("update");
+            log_tree.update(*key, blob).expect("update");
+        }
+    }
+    for key in keys.iter().take(10) {
+        tree.update(*key, Blob::zero()).expect("update");
+        log_tree.update(*key, Blob::zero()).expect("update");
+    }
+    assert_eq!(tree.root(), log_tree.root());
+
+    // two thirds of the log are overwritten values, plus the removed ones
+    let store = log_tree.store();
+    let size = store.log().size() as u64;
+    assert!(store.garbage_bytes() * 3 > size * 2);
+    for key in &keys {
+        let value = tree.get(key).expect("get");
+        assert_eq!(log_tree.get(key).expect("get"), value);
+        let hash = store.get_leaf_hash(key);
+        assert_eq!(hash.unwrap_or_else(H256::zero), value.to_h256());
+    }
+
+    let garbage = store.garbage_bytes();
+    let mut reclaimed = 0;
+    while log_tree.store().garbage_bytes() > 0 {
+        reclaimed += log_tree.store_mut().gc_step(16 * 1024);
+    }
+    assert_eq!(reclaimed as u64, garbage);
+    for key in &keys {
+        assert_eq!(log_tree.get(key).expect("get"), tree.get(key).expect("get"));
+    }
+    let key = keys[20];
+    let blob = random_blob(&mut rng);
+    tree.update(key, blob.clone()).expect("update");
+    log_tree.update(key, blob).expect("update");
+    assert_eq!(tree.root(), log_tree.root());
+    let proof = log_tree.merkle_proof(vec![key]).expect("proof");
+    let leaf_hash = log_tree.store().get_leaf_hash(&key).expect("hash");
+    assert!(proof
+        .verify::<Blake2bHasher>(log_tree.root(), vec![(key, leaf_hash)])
+        .expect("verify"));
+}
+
+#[test]
+fn test_leaf_count_store() {
+    type CountSMT = SparseMerkleTree<Blake2bHasher, H256, LeafCountStore<DefaultStore<H256>>>;
+
+    fn check(tree: &CountSMT, keys: &[H256]) {
+        let mut keys = keys.to_vec();
+        keys.sort();
+        // every branch counts the leaves under it
+        let branches = tree.store().inner().branches_map();
+        assert_eq!(tree.store().counts().len(), branches.len());
+        for (i, key) in keys.iter().enumerate() {
+            assert_eq!(tree.nth_key(i as u64), Ok(Some(*key)));
+        }
+        assert_eq!(tree.nth_key(keys.len() as u64), Ok(None));
+        let mut rng = rand::thread_rng();
+        for _ in 0..20 {
+            let mut bounds: Vec<H256> = (0..2)
+                .map(|_| {
+                    if !keys.is_empty() && rng.gen() {
+                        keys[rng.gen_range(0, keys.len())]
+                    } else {
+                        rng.gen::<[u8; 32]>().into()
+                    }
+                })
+                .collect();
+            bounds.sort();
+            let expected = keys
+                .iter()
+                .filter(|k| **k >= bounds[0] && **k <= bounds[1])
+                .count();
+            assert_eq!(
+                tree.count_range(&bounds[0], &bounds[1]),
+                Ok(expected as u64)
+            );
+        }
+        assert_eq!(
+            tree.count_range(&H256::zero(), &[255u8; 32].into()),
+            Ok(keys.len() as u64)
+        );
+    }
+
+    let mut rng = rand::thread_rng();
+    let mut tree = CountSMT::default();
+    check(&tree, &[]);
+    let mut keys: Vec<H256> = (0..50)
+        .map(|i| {
+            let mut key: [u8; 32] = rng.gen();
+            key[31] = (i % 4) as u8;
+            key.into()
+        })
+        .collect();
+    for key in &keys[..25] {
+        tree.update(*key, rng.gen::<[u8; 32]>().into())
+            .expect("update");
+    }
+    tree.update_all(
+        keys[25..]
+            .iter()
+            .map(|k| (*k, rng.gen::<[u8; 32]>().into()))
+            .collect(),
+    )
+    .expect("update_all");
+    check(&tree, &keys);
+
+    // delete by update, update_all and delete_prefix
+    tree.update(keys[0], H256::zero()).expect("update");
+    tree.update_all(vec![(keys[1], H256::zero()), (keys[4], H256::zero())])
+        .expect("update_all");
+    let prefix = keys[2];
+    tree.delete_prefix(247, prefix).expect("delete prefix");
+    tree.reclaim(usize::MAX).expect("reclaim");
+    let removed = [keys[0], keys[1], keys[4]];
+    keys.retain(|k| !removed.contains(k) && k.as_slice()[31] != 2);
+    check(&tree, &keys);
+
+    // counts of a tree filled without them are counted when wrapped
+    let mut plain = SMT::default();
+    plain
+        .update_all(
+            keys.iter()
+                .map(|k| (*k, rng.gen::<[u8; 32]>().into()))
+                .collect(),
+        )
+        .expect("update_all");
+    let root = *plain.root();
+    let counted = CountSMT::with_leaf_counts(plain).expect("with leaf counts");
+    assert_eq!(counted.root(), &root);
+    check(&counted, &keys);
+    check(
+        &CountSMT::with_leaf_counts(SMT::default()).expect("with leaf counts"),
+        &[],
+    );
+
+    // split and graft keep counts
+    let shard = tree.split(247, keys[0]).expect("split");
+    let moved = keys[0].as_slice()[31];
+    let (shard_keys, rest): (Vec<H256>, Vec<H256>) =
+        keys.iter().partition(|k| k.as_slice()[31] == moved);
+    check(&shard, &shard_keys);
+    check(&tree, &rest);
+    let mut prefix = [0u8; 32];
+    prefix[31] = moved;
+    tree.graft(shard, 247, prefix.into()).expect("graft");
+    check(&tree, &keys);
+
+    let plain = SparseMerkleTree::<Blake2bHasher, H256, DefaultStore<H256>>::default();
+    assert_eq!(plain.nth_key(0), Err(Error::MissingLeafCounts));
+}
+
+#[test]
+fn test_snapshot_view() {
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..100)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut tree = SMT::default();
+    tree.update_all(pairs.clone()).expect("update_all");
+    // a detached subtree is not part of the snapshot
+    tree.delete_prefix(250, pairs[0].0).expect("delete prefix");
+
+    let bytes = tree.snapshot().expect("snapshot");
+    let view = SnapshotView::<H256>::new(&bytes).expect("view");
+    assert_eq!(view.root(), tree.root());
+    let mut snapshot_tree = view.into_tree::<Blake2bHasher, 256>().expect("tree");
+    assert_eq!(snapshot_tree.root(), tree.root());
+    for (key, _value) in &pairs {
+        assert_eq!(snapshot_tree.get(key), tree.get(key));
+    }
+    let keys: Vec<H256> = pairs.iter().take(10).map(|(k, _)| *k).collect();
+    assert_eq!(
+        snapshot_tree.merkle_proof(keys.clone()),
+        tree.merkle_proof(keys)
+    );
+    assert!(snapshot_tree.update(pairs[1].0, H256::zero()).is_err());
+
+    // the depth must match, a truncated snapshot is rejected
+    assert!(view.into_tree::<Blake2bHasher, 64>().is_err());
+    assert!(SnapshotView::<H256>::new(&bytes[..bytes.len() / 2]).is_err());
+    let empty = SMT::default().snapshot().expect("snapshot");
+    let empty_view = SnapshotView::<H256>::new(&empty).expect("view");
+    assert_eq!(empty_view.branches_len(), 0);
+    assert_eq!(empty_view.leaves_len(), 0);
+
+    // a published snapshot is replaced as a whole
+    let path = std::env::temp_dir().join(format!("smt-snapshot-{}", rng.gen::<u64>()));
+    publish(&path, &bytes).expect("publish");
+    assert_eq!(std::fs::read(&path).expect("read"), bytes);
+    tree.update(pairs[1].0, H256::zero()).expect("update");
+    let bytes = tree.snapshot().expect("snapshot");
+    publish(&path, &bytes).expect("publish");
+    let published = std::fs::read(&path).expect("read");
+    let view = SnapshotView::<H256>::new(&published).expect("view");
+    assert_eq!(view.root(), tree.root());
+    // concurrent publishers write their own temporary files
+    let publishers: Vec<_> = (0..4)
+        .map(|_| {
+            let (path, bytes) = (path.clone(), bytes.clone());
+            std::thread::spawn(move || publish(&path, &bytes))
+        })
+        .collect();
+    for publisher in publishers {
+        publisher.join().expect("join").expect("publish");
+    }
+    assert_eq!(std::fs::read(&path).expect("read"), bytes);
+    let name = path.file_name().expect("name").to_owned();
+    let leftovers = std::fs::read_dir(std::env::temp_dir())
+        .expect("read dir")
+        .filter_map(|entry| entry.ok())
+        .filter(|entry| {
+            let entry_name = entry.file_name();
+            entry_name != name
+                && entry_name
+                    .to_string_lossy()
+                    .starts_with(&*name.to_string_lossy())
+        })
+        .count();
+    assert_eq!(leftovers, 0);
+    std::fs::remove_file(&path).expect("remove");
+}
+
+#[test]
+fn test_hybrid_store() {
+    type HybridSMT = SparseMerkleTree<Blake2bHasher, H256, HybridStore<DefaultStore<H256>>>;
+
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..1000)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut expected = SMT::default();
+    expected.update_all(pairs.clone()).expect("update_all");
+    let mut tree = HybridSMT::new(H256::zero(), HybridStore::new(DefaultStore::default()));
+    tree.update_all(pairs[..500].to_vec()).expect("update_all");
+    let dense_levels = tree.store_mut().adapt::<H256>().expect("adapt");
+    assert!(dense_levels > 8 && dense_levels < 12);
+    // every dense level is at least half full
+    for (level, occupied) in tree.store().occupied().iter().enumerate() {
+        assert!(occupied * 2 >= 1 << level);
+    }
+    tree.update_all(pairs[500..].to_vec()).expect("update_all");
+    assert_eq!(tree.root(), expected.root());
+    let dense_levels = tree.store_mut().adapt::<H256>().expect("adapt");
+    assert!(dense_levels > 10 && dense_levels < 13);
+
+    // branches are either in a dense level or in the inner store
+    let branches = expected.store().branches_map();
+    let dense: usize = tree.store().occupied().iter().sum();
+    assert_eq!(
+        dense + tree.store().inner().branches_map().len(),
+        branches.len()
+    );
+    for (branch_key, branch) in branches {
+        assert_eq!(
+            tree.store().get_branch(branch_key),
+            Ok(Some(branch.clone()))
+        );
+    }
+    let keys: Vec<H256> = pairs.iter().take(20).map(|(k, _)| *k).collect();
+    assert_eq!(tree.merkle_proof(keys.clone()), expected.merkle_proof(keys));
+
+    // deleting most keys empties the dense levels, adapt shrinks them
+    for (key, _value) in &pairs[20..] {
+        tree.update(*key, H256::zero()).expect("update");
+        expected.update(*key, H256::zero()).expect("update");
+    }
+    assert_eq!(tree.root(), expected.root());
+    let dense_levels = tree.store_mut().adapt::<H256>().expect("adapt");
+    assert!(dense_levels < 8);
+    let inner = tree.take_store().into_inner::<H256>().expect("into_inner");
+    assert_eq!(inner.branches_map(), expected.store().branches_map());
+    assert_eq!(inner.leaves_map(), expected.store().leaves_map());
+
+    // a shallow tree
+    type SMT64 = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>, 64>;
+    type HybridSMT64 =
+        SparseMerkleTree<Blake2bHasher, H256, HybridStore<DefaultStore<H256>, 64>, 64>;
+    let pairs: Vec<(H256, H256)> = (0..200u64)
+        .map(|i| {
+            let mut key = [0u8; 32];
+            key[..8].copy_from_slice(&rng.gen::<u64>().to_le_bytes());
+            (key.into(), [i as u8 + 1; 32].into())
+        })
+        .collect();
+    let mut expected = SMT64::default();
+    expected.update_all(pairs.clone()).expect("update_all");
+    let mut tree = HybridSMT64::new(H256::zero(), HybridStore::new(DefaultStore::default()));
+    tree.update_all(pairs[..100].to_vec()).expect("update_all");
+    assert!(tree.store_mut().adapt::<H256>().expect("adapt") > 5);
+    tree.update_all(pairs[100..].to_vec()).expect("update_all");
+    assert_eq!(tree.root(), expected.root());
+    let keys: Vec<H256> = pairs.iter().take(20).map(|(k, _)| *k).collect();
+    assert_eq!(tree.merkle_proof(keys.clone()), expected.merkle_proof(keys));
+
+    // leaf counts follow the branches in and out of the dense levels
+    type CountSMT = SparseMerkleTree<Blake2bHasher, H256, LeafCountStore<DefaultStore<H256>>>;
+    type HybridCountSMT =
+        SparseMerkleTree<Blake2bHasher, H256, HybridStore<LeafCountStore<DefaultStore<H256>>>>;
+    let pairs: Vec<(H256, H256)> = (0..256)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let max_key: H256 = [255u8; 32].into();
+    let mut expected = CountSMT::default();
+    expected.update_all(pairs.clone()).expect("update_all");
+    let mut tree = HybridCountSMT::new(H256::zero(), HybridStore::new(LeafCountStore::default()));
+    tree.update_all(pairs.clone()).expect("update_all");
+    assert!(tree.store_mut().adapt::<H256>().expect("adapt") > 7);
+    assert_eq!(tree.count_range(&H256::zero(), &max_key), Ok(256));
+    let mut keys: Vec<H256> = pairs.iter().map(|(k, _)| *k).collect();
+    keys.sort();
+    assert_eq!(tree.nth_key(100), Ok(Some(keys[100])));
+    // deleting keys under dense branches, then demoting them
+    for (key, _value) in &pairs[16..] {
+        tree.update(*key, H256::zero()).expect("update");
+        expected.update(*key, H256::zero()).expect("update");
+    }
+    assert_eq!(tree.count_range(&H256::zero(), &max_key), Ok(16));
+    assert!(tree.store_mut().adapt::<H256>().expect("adapt") < 8);
+    assert_eq!(tree.count_range(&H256::zero(), &max_key), Ok(16));
+    let inner = tree.take_store().into_inner::<H256>().expect("into_inner");
+    assert_eq!(inner.counts(), expected.store().counts());
+}
+
+#[test]
+fn test_multi_tree_store() {
+    fn random_batch<R: Rng>(
+        rng: &mut R,
+        namespaces: &[Namespace],
+    ) -> Vec<(Namespace, Vec<(H256, H256)>)> {
+        namespaces
+            .iter()
+            .map(|ns| {
+                let leaves = (0..20)
+                    .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+                    .collect();
+                (*ns, leaves)
+            })
+            .collect()
+    }
+
+    let mut rng = rand::thread_rng();
+    let namespaces: Vec<Namespace> = (0..20).map(|_| rng.gen::<[u8; 32]>().into()).collect();
+    let mut store = MultiTreeStore::<H256>::default();
+    let mut parallel_store = MultiTreeStore::<H256>::default();
+    let mut expected: Vec<SMT> = namespaces.iter().map(|_| SMT::default()).collect();
+    for _ in 0..3 {
+        let mut batch = random_batch(&mut rng, &namespaces);
+        // a namespace twice in a batch, the last write of a key wins
+        let (ns, leaves) = batch[0].clone();
+        batch.push((ns, vec![(leaves[0].0, H256::zero())]));
+        for (i, (_ns, leaves)) in batch.iter().enumerate() {
+            expected[i % namespaces.len()]
+                .update_all(leaves.clone())
+                .expect("update_all");
+        }
+        let roots = store
+            .commit::<Blake2bHasher, 256>(batch.clone())
+            .expect("commit");
+        assert_eq!(roots.len(), namespaces.len());
+        for ((ns, root), tree) in roots.iter().zip(&expected) {
+            assert_eq!(root, tree.root());
+            assert_eq!(&store.root(ns), tree.root());
+        }
+        let roots_parallel = parallel_store
+            .commit_parallel::<Blake2bHasher, 256>(batch, 3)
+            .expect("commit");
+        assert_eq!(roots_parallel, roots);
+    }
+    let branches: usize = expected
+        .iter()
+        .map(|t| t.store().branches_map().len())
+        .sum();
+    assert_eq!(store.branches_map().len(), branches);
+    assert_eq!(parallel_store.branches_map().len(), branches);
+
+    // read and update one tree through its overlay
+    let mut tree = store.tree::<Blake2bHasher, 256>(namespaces[1]);
+    let keys: Vec<H256> = expected[1]
+        .store()
+        .leaves_map()
+        .keys()
+        .take(5)
+        .cloned()
+        .collect();
+    assert_eq!(
+        tree.merkle_proof(keys.clone()),
+        expected[1].merkle_proof(keys.clone())
+    );
+    for key in &keys {
+        assert_eq!(tree.get(key), expected[1].get(key));
+    }
+    tree.delete_prefix(255, H256::zero())
+        .expect("delete prefix");
+    let changes = TreeChanges::from_tree(tree).expect("changes");
+    assert_eq!(store.root(&namespaces[1]), *expected[1].root());
+    store.apply(vec![changes]);
+    assert_eq!(store.root(&namespaces[1]), H256::zero());
+    assert_eq!(
+        store.branches_map().len(),
+        branches - expected[1].store().branches_map().len()
+    );
+
+    // a failed tree update writes nothing
+    let mut store = MultiTreeStore::<H256>::default();
+    let mut key = [0u8; 32];
+    key[0] = 1;
+    store
+        .commit::<Blake2bHasher, 64>(vec![(namespaces[0], vec![(key.into(), key.into())])])
+        .expect("commit");
+    let root = store.root(&namespaces[0]);
+    let out_of_range: H256 = [1u8; 32].into();
+    let ret = store.commit::<Blake2bHasher, 64>(vec![
+        (namespaces[0], vec![(H256::zero(), key.into())]),
+        (namespaces[1], vec![(out_of_range, key.into())]),
+    ]);
+    assert_eq!(ret, Err(Error::KeyOutOfRange(out_of_range)));
+    assert_eq!(store.root(&namespaces[0]), root);
+    assert_eq!(store.roots().len(), 1);
+    assert_eq!(store.leaves_map().len(), 1);
+}
+
+#[test]
+fn test_checkpoints() {
+    type CheckpointSMT = SparseMerkleTree<Blake2bHasher, H256, CheckpointStore<DefaultStore<H256>>>;
+
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..500)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut expected = SMT::default();
+    let mut tree = CheckpointSMT::new(H256::zero(), CheckpointStore::new(DefaultStore::default()));
+    expected.update_all(pairs.clone()).expect("update_all");
+    tree.update_all(pairs.clone()).expect("update_all");
+    let base = tree.checkpoint().expect("checkpoint");
+    assert_eq!(tree.store().base_root(), expected.root());
+    assert_eq!(tree.store().dirty_len(), (0, 0));
+
+    // deltas hold the churn only: updates, new keys and deletions
+    let mut chain = vec![base.clone()];
+    for i in 0..3 {
+        let mut leaves: Vec<(H256, H256)> = pairs[i * 10..i * 10 + 5]
+            .iter()
+            .map(|(k, _)| (*k, rng.gen::<[u8; 32]>().into()))
+            .collect();
+        leaves.extend(
+            pairs[i * 10 + 5..i * 10 + 10]
+                .iter()
+                .map(|(k, _)| (*k, H256::zero())),
+        );
+        leaves.push((rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()));
+        expected.update_all(leaves.clone()).expect("update_all");
+        tree.update_all(leaves).expect("update_all");
+        let delta = tree.checkpoint().expect("checkpoint");
+        assert!(delta.len() * 10 < base.len());
+        chain.push(delta);
+    }
+    // a deleted prefix is written as removals
+    tree.delete_prefix(1, H256::zero()).expect("delete prefix");
+    expected
+        .delete_prefix(1, H256::zero())
+        .expect("delete prefix");
+    chain.push(tree.checkpoint().expect("checkpoint"));
+
+    let restored = CheckpointSMT::restore(&chain).expect("restore");
+    assert_eq!(restored.root(), expected.root());
+    assert_eq!(restored.store().base_root(), expected.root());
+    let inner = restored.take_store().into_inner();
+    assert_eq!(inner.branches_map(), expected.store().branches_map());
+    assert_eq!(inner.leaves_map(), expected.store().leaves_map());
+
+    // compacting the chain gives a new base, a base checkpoint of the tree
+    let compacted = compact(&chain).expect("compact");
+    assert!(compacted.len() < base.len());
+    assert!(compacted == tree.base_checkpoint().expect("base checkpoint"));
+    let restored = CheckpointSMT::restore(vec![compacted]).expect("restore");
+    assert_eq!(restored.root(), expected.root());
+    // compacting deltas only keeps the removals
+    let delta = compact(&chain[1..]).expect("compact");
+    let restored = CheckpointSMT::restore(vec![base.clone(), delta]).expect("restore");
+    assert_eq!(restored.root(), expected.root());
+    let mut tree = restored;
+    tree.update(pairs[0].0, H256::zero()).expect("update");
+    let delta = tree.checkpoint().expect("checkpoint");
+    let mut chain_after = chain.clone();
+    chain_after.push(delta);
+    assert_eq!(
+        CheckpointSMT::restore(&chain_after)
+            .expect("restore")
+            .root(),
+        tree.root()
+    );
+
+    // a delta applies only to its base
+    let ret = CheckpointSMT::restore(vec![&base, &chain[2]]);
+    assert!(matches!(ret, Err(Error::RootMismatch { .. })));
+    assert!(matches!(
+        compact(chain[2..=3].iter().rev().collect::<Vec<_>>()),
+        Err(Error::RootMismatch { .. })
+    ));
+    let mut corrupted = chain[1].clone();
+    let last = corrupted.len() - 1;
+    corrupted[last] ^= 1;
+    let ret = CheckpointSMT::restore(vec![&base, &corrupted]);
+    assert_eq!(ret.err(), Some(Error::Store("corrupted checkpoint".into())));
+    // the root of the header is not covered by the checksum
+    let mut forged = chain[3].clone();
+    forged[42] ^= 1;
+    let ret = CheckpointSMT::restore(vec![&chain[0], &chain[1], &chain[2], &forged]);
+    assert!(
+        matches!(ret, Err(Error::RootMismatch { actual, .. }) if actual == read_h256(&chain[3][42..]))
+    );
+    // a forged leaf with a valid checksum is caught by its branch
+    let mut forged = chain[2].clone();
+    let mut pos = 98;
+    while forged[pos] != 1 || read_u32(&forged[pos + 34..]) == u32::MAX {
+        let len = read_u32(&forged[pos + 34..]);
+        pos += 38 + if len == u32::MAX { 0 } else { len as usize };
+    }
+    forged[pos + 38] ^= 1;
+    let sum = checksum(&forged[98..]);
+    forged[82..90].copy_from_slice(&sum.to_le_bytes());
+    let ret = CheckpointSMT::restore(vec![&chain[0], &chain[1], &forged]);
+    assert_eq!(ret.err(), Some(Error::Store("corrupted checkpoint".into())));
+
+    // leaf counts are rebuilt for a store keeping them
+    type CountCheckpointSMT =
+        SparseMerkleTree<Blake2bHasher, H256, CheckpointStore<LeafCountStore<DefaultStore<H256>>>>;
+    let restored = CountCheckpointSMT::restore(&chain).expect("restore");
+    let leaves = expected.store().leaves_map().len() as u64;
+    assert_eq!(
+        restored.count_range(&H256::zero(), &[255u8; 32].into()),
+        Ok(leaves)
+    );
+    let inner = restored.take_store().into_inner();
+    assert_eq!(inner.counts().len(), inner.inner().branches_map().len());
+}
+
+#[test]
+fn test_segment_store() {
+    type SegmentSMT = SparseMerkleTree<Blake2bHasher, H256, SegmentStore<H256>>;
+
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..300)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut expected = SMT::default();
+    let mut tree = SegmentSMT::new(H256::zero(), SegmentStore::new(1 << 16));
+    expected.update_all(pairs.clone()).expect("update_all");
+    tree.update_all(pairs.clone()).expect("update_all");
+    // deletes and overwrites leave holes
+    for (key, _value) in &pairs[..150] {
+        tree.update(*key, H256::zero()).expect("update");
+        expected.update(*key, H256::zero()).expect("update");
+    }
+    assert_eq!(tree.root(), expected.root());
+    let size = tree.store().size();
+    assert!(tree.store().garbage_bytes() * 2 > size);
+
+    // reads and writes go on between the steps
+    tree.store_mut().start_compaction();
+    let total = tree.store().progress().expect("progress").total;
+    assert_eq!(total, tree.store().len());
+    let mut steps = 0;
+    while !tree.store_mut().compact_step(1000).expect("compact") {
+        steps += 1;
+        let done = tree.store().progress().expect("progress").done;
+        assert_eq!(done, core::cmp::min(steps * 1000, total));
+        let leaves = vec![
+            (pairs[steps].0, rng.gen::<[u8; 32]>().into()),
+            (pairs[150 + steps].0, H256::zero()),
+        ];
+        tree.update_all(leaves.clone()).expect("update_all");
+        expected.update_all(leaves).expect("update_all");
+        let keys: Vec<H256> = pairs[200..210].iter().map(|(k, _)| *k).collect();
+        assert_eq!(tree.merkle_proof(keys.clone()), expected.merkle_proof(keys));
+    }
+    assert!(steps > 10);
+    assert_eq!(tree.store().progress(), None);
+    assert_eq!(tree.root(), expected.root());
+    for (key, _value) in &pairs {
+        assert_eq!(tree.get(key), expected.get(key));
+    }
+    let stats = *tree.store().stats();
+    assert_eq!(stats.runs, 1);
+    assert_eq!(stats.steps as usize, steps + 1);
+    assert!(stats.relocated > 0 && stats.relocated as usize <= total);
+    // the old segments are gone, garbage is left by the writes in between
+    assert!(stats.reclaimed_bytes as usize >= size);
+    assert!(tree.store().size() < size * 3 / 4);
+
+    // without writes in between, the branches of a path are in order
+    tree.store_mut().start_compaction();
+    while !tree.store_mut().compact_step(1000).expect("compact") {}
+    assert_eq!(tree.store().garbage_bytes(), 0);
+    for (key, _value) in &pairs[200..] {
+        let locations: Vec<_> = (0..=255u8)
+            .rev()
+            .filter_map(|height| {
+                let branch_key = BranchKey::new(height, key.parent_path(height));
+                tree.store().branch_location(&branch_key)
+            })
+            .map(|location| (location.segment, location.offset))
+            .collect();
+        assert_eq!(locations.len(), 256);
+        assert!(locations.windows(2).all(|w| w[0] < w[1]));
+    }
+
+    // the segment files replay into the same store
+    let dir = std::env::temp_dir().join(format!("smt-segments-{}", rng.gen::<u64>()));
+    std::fs::create_dir(&dir).expect("create dir");
+    tree.store_mut().sync(&dir).expect("sync");
+    tree.update_all(pairs[..50].to_vec()).expect("update_all");
+    tree.store_mut().start_compaction();
+    while !tree.store_mut().compact_step(1000).expect("compact") {}
+    tree.update(pairs[299].0, H256::zero()).expect("update");
+    tree.store_mut().sync(&dir).expect("sync");
+    let files = std::fs::read_dir(&dir).expect("read dir").count();
+    assert_eq!(files, tree.store().segments_len());
+    let store = SegmentStore::<H256>::open(&dir, 1 << 16).expect("open");
+    assert_eq!(store.len(), tree.store().len());
+    let reopened = SegmentSMT::new(*tree.root(), store);
+    for (key, _value) in &pairs {
+        assert_eq!(reopened.get(key), tree.get(key));
+    }
+    let keys: Vec<H256> = pairs[..10].iter().map(|(k, _)| *k).collect();
+    assert_eq!(reopened.merkle_proof(keys.clone()), tree.merkle_proof(keys));
+
+    // writes between the steps start a segment below the last relocation
+    // target, the items relocated last are the largest keys: overwrites and
+    // removals of them after the compaction must replay after their copies
+    let mut live: Vec<H256> = pairs[..50]
+        .iter()
+        .chain(&pairs[150..299])
+        .map(|(k, _)| *k)
+        .collect();
+    live.sort();
+    tree.store_mut().start_compaction();
+    while !tree.store_mut().compact_step(1000).expect("compact") {
+        tree.update(live[0], rng.gen::<[u8; 32]>().into())
+            .expect("update");
+    }
+    let last = live.len() - 1;
+    tree.update(live[last], rng.gen::<[u8; 32]>().into())
+        .expect("update");
+    tree.update(live[last - 1], H256::zero()).expect("update");
+    tree.store_mut().sync(&dir).expect("sync");
+    let store = SegmentStore::<H256>::open(&dir, 1 << 16).expect("open");
+    assert_eq!(store.len(), tree.store().len());
+    let reopened = SegmentSMT::new(*tree.root(), store);
+    for (key, _value) in &pairs {
+        assert_eq!(reopened.get(key), tree.get(key));
+    }
+    std::fs::remove_dir_all(&dir).expect("remove");
+}
@@ -1,7 +1,9 @@
 use crate::*;
 use crate::{
-    blake2b::Blake2bHasher, default_store::DefaultStore, error::Error, merge::MergeValue,
-    MerkleProof, SparseMerkleTree,
+    blake2b::Blake2bHasher, compact_store::CompactStore, default_store::DefaultStore,
+    detach_store::DetachStore, error::Error, frozen::FrozenTree, merge::MergeValue,
+    stats::StatsCollector, trace_store::TraceStore, traits::Store, tree::BranchKey, MerkleProof,
+    SparseMerkleTree,
 };
 use proptest::prelude::*;
 use rand::prelude::{Rng, SliceRandom};
@@ -473,9 +475,14 @@ proptest! {
         for (k, v) in pairs2.clone().into_iter() {
             smt.update(k, v).expect("update");
         }
-        let mut smt2 = new_smt(pairs);
-        smt2.update_all(pairs2).expect("update all");
+        let mut smt2 = new_smt(pairs.clone());
+        smt2.update_all(pairs2.clone()).expect("update all");
         assert_eq!(smt.root(), smt2.root());
+        for threads in &[0, 1, 3, 64] {
+            let mut smt3 = new_smt(pairs.clone());
+            smt3.update_all_parallel(pairs2.clone(), *threads).expect("update all parallel");
+            assert_eq!(smt.root(), smt3.root());
+        }
     }
 
     #[test]
@@ -792,3 +799,550 @@ fn test_max_stack_size() {
         .verify::<Blake2bHasher>(smt.root(), pairs)
         .expect("verify"));
 }
+
+#[test]
+fn test_collect_stats() {
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..50)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let smt = new_smt(pairs.clone());
+
+    let mut collector = StatsCollector::new();
+    while !smt.collect_stats(&mut collector, 1).expect("stats") {}
+    let stats = collector.take_stats();
+    let mut collector = StatsCollector::new();
+    assert!(smt
+        .collect_stats(&mut collector, usize::MAX)
+        .expect("stats"));
+    assert_eq!(&stats, collector.stats());
+
+    assert_eq!(stats.leaves, pairs.len() as u64);
+    assert_eq!(
+        stats.branches.iter().sum::<u64>(),
+        smt.store().branches_map().len() as u64
+    );
+    // n leaves always fork n - 1 times
+    assert_eq!(stats.forks.iter().sum::<u64>(), pairs.len() as u64 - 1);
+    let siblings: usize = pairs
+        .iter()
+        .map(|(k, _v)| smt.merkle_proof(vec![*k]).unwrap().merkle_path().len())
+        .sum();
+    assert_eq!(stats.siblings, siblings as u64);
+}
+
+#[test]
+fn test_cached_merge_with_zero_hash() {
+    type CompactSMT = SparseMerkleTree<Blake2bHasher, H256, CompactStore<H256>>;
+    type TracedSMT = SparseMerkleTree<Blake2bHasher, H256, TraceStore<DefaultStore<H256>>>;
+
+    fn check_fork_hashes<S: Store<H256>>(store: &S, branch_keys: Vec<BranchKey>) -> usize {
+        let mut cached = 0;
+        for branch_key in branch_keys {
+            let (branch, hashes) = store
+                .get_branch_with_hashes(&branch_key)
+                .expect("get")
+                .expect("branch");
+            for (child, hash) in [&branch.left, &branch.right].iter().zip(&hashes) {
+                if let Some(hash) = hash {
+                    assert!(matches!(child, MergeValue::MergeWithZero { .. }));
+                    assert_eq!(*hash, child.hash::<Blake2bHasher>());
+                    // only children of a fork keep their hash
+                    assert!(!branch.left.is_zero() && !branch.right.is_zero());
+                    cached += 1;
+                }
+            }
+        }
+        cached
+    }
+
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..50)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut smt = SMT::default();
+    let mut compact_smt = CompactSMT::default();
+    for (key, value) in &pairs {
+        smt.update(*key, *value).expect("update");
+        compact_smt.update(*key, *value).expect("update");
+    }
+    let mut batch_smt = SMT::default();
+    batch_smt.update_all(pairs.clone()).expect("update_all");
+    assert_eq!(smt.root(), batch_smt.root());
+    assert_eq!(smt.root(), compact_smt.root());
+    // wrapping stores keep the hashes of the inner store
+    let mut traced_smt = TracedSMT::new(H256::zero(), TraceStore::new(DefaultStore::default(), 0));
+    traced_smt.update_all(pairs.clone()).expect("update_all");
+    assert_eq!(smt.root(), traced_smt.root());
+
+    let branch_keys: Vec<BranchKey> = smt.store().branches_map().keys().cloned().collect();
+    assert!(check_fork_hashes(smt.store(), branch_keys.clone()) > 0);
+    assert!(check_fork_hashes(batch_smt.store(), branch_keys.clone()) > 0);
+    assert!(check_fork_hashes(traced_smt.store().inner(), branch_keys.clone()) > 0);
+    assert!(check_fork_hashes(compact_smt.store(), branch_keys) > 0);
+
+    // deleting keys turns forks into chains, their hashes are dropped
+    for (key, _value) in &pairs[..40] {
+        smt.update(*key, rng.gen::<[u8; 32]>().into())
+            .expect("update");
+        smt.update(pairs[40 + rng.gen::<usize>() % 10].0, H256::zero())
+            .expect("update");
+    }
+    let branch_keys: Vec<BranchKey> = smt.store().branches_map().keys().cloned().collect();
+    check_fork_hashes(smt.store(), branch_keys);
+    let pairs: Vec<_> = pairs
+        .into_iter()
+        .map(|(key, _value)| (key, smt.get(&key).expect("get")))
+        .collect();
+    let mut expected = SMT::default();
+    expected.update_all(pairs).expect("update_all");
+    assert_eq!(smt.root(), expected.root());
+}
+
+#[test]
+fn test_tree_depth() {
+    type SMT64 = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>, 64>;
+    fn u64_key(n: u64) -> H256 {
+        let mut buf = [0u8; 32];
+        buf[..8].copy_from_slice(&n.to_le_bytes());
+        buf.into()
+    }
+
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..50)
+        .map(|_| (u64_key(rng.gen()), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut smt = SMT64::default();
+    for (key, value) in &pairs {
+        smt.update(*key, *value).expect("update");
+    }
+    let mut batch_smt = SMT64::default();
+    batch_smt.update_all(pairs.clone()).expect("update_all");
+    assert_eq!(smt.root(), batch_smt.root());
+    // only 64 levels are stored
+    assert!(smt
+        .store()
+        .branches_map()
+        .keys()
+        .all(|branch_key| branch_key.height < 64));
+
+    // the same leaves in a full depth tree have a different root
+    let mut full_smt = SMT::default();
+    full_smt.update_all(pairs.clone()).expect("update_all");
+    assert_ne!(smt.root(), full_smt.root());
+
+    let keys: Vec<H256> = pairs
+        .iter()
+        .take(5)
+        .map(|(k, _v)| *k)
+        .chain(Some(u64_key(rng.gen())))
+        .collect();
+    let leaves: Vec<(H256, H256)> = keys
+        .iter()
+        .map(|k| (*k, smt.get(k).expect("get")))
+        .collect();
+    let proof = smt.merkle_proof(keys.clone()).expect("proof");
+    assert_eq!(proof.depth(), 64);
+    assert!(proof
+        .clone()
+        .verify::<Blake2bHasher>(smt.root(), leaves.clone())
+        .expect("verify"));
+    let compiled_proof = proof.compile(keys).expect("compile");
+    assert!(compiled_proof
+        .verify_with_depth::<Blake2bHasher>(64, smt.root(), leaves.clone())
+        .expect("verify"));
+    assert!(compiled_proof
+        .compute_root::<Blake2bHasher>(leaves.clone())
+        .is_err());
+
+    // keys must fit into the low 64 bits
+    let mut wide_key = u64_key(1);
+    wide_key.set_bit(64);
+    assert_eq!(
+        smt.update(wide_key, [1u8; 32].into()),
+        Err(Error::KeyOutOfRange(wide_key))
+    );
+    assert!(smt.merkle_proof(vec![wide_key]).is_err());
+
+    for (key, _value) in &pairs {
+        smt.update(*key, H256::zero()).expect("update");
+    }
+    assert!(smt.is_empty());
+    assert!(smt.store().branches_map().is_empty());
+}
+
+#[test]
+fn test_delete_prefix() {
+    let mut rng = rand::thread_rng();
+    // 5 namespaces by the most significant byte of keys
+    let pairs: Vec<(H256, H256)> = (0..100)
+        .map(|i| {
+            let mut key: [u8; 32] = rng.gen();
+            key[31] = (i % 5) as u8;
+            (key.into(), rng.gen::<[u8; 32]>().into())
+        })
+        .collect();
+    type DetachSMT = SparseMerkleTree<Blake2bHasher, H256, DetachStore<DefaultStore<H256>>>;
+    let smt = new_smt(pairs.clone());
+    let mut smt = DetachSMT::new(*smt.root(), DetachStore::new(smt.take_store()));
+    let kept: Vec<_> = pairs
+        .iter()
+        .filter(|(k, _)| k.as_slice()[31] != 2)
+        .cloned()
+        .collect();
+    let mut expected = new_smt(kept);
+
+    // other stores remove the subtree at once
+    let deleted = pairs[2].0;
+    let mut eager = new_smt(pairs.clone());
+    eager.delete_prefix(247, deleted).expect("delete prefix");
+    assert_eq!(eager.root(), expected.root());
+    assert!(eager.is_reclaimed());
+    assert_eq!(
+        eager.store().branches_map(),
+        expected.store().branches_map()
+    );
+    assert_eq!(eager.store().leaves_map(), expected.store().leaves_map());
+    assert_eq!(deleted.as_slice()[31], 2);
+    smt.delete_prefix(247, deleted).expect("delete prefix");
+    assert_eq!(smt.root(), expected.root());
+    assert!(!smt.is_reclaimed());
+    // deleting again or deleting a subtree of it changes nothing
+    smt.delete_prefix(247, deleted).expect("delete prefix");
+    smt.delete_prefix(100, deleted).expect("delete prefix");
+    assert_eq!(smt.root(), expected.root());
+
+    // detached leaves are absent for reads and proofs
+    assert_eq!(smt.get(&deleted), Ok(H256::zero()));
+    let proof = smt.merkle_proof(vec![deleted]).expect("proof");
+    assert_eq!(proof, expected.merkle_proof(vec![deleted]).expect("proof"));
+    assert!(proof
+        .verify::<Blake2bHasher>(smt.root(), vec![(deleted, H256::zero())])
+        .expect("verify"));
+    // the store records the detached subtree, it outlives the tree
+    assert_eq!(smt.store().get_leaf(&deleted), Ok(None));
+    let root = *smt.root();
+    let mut smt = DetachSMT::new(root, smt.take_store());
+    assert_eq!(smt.get(&deleted), Ok(H256::zero()));
+    assert_eq!(smt.store().detached_len(), 1);
+
+    // an update under the detached prefix reclaims it first
+    let value: H256 = rng.gen::<[u8; 32]>().into();
+    smt.update(pairs[7].0, value).expect("update");
+    expected.update(pairs[7].0, value).expect("update");
+    assert_eq!(smt.root(), expected.root());
+    assert!(smt.is_reclaimed());
+    assert_eq!(smt.get(&deleted), Ok(H256::zero()));
+
+    // the rest is reclaimed step by step
+    smt.delete_prefix(247, pairs[0].0).expect("delete prefix");
+    for (k, _v) in pairs.iter().filter(|(k, _)| k.as_slice()[31] == 0) {
+        expected.update(*k, H256::zero()).expect("update");
+    }
+    assert_eq!(smt.root(), expected.root());
+    while !smt.reclaim(16).expect("reclaim") {}
+    assert_eq!(
+        smt.store().inner().branches_map().len(),
+        expected.store().branches_map().len()
+    );
+    assert_eq!(
+        smt.store().inner().leaves_map().len(),
+        expected.store().leaves_map().len()
+    );
+
+    // a graft into a detached slot reclaims it first
+    let root = *smt.root();
+    let shard = new_smt(
+        pairs
+            .iter()
+            .filter(|(k, _)| k.as_slice()[31] == 1)
+            .cloned()
+            .collect(),
+    );
+    smt.delete_prefix(247, pairs[1].0).expect("delete prefix");
+    assert!(!smt.is_reclaimed());
+    smt.graft(shard, 247, pairs[1].0).expect("graft");
+    assert_eq!(smt.root(), &root);
+    assert!(smt.is_reclaimed());
+    for (k, v) in pairs.iter().filter(|(k, _)| k.as_slice()[31] == 1) {
+        assert_eq!(smt.get(k), Ok(*v));
+    }
+
+    // delete the whole tree
+    smt.delete_prefix(255, H256::zero()).expect("delete prefix");
+    assert!(smt.is_empty());
+    smt.reclaim(usize::MAX).expect("reclaim");
+    assert!(smt.store().inner().branches_map().is_empty());
+    assert!(smt.store().inner().leaves_map().is_empty());
+
+    type SMT64 = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>, 64>;
+    assert_eq!(
+        SMT64::default().delete_prefix(64, H256::zero()),
+        Err(Error::HeightOutOfRange(64))
+    );
+}
+
+#[test]
+fn test_graft() {
+    let mut rng = rand::thread_rng();
+    // 4 shards by the most significant byte of keys
+    let pairs: Vec<(H256, H256)> = (0..100)
+        .map(|i| {
+            let mut key: [u8; 32] = rng.gen();
+            key[31] = (i % 4) as u8;
+            (key.into(), rng.gen::<[u8; 32]>().into())
+        })
+        .collect();
+    let expected = new_smt(pairs.clone());
+
+    let shard = |n: u8| {
+        new_smt(
+            pairs
+                .iter()
+                .filter(|(k, _)| k.as_slice()[31] == n)
+                .cloned()
+                .collect(),
+        )
+    };
+    let mut smt = shard(0);
+    for n in 1..4u8 {
+        let mut prefix = [0u8; 32];
+        prefix[31] = n;
+        smt.graft(shard(n), 247, prefix.into()).expect("graft");
+    }
+    assert_eq!(smt.root(), expected.root());
+    assert_eq!(smt.store().branches_map(), expected.store().branches_map());
+    assert_eq!(smt.store().leaves_map(), expected.store().leaves_map());
+    for (k, v) in &pairs {
+        assert_eq!(smt.get(k), Ok(*v));
+    }
+
+    // the slot is taken
+    assert_eq!(
+        smt.graft(shard(1), 247, pairs[1].0),
+        Err(Error::NonEmptySubtree(247, pairs[1].0.parent_path(247)))
+    );
+    // the shard has leaves out of the slot
+    let mut prefix = [0u8; 32];
+    prefix[31] = 8;
+    assert_eq!(
+        smt.graft(expected, 247, prefix.into()),
+        Err(Error::GraftOutOfRange)
+    );
+
+    // graft into a detached slot and into an empty tree
+    smt.delete_prefix(247, pairs[2].0).expect("delete prefix");
+    smt.graft(shard(2), 247, pairs[2].0).expect("graft");
+    let root = *smt.root();
+    let mut empty = SMT::default();
+    empty.graft(smt, 255, H256::zero()).expect("graft");
+    assert_eq!(empty.root(), &root);
+}
+
+#[test]
+fn test_split() {
+    let mut rng = rand::thread_rng();
+    // 4 shards by the most significant byte of keys
+    let pairs: Vec<(H256, H256)> = (0..100)
+        .map(|i| {
+            let mut key: [u8; 32] = rng.gen();
+            key[31] = (i % 4) as u8;
+            (key.into(), rng.gen::<[u8; 32]>().into())
+        })
+        .collect();
+    let mut smt = new_smt(pairs.clone());
+    let (moved, kept): (Vec<_>, Vec<_>) = pairs.iter().partition(|(k, _)| k.as_slice()[31] == 1);
+    let expected_moved = new_smt(moved);
+    let expected_kept = new_smt(kept);
+
+    let shard = smt.split(247, pairs[1].0).expect("split");
+    assert_eq!(shard.root(), expected_moved.root());
+    assert_eq!(smt.root(), expected_kept.root());
+    assert_eq!(
+        shard.store().branches_map(),
+        expected_moved.store().branches_map()
+    );
+    assert_eq!(
+        shard.store().leaves_map(),
+        expected_moved.store().leaves_map()
+    );
+    assert_eq!(
+        smt.store().branches_map(),
+        expected_kept.store().branches_map()
+    );
+    assert_eq!(smt.store().leaves_map(), expected_kept.store().leaves_map());
+
+    // an empty subtree splits into an empty tree
+    assert!(smt.split(247, pairs[1].0).expect("split").is_empty());
+    // split and graft are inverse
+    let root = *smt.root();
+    let shard = smt.split(247, pairs[2].0).expect("split");
+    smt.graft(shard, 247, pairs[2].0).expect("graft");
+    assert_eq!(smt.root(), &root);
+    // split a detached subtree
+    smt.delete_prefix(247, pairs[3].0).expect("delete prefix");
+    assert!(smt.split(247, pairs[3].0).expect("split").is_empty());
+    assert!(smt.is_reclaimed());
+    // split the whole tree
+    let root = *smt.root();
+    let all = smt.split(255, H256::zero()).expect("split");
+    assert_eq!(all.root(), &root);
+    assert!(smt.is_empty());
+    assert!(smt.store().branches_map().is_empty());
+}
+
+#[test]
+fn test_freeze() {
+    let mut rng = rand::thread_rng();
+    let mut pairs: Vec<(H256, H256)> = (0..100)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    // siblings of a leaf, both children of a height 0 branch are leaves
+    let mut sibling = pairs[0].0;
+    sibling.set_bit(0);
+    sibling.clear_bit(1);
+    let mut sibling2 = sibling;
+    sibling2.set_bit(1);
+    pairs.push((sibling, [1u8; 32].into()));
+    pairs.push((sibling2, [2u8; 32].into()));
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update_all");
+    smt.delete_prefix(250, pairs[1].0).expect("delete prefix");
+
+    let bytes = smt.freeze().expect("freeze");
+    let frozen = FrozenTree::<Blake2bHasher, H256>::new(&bytes).expect("frozen");
+    assert_eq!(frozen.root(), smt.root());
+    let absent: Vec<H256> = (0..10).map(|_| rng.gen::<[u8; 32]>().into()).collect();
+    for key in pairs.iter().map(|(k, _)| k).chain(absent.iter()) {
+        assert_eq!(frozen.get(key).expect("get"), smt.get(key).expect("get"));
+        assert_eq!(
+            frozen.merkle_proof(vec![*key]).expect("proof"),
+            smt.merkle_proof(vec![*key]).expect("proof")
+        );
+    }
+    let keys: Vec<H256> = pairs
+        .iter()
+        .step_by(3)
+        .map(|(k, _)| *k)
+        .chain(absent.iter().cloned())
+        .collect();
+    let proof = frozen.merkle_proof(keys.clone()).expect("proof");
+    assert_eq!(proof, smt.merkle_proof(keys.clone()).expect("proof"));
+    let leaves: Vec<(H256, H256)> = keys
+        .iter()
+        .map(|k| (*k, smt.get(k).expect("get")))
+        .collect();
+    assert!(proof
+        .verify::<Blake2bHasher>(frozen.root(), leaves)
+        .expect("verify"));
+
+    // the depth must match, a truncated buffer is rejected
+    assert!(FrozenTree::<Blake2bHasher, H256, 64>::new(&bytes).is_err());
+    assert!(FrozenTree::<Blake2bHasher, H256>::new(&bytes[..bytes.len() - 1]).is_err());
+    let empty = SMT::default().freeze().expect("freeze");
+    let frozen = FrozenTree::<Blake2bHasher, H256>::new(&empty).expect("frozen");
+    assert!(frozen.is_empty());
+    assert_eq!(frozen.get(&pairs[0].0).expect("get"), H256::zero());
+
+    // a shallow tree
+    type SMT64 = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>, 64>;
+    let mut smt = SMT64::default();
+    for (i, (_, value)) in pairs.iter().enumerate() {
+        let mut key = [0u8; 32];
+        key[..8].copy_from_slice(&(i as u64 * 7).to_le_bytes());
+        smt.update(key.into(), *value).expect("update");
+    }
+    let bytes = smt.freeze().expect("freeze");
+    let frozen = FrozenTree::<Blake2bHasher, H256, 64>::new(&bytes).expect("frozen");
+    let keys: Vec<H256> = (0..20u64)
+        .map(|i| {
+            let mut key = [0u8; 32];
+            key[..8].copy_from_slice(&(i * 5).to_le_bytes());
+            key.into()
+        })
+        .collect();
+    for key in &keys {
+        assert_eq!(frozen.get(key).expect("get"), smt.get(key).expect("get"));
+    }
+    assert_eq!(
+        frozen.merkle_proof(keys.clone()).expect("proof"),
+        smt.merkle_proof(keys).expect("proof")
+    );
+}
+
+#[test]
+fn test_export_import() {
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..1000)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut smt = SMT::default();
+    smt.update_all(pairs).expect("update_all");
+
+    let export = smt.export(250).expect("export");
+    let header = export.header();
+    let chunks: Vec<Vec<u8>> = export.collect::<Result<_, _>>().expect("chunks");
+    assert!(chunks.len() > 1 && chunks.len() <= 32);
+    let imported = SMT::import(&header, &chunks).expect("import");
+    assert_eq!(imported.root(), smt.root());
+    assert_eq!(imported.store().branches_map(), smt.store().branches_map());
+    assert_eq!(imported.store().leaves_map(), smt.store().leaves_map());
+    let imported = SMT::import_parallel(&header, chunks.clone(), 3).expect("import");
+    assert_eq!(imported.root(), smt.root());
+    assert_eq!(imported.store().branches_map(), smt.store().branches_map());
+
+    // one chunk holds the whole tree
+    let export = smt.export(255).expect("export");
+    let header = export.header();
+    let chunk: Vec<Vec<u8>> = export.collect::<Result<_, _>>().expect("chunks");
+    assert_eq!(chunk.len(), 1);
+    assert_eq!(
+        SMT::import(&header, &chunk).expect("import").root(),
+        smt.root()
+    );
+
+    // a damaged chunk fails its checksum
+    let mut damaged = chunks.clone();
+    let last = damaged[0].len() - 1;
+    damaged[0][last] ^= 1;
+    assert_eq!(
+        SMT::import(&header, &damaged).map(|_| ()),
+        Err(Error::Store("corrupted export".into()))
+    );
+    // a chunk not matching its subtree hash
+    let mut forged = chunks.clone();
+    forged[0][41] ^= 1;
+    let height = forged[0][8];
+    let mut node_key = [0u8; 32];
+    node_key.copy_from_slice(&forged[0][9..41]);
+    assert_eq!(
+        SMT::import_parallel(&header, forged, 2).map(|_| ()),
+        Err(Error::InvalidChunk(height, node_key.into()))
+    );
+    // a missing chunk
+    assert!(matches!(
+        SMT::import(&header, &chunks[1..]),
+        Err(Error::RootMismatch { .. })
+    ));
+    // a chunk twice
+    let mut twice = chunks.clone();
+    twice.push(chunks[0].clone());
+    assert!(matches!(
+        SMT::import(&header, &twice),
+        Err(Error::NonEmptySubtree(250, _))
+    ));
+
+    let empty = SMT::default();
+    let export = empty.export(250).expect("export");
+    let header = export.header();
+    assert_eq!(export.count(), 0);
+    assert!(SMT::import(&header, Vec::<Vec<u8>>::new())
+        .expect("import")
+        .is_empty());
+    assert_eq!(
+        SparseMerkleTree::<Blake2bHasher, H256, DefaultStore<H256>, 64>::default()
+            .export(64)
+            .map(|_| ()),
+        Err(Error::HeightOutOfRange(64))
+    );
+}
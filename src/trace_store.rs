@@ -0,0 +1,352 @@
+use crate::{
+    collections::VecDeque,
+    default_store::Map,
+    error::Error,
+    traits::{ForkHashes, Store},
+    tree::{BranchKey, BranchNode},
+    vec,
+    vec::Vec,
+    H256,
+};
+use core::cell::RefCell;
+
+/// Store operation recorded by `TraceStore`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum TraceOp {
+    GetBranch,
+    GetLeaf,
+    InsertBranch,
+    InsertLeaf,
+    RemoveBranch,
+    RemoveLeaf,
+}
+
+impl TraceOp {
+    pub fn is_read(&self) -> bool {
+        matches!(self, TraceOp::GetBranch | TraceOp::GetLeaf)
+    }
+}
+
+/// A traced store access
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct TraceEvent {
+    pub op: TraceOp,
+    /// branch height, None for leaves
+    pub height: Option<u8>,
+    /// branch node key or leaf key
+    pub key: H256,
+    /// reads: the item exists, writes: always true
+    pub hit: bool,
+    /// elapsed nanoseconds, always 0 without the `std` feature
+    pub latency_ns: u64,
+}
+
+/// A store adapter logs every access of the inner store into a ring buffer
+#[derive(Debug)]
+pub struct TraceStore<S> {
+    inner: S,
+    capacity: usize,
+    events: RefCell<VecDeque<TraceEvent>>,
+}
+
+impl<S> TraceStore<S> {
+    /// Wrap a store, keep at most `capacity` latest events
+    pub fn new(inner: S, capacity: usize) -> Self {
+        TraceStore {
+            inner,
+            capacity,
+            events: RefCell::new(VecDeque::with_capacity(capacity)),
+        }
+    }
+
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+
+    pub fn inner_mut(&mut self) -> &mut S {
+        &mut self.inner
+    }
+
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+
+    /// Drain recorded events, oldest first
+    pub fn take_events(&self) -> Vec<TraceEvent> {
+        self.events.borrow_mut().drain(..).collect()
+    }
+
+    pub(crate) fn record(
+        &self,
+        op: TraceOp,
+        height: Option<u8>,
+        key: &H256,
+        hit: bool,
+        latency_ns: u64,
+    ) {
+        if self.capacity == 0 {
+            return;
+        }
+        let mut events = self.events.borrow_mut();
+        if events.len() == self.capacity {
+            events.pop_front();
+        }
+        events.push_back(TraceEvent {
+            op,
+            height,
+            key: *key,
+            hit,
+            latency_ns,
+        });
+    }
+}
+
+cfg_if::cfg_if! {
+    if #[cfg(feature = "std")] {
+        pub(crate) fn timed<T>(f: impl FnOnce() -> T) -> (T, u64) {
+            let start = std::time::Instant::now();
+            let ret = f();
+            (ret, start.elapsed().as_nanos() as u64)
+        }
+    } else {
+        pub(crate) fn timed<T>(f: impl FnOnce() -> T) -> (T, u64) {
+            (f(), 0)
+        }
+    }
+}
+
+impl<V, S: Store<V>> Store<V> for TraceStore<S> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        let (ret, latency) = timed(|| self.inner.get_branch(branch_key));
+        let hit = matches!(ret, Ok(Some(_)));
+        self.record(
+            TraceOp::GetBranch,
+            Some(branch_key.height),
+            &branch_key.node_key,
+            hit,
+            latency,
+        );
+        ret
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>, Error> {
+        let (ret, latency) = timed(|| self.inner.get_leaf(leaf_key));
+        let hit = matches!(ret, Ok(Some(_)));
+        self.record(TraceOp::GetLeaf, None, leaf_key, hit, latency);
+        ret
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        let (height, node_key) = (branch_key.height, branch_key.node_key);
+        let inner = &mut self.inner;
+        let (ret, latency) = timed(|| inner.insert_branch(branch_key, branch));
+        self.record(
+            TraceOp::InsertBranch,
+            Some(height),
+            &node_key,
+            true,
+            latency,
+        );
+        ret
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error> {
+        let inner = &mut self.inner;
+        let (ret, latency) = timed(|| inner.insert_leaf(leaf_key, leaf));
+        self.record(TraceOp::InsertLeaf, None, &leaf_key, true, latency);
+        ret
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
+        let inner = &mut self.inner;
+        let (ret, latency) = timed(|| inner.remove_branch(branch_key));
+        self.record(
+            TraceOp::RemoveBranch,
+            Some(branch_key.height),
+            &branch_key.node_key,
+            true,
+            latency,
+        );
+        ret
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        let inner = &mut self.inner;
+        let (ret, latency) = timed(|| inner.remove_leaf(leaf_key));
+        self.record(TraceOp::RemoveLeaf, None, leaf_key, true, latency);
+        ret
+    }
+    fn keeps_leaf_counts(&self) -> bool {
+        self.inner.keeps_leaf_counts()
+    }
+    fn get_leaf_count(&self, branch_key: &BranchKey) -> Result<u64, Error> {
+        self.inner.get_leaf_count(branch_key)
+    }
+    fn insert_leaf_count(&mut self, branch_key: BranchKey, count: u64) -> Result<(), Error> {
+        self.inner.insert_leaf_count(branch_key, count)
+    }
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>, Error> {
+        let (ret, latency) = timed(|| self.inner.get_branch_with_hashes(branch_key));
+        let hit = matches!(ret, Ok(Some(_)));
+        self.record(
+            TraceOp::GetBranch,
+            Some(branch_key.height),
+            &branch_key.node_key,
+            hit,
+            latency,
+        );
+        ret
+    }
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        hashes: ForkHashes,
+    ) -> Result<(), Error> {
+        let (height, node_key) = (branch_key.height, branch_key.node_key);
+        let inner = &mut self.inner;
+        let (ret, latency) = timed(|| inner.insert_branch_with_hashes(branch_key, branch, hashes));
+        self.record(
+            TraceOp::InsertBranch,
+            Some(height),
+            &node_key,
+            true,
+            latency,
+        );
+        ret
+    }
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, hash: H256) -> Result<(), Error> {
+        let inner = &mut self.inner;
+        let (ret, latency) = timed(|| inner.insert_leaf_with_hash(leaf_key, leaf, hash));
+        self.record(TraceOp::InsertLeaf, None, &leaf_key, true, latency);
+        ret
+    }
+    // a detached subtree is traced as the removal of its top branch, the
+    // removals of a reclaim happen inside the inner store
+    fn detach_branch(&mut self, branch_key: &BranchKey) -> Result<bool, Error> {
+        let inner = &mut self.inner;
+        let (ret, latency) = timed(|| inner.detach_branch(branch_key));
+        if let Ok(true) = ret {
+            self.record(
+                TraceOp::RemoveBranch,
+                Some(branch_key.height),
+                &branch_key.node_key,
+                true,
+                latency,
+            );
+        }
+        ret
+    }
+    fn reclaim_detached(&mut self, budget: usize) -> Result<bool, Error> {
+        self.inner.reclaim_detached(budget)
+    }
+    fn has_detached(&self) -> bool {
+        self.inner.has_detached()
+    }
+}
+
+/// Access pattern of one tree level
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct LevelSummary {
+    pub reads: u64,
+    pub hits: u64,
+    pub writes: u64,
+    pub latency_ns: u64,
+    /// number of distinct keys accessed
+    pub working_set: u64,
+    /// sum and count of reuse distances of repeated accesses
+    pub reuse_distance_sum: u64,
+    pub reuses: u64,
+}
+
+impl LevelSummary {
+    pub fn misses(&self) -> u64 {
+        self.reads - self.hits
+    }
+
+    /// Average number of distinct items accessed between two accesses of the same item
+    pub fn avg_reuse_distance(&self) -> f64 {
+        if self.reuses == 0 {
+            return 0.0;
+        }
+        self.reuse_distance_sum as f64 / self.reuses as f64
+    }
+}
+
+/// Summary of a store trace
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct TraceSummary {
+    /// indexed by branch height, index 256 is leaves
+    pub levels: Vec<LevelSummary>,
+    /// accesses indexed by the most significant byte of the key
+    pub key_ranges: Vec<u64>,
+}
+
+impl TraceSummary {
+    /// Index of leaves in `levels`
+    pub const LEAVES: usize = 256;
+
+    /// Analyze a trace, events must be ordered from oldest to newest
+    pub fn analyze(events: &[TraceEvent]) -> Self {
+        let mut levels = vec![LevelSummary::default(); 257];
+        let mut key_ranges = vec![0; 256];
+        // item -> time of its last access
+        let mut last_access: Map<(Option<u8>, H256), usize> = Map::default();
+        // marks the last access time of every item, the marks after an
+        // earlier access count the distinct items since (LRU stack distance)
+        let mut recent = Fenwick::new(events.len());
+        for (time, event) in events.iter().enumerate() {
+            let level = &mut levels[event.height.map_or(Self::LEAVES, usize::from)];
+            if event.op.is_read() {
+                level.reads += 1;
+                level.hits += event.hit as u64;
+            } else {
+                level.writes += 1;
+            }
+            level.latency_ns += event.latency_ns;
+            key_ranges[event.key.as_slice()[31] as usize] += 1;
+
+            match last_access.insert((event.height, event.key), time) {
+                Some(prev) => {
+                    level.reuse_distance_sum +=
+                        recent.prefix_sum(time) - recent.prefix_sum(prev + 1);
+                    level.reuses += 1;
+                    recent.add(prev, -1);
+                }
+                None => level.working_set += 1,
+            }
+            recent.add(time, 1);
+        }
+        TraceSummary { levels, key_ranges }
+    }
+}
+
+/// Binary indexed tree of counts, both operations are O(log n)
+struct Fenwick {
+    tree: Vec<i64>,
+}
+
+impl Fenwick {
+    fn new(len: usize) -> Self {
+        Fenwick {
+            tree: vec![0; len + 1],
+        }
+    }
+
+    fn add(&mut self, index: usize, delta: i64) {
+        let mut i = index + 1;
+        while i < self.tree.len() {
+            self.tree[i] += delta;
+            i += i & i.wrapping_neg();
+        }
+    }
+
+    /// Sum of the counts before index
+    fn prefix_sum(&self, index: usize) -> u64 {
+        let mut sum = 0;
+        let mut i = index;
+        while i > 0 {
+            sum += self.tree[i];
+            i -= i & i.wrapping_neg();
+        }
+        sum as u64
+    }
+}
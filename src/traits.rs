@@ -1,6 +1,7 @@
 use crate::{
     error::Error,
     tree::{BranchKey, BranchNode},
+    vec::Vec,
     H256,
 };
 
@@ -26,6 +27,32 @@ impl Value for H256 {
     }
 }
 
+/// Trait for values a store keeps as bytes
+pub trait ValueCodec: Sized {
+    /// Append the encoded value to buf
+    fn encode(&self, buf: &mut Vec<u8>);
+    /// Decode a value, return None if the bytes are corrupted
+    fn decode(bytes: &[u8]) -> Option<Self>;
+}
+
+impl ValueCodec for H256 {
+    fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(self.as_slice());
+    }
+    fn decode(bytes: &[u8]) -> Option<Self> {
+        if bytes.len() != 32 {
+            return None;
+        }
+        let mut inner = [0u8; 32];
+        inner.copy_from_slice(bytes);
+        Some(inner.into())
+    }
+}
+
+/// Hashes of the MergeWithZero children of a fork, left and right,
+/// None for a child without a kept hash
+pub type ForkHashes = [Option<H256>; 2];
+
 /// Trait for customize backend storage
 pub trait Store<V> {
     fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error>;
@@ -34,4 +61,64 @@ pub trait Store<V> {
     fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error>;
     fn remove_branch(&mut self, node_key: &BranchKey) -> Result<(), Error>;
     fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error>;
+
+    /// Leaf counts are optional, a store keeping them holds the number of
+    /// leaves under every branch, outside of the branch and its hash
+    fn keeps_leaf_counts(&self) -> bool {
+        false
+    }
+    /// Number of leaves under a branch, 0 if the store does not keep counts
+    fn get_leaf_count(&self, _branch_key: &BranchKey) -> Result<u64, Error> {
+        Ok(0)
+    }
+    /// Set the number of leaves under a branch, the count of a removed
+    /// branch is dropped by `remove_branch`
+    fn insert_leaf_count(&mut self, _branch_key: BranchKey, _count: u64) -> Result<(), Error> {
+        Ok(())
+    }
+
+    /// Fork hashes are optional, a store keeping them holds the hashes of
+    /// the MergeWithZero children of a fork beside the branch, so a later
+    /// update below the fork does not hash the unchanged child again.
+    /// Return a branch along with its kept hashes.
+    fn get_branch_with_hashes(
+        &self,
+        branch_key: &BranchKey,
+    ) -> Result<Option<(BranchNode, ForkHashes)>, Error> {
+        Ok(self
+            .get_branch(branch_key)?
+            .map(|branch| (branch, [None, None])))
+    }
+    /// Insert a branch along with the hashes of its MergeWithZero children,
+    /// `insert_branch` of the same branch drops the hashes
+    fn insert_branch_with_hashes(
+        &mut self,
+        branch_key: BranchKey,
+        branch: BranchNode,
+        _hashes: ForkHashes,
+    ) -> Result<(), Error> {
+        self.insert_branch(branch_key, branch)
+    }
+
+    /// Insert a leaf along with its `to_h256`, which the tree has already
+    /// computed, a store keeping leaf hashes does not hash the value again
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, _hash: H256) -> Result<(), Error> {
+        self.insert_leaf(leaf_key, leaf)
+    }
+
+    /// Detaching is optional, a store supporting it hides the subtree under
+    /// a branch at once and removes its nodes later in `reclaim_detached`.
+    /// Return false if it is not supported, the caller removes the subtree.
+    fn detach_branch(&mut self, _branch_key: &BranchKey) -> Result<bool, Error> {
+        Ok(false)
+    }
+    /// Remove at most `budget` branches of detached subtrees, along with
+    /// their leaves, return true if nothing is left to reclaim
+    fn reclaim_detached(&mut self, _budget: usize) -> Result<bool, Error> {
+        Ok(true)
+    }
+    /// Return true if detached subtrees are left to reclaim
+    fn has_detached(&self) -> bool {
+        false
+    }
 }
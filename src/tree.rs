@@ -1,8 +1,10 @@
 use crate::{
     error::{Error, Result},
-    merge::{merge, MergeValue},
+    merge::{depth_root, merge, merge_fork, MergeValue},
     merkle_proof::MerkleProof,
-    traits::{Hasher, Store, Value},
+    stats::StatsCollector,
+    traits::{ForkHashes, Hasher, Store, Value},
+    vec,
     vec::Vec,
     H256, MAX_STACK_SIZE,
 };
@@ -44,16 +46,33 @@ pub struct BranchNode {
 }
 
 /// Sparse merkle tree
+///
+/// `DEPTH` is the number of levels (1..=256). Keys of a shallower tree only
+/// use their low `DEPTH` bits, e.g. a tree of 64 levels takes u64 keys
+/// stored in the first 8 bytes of a H256, and its root is domain separated
+/// by the depth.
+///
+/// A store supporting detached subtrees, e.g. `DetachStore`, records the
+/// subtrees dropped by `delete_prefix` and hides them until `reclaim`
+/// removes their nodes.
 #[derive(Default, Debug)]
-pub struct SparseMerkleTree<H, V, S> {
+pub struct SparseMerkleTree<H, V, S, const DEPTH: usize = 256> {
     store: S,
     root: H256,
     phantom: PhantomData<(H, V)>,
 }
 
-impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
+impl<H: Hasher + Default, V: Value, S: Store<V>, const DEPTH: usize>
+    SparseMerkleTree<H, V, S, DEPTH>
+{
+    /// Height of the root branch
+    pub const ROOT_HEIGHT: u8 = {
+        assert!(DEPTH > 0 && DEPTH <= 256, "tree depth must be 1..=256");
+        (DEPTH - 1) as u8
+    };
+
     /// Build a merkle tree from root and store
-    pub fn new(root: H256, store: S) -> SparseMerkleTree<H, V, S> {
+    pub fn new(root: H256, store: S) -> SparseMerkleTree<H, V, S, DEPTH> {
         SparseMerkleTree {
             root,
             store,
@@ -86,82 +105,167 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
         &mut self.store
     }
 
+    fn check_key(key: &H256) -> Result<()> {
+        if key.is_within_depth(DEPTH) {
+            Ok(())
+        } else {
+            Err(Error::KeyOutOfRange(*key))
+        }
+    }
+
     /// Update a leaf, return new merkle root
     /// set to zero value to delete a key
     pub fn update(&mut self, key: H256, value: V) -> Result<&H256> {
+        Self::check_key(&key)?;
         // compute and store new leaf
-        let node = MergeValue::from_h256(value.to_h256());
+        let hash = value.to_h256();
+        let node = MergeValue::from_h256(hash);
         // notice when value is zero the leaf is deleted, so we do not need to store it
         if !node.is_zero() {
-            self.store.insert_leaf(key, value)?;
+            self.store.insert_leaf_with_hash(key, value, hash)?;
         } else {
             self.store.remove_leaf(&key)?;
         }
 
         // recompute the tree from bottom to top
+        let count = !node.is_zero() as u64;
+        self.update_path(0, key, node, count)
+    }
+
+    /// Recompute branches from `start_height` to the root, `key`, `node` and
+    /// `count` are the path, the new value and the leaf count of the child
+    /// at `start_height`
+    fn update_path(
+        &mut self,
+        start_height: u8,
+        key: H256,
+        node: MergeValue,
+        count: u64,
+    ) -> Result<&H256> {
+        let counting = self.store.keeps_leaf_counts();
         let mut current_key = key;
         let mut current_node = node;
-        for height in 0..=core::u8::MAX {
+        let mut current_count = count;
+        for height in start_height..=Self::ROOT_HEIGHT {
             let parent_key = current_key.parent_path(height);
             let parent_branch_key = BranchKey::new(height, parent_key);
-            let (left, right) =
-                if let Some(parent_branch) = self.store.get_branch(&parent_branch_key)? {
-                    if current_key.is_right(height) {
-                        (parent_branch.left, current_node)
-                    } else {
-                        (current_node, parent_branch.right)
+            // the kept hash of the sibling, the updated child has changed
+            let (left, right, hashes) =
+                match self.store.get_branch_with_hashes(&parent_branch_key)? {
+                    Some((parent_branch, hashes)) => {
+                        if current_key.is_right(height) {
+                            (parent_branch.left, current_node, [hashes[0], None])
+                        } else {
+                            (current_node, parent_branch.right, [None, hashes[1]])
+                        }
                     }
-                } else if current_key.is_right(height) {
-                    (MergeValue::zero(), current_node)
-                } else {
-                    (current_node, MergeValue::zero())
+                    None if current_key.is_right(height) => {
+                        (MergeValue::zero(), current_node, [None, None])
+                    }
+                    None => (current_node, MergeValue::zero(), [None, None]),
                 };
+            if counting {
+                current_count +=
+                    sibling_leaf_count(&self.store, height, &current_key, &left, &right)?;
+            }
 
-            if !left.is_zero() || !right.is_zero() {
+            let parent = if !left.is_zero() || !right.is_zero() {
                 // insert or update branch
-                self.store.insert_branch(
-                    parent_branch_key,
-                    BranchNode {
-                        left: left.clone(),
-                        right: right.clone(),
-                    },
-                )?;
+                if counting {
+                    self.store
+                        .insert_leaf_count(parent_branch_key.clone(), current_count)?;
+                }
+                self.merge_branch(parent_branch_key, left, right, hashes)?
             } else {
                 // remove empty branch
                 self.store.remove_branch(&parent_branch_key)?;
-            }
+                MergeValue::zero()
+            };
             // prepare for next round
             current_key = parent_key;
-            current_node = merge::<H>(height, &parent_key, &left, &right);
+            current_node = parent;
         }
 
-        self.root = current_node.hash::<H>();
+        self.root = depth_root::<H>(DEPTH, &current_node);
         Ok(&self.root)
     }
 
+    /// Store a non-empty branch and return its merged value. The hashes of
+    /// the MergeWithZero children of a fork are kept beside it, a fork is
+    /// merged again by every later update below it; `hashes` are the kept
+    /// hashes of unchanged children.
+    fn merge_branch(
+        &mut self,
+        branch_key: BranchKey,
+        left: MergeValue,
+        right: MergeValue,
+        hashes: ForkHashes,
+    ) -> Result<MergeValue> {
+        let height = branch_key.height;
+        if !left.is_zero() && !right.is_zero() {
+            let (parent, hashes) =
+                merge_fork::<H>(height, &branch_key.node_key, &left, &right, hashes);
+            self.store
+                .insert_branch_with_hashes(branch_key, BranchNode { left, right }, hashes)?;
+            return Ok(parent);
+        }
+        let parent = merge::<H>(height, &branch_key.node_key, &left, &right);
+        self.store
+            .insert_branch(branch_key, BranchNode { left, right })?;
+        Ok(parent)
+    }
+
     /// Update multiple leaves at once
-    pub fn update_all(&mut self, mut leaves: Vec<(H256, V)>) -> Result<&H256> {
-        // Dedup(only keep the last of each key) and sort leaves
+    pub fn update_all(&mut self, leaves: Vec<(H256, V)>) -> Result<&H256> {
+        let leaves = Self::prepare_leaves(leaves)?;
+        let hashes = leaves.iter().map(|(_, v)| v.to_h256()).collect();
+        self.update_sorted(leaves, hashes)
+    }
+
+    /// Dedup(only keep the last of each key), sort and check leaves of a batch
+    fn prepare_leaves(mut leaves: Vec<(H256, V)>) -> Result<Vec<(H256, V)>> {
         leaves.reverse();
         leaves.sort_by_key(|(a, _)| *a);
         leaves.dedup_by_key(|(a, _)| *a);
+        for (key, _value) in &leaves {
+            Self::check_key(key)?;
+        }
+        Ok(leaves)
+    }
 
-        let mut nodes: Vec<(H256, MergeValue)> = Vec::new();
-        for (k, v) in leaves {
-            let value = MergeValue::from_h256(v.to_h256());
+    /// Store prepared leaves and merge them level by level,
+    /// `hashes` are the `to_h256` of the leaf values
+    pub(crate) fn update_sorted(
+        &mut self,
+        leaves: Vec<(H256, V)>,
+        hashes: Vec<H256>,
+    ) -> Result<&H256> {
+        // The only level array of the batch: merged parents are written back in place,
+        // the write cursor never passes the read cursor, so no level allocates.
+        let mut nodes: Vec<(H256, MergeValue)> = Vec::with_capacity(leaves.len());
+        // leaf counts of nodes, only kept if the store keeps them
+        let counting = self.store.keeps_leaf_counts();
+        let mut counts: Vec<u64> = Vec::new();
+        for ((k, v), hash) in leaves.into_iter().zip(hashes) {
+            let value = MergeValue::from_h256(hash);
+            if counting {
+                counts.push(!value.is_zero() as u64);
+            }
             if !value.is_zero() {
-                self.store.insert_leaf(k, v)?;
+                self.store.insert_leaf_with_hash(k, v, hash)?;
             } else {
                 self.store.remove_leaf(&k)?;
             }
             nodes.push((k, value));
         }
 
-        for height in 0..=core::u8::MAX {
-            let mut next_nodes: Vec<(H256, MergeValue)> = Vec::new();
+        for height in 0..=Self::ROOT_HEIGHT {
+            let mut next = 0;
             let mut i = 0;
             while i < nodes.len() {
-                let (current_key, current_merge_value) = &nodes[i];
+                let current_key = nodes[i].0;
+                let current_merge_value = core::mem::replace(&mut nodes[i].1, MergeValue::zero());
+                let mut count = if counting { counts[i] } else { 0 };
                 i += 1;
                 let parent_key = current_key.parent_path(height);
                 let parent_branch_key = BranchKey::new(height, parent_key);
@@ -169,53 +273,223 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
                 // Test for neighbors
                 let mut right = None;
                 if i < nodes.len() && (!current_key.is_right(height)) {
-                    let (neighbor_key, neighbor_value) = &nodes[i];
-                    let mut right_key = *current_key;
+                    let mut right_key = current_key;
                     right_key.set_bit(height);
-                    if right_key == *neighbor_key {
-                        right = Some(neighbor_value.clone());
+                    if right_key == nodes[i].0 {
+                        right = Some(core::mem::replace(&mut nodes[i].1, MergeValue::zero()));
+                        if counting {
+                            count += counts[i];
+                        }
                         i += 1;
                     }
                 }
 
-                let (left, right) = if let Some(right_merge_value) = right {
-                    (current_merge_value.clone(), right_merge_value)
+                let (left, right, hashes) = if let Some(right_merge_value) = right {
+                    (current_merge_value, right_merge_value, [None, None])
                 } else {
-                    // In case neighbor is not available, fetch from store
-                    if let Some(parent_branch) = self.store.get_branch(&parent_branch_key)? {
-                        if current_key.is_right(height) {
-                            (parent_branch.left, current_merge_value.clone())
-                        } else {
-                            (current_merge_value.clone(), parent_branch.right)
-                        }
-                    } else if current_key.is_right(height) {
-                        (MergeValue::zero(), current_merge_value.clone())
-                    } else {
-                        (current_merge_value.clone(), MergeValue::zero())
+                    // In case neighbor is not available, fetch from store,
+                    // along with the kept hash of the sibling
+                    let (left, right, hashes) =
+                        match self.store.get_branch_with_hashes(&parent_branch_key)? {
+                            Some((parent_branch, hashes)) => {
+                                if current_key.is_right(height) {
+                                    (parent_branch.left, current_merge_value, [hashes[0], None])
+                                } else {
+                                    (current_merge_value, parent_branch.right, [None, hashes[1]])
+                                }
+                            }
+                            None if current_key.is_right(height) => {
+                                (MergeValue::zero(), current_merge_value, [None, None])
+                            }
+                            None => (current_merge_value, MergeValue::zero(), [None, None]),
+                        };
+                    if counting {
+                        count +=
+                            sibling_leaf_count(&self.store, height, &current_key, &left, &right)?;
                     }
+                    (left, right, hashes)
                 };
 
-                if !left.is_zero() || !right.is_zero() {
-                    self.store.insert_branch(
-                        parent_branch_key,
-                        BranchNode {
-                            left: left.clone(),
-                            right: right.clone(),
-                        },
-                    )?;
+                let parent = if !left.is_zero() || !right.is_zero() {
+                    if counting {
+                        self.store
+                            .insert_leaf_count(parent_branch_key.clone(), count)?;
+                        counts[next] = count;
+                    }
+                    self.merge_branch(parent_branch_key, left, right, hashes)?
                 } else {
                     self.store.remove_branch(&parent_branch_key)?;
-                }
-                next_nodes.push((parent_key, merge::<H>(height, &parent_key, &left, &right)));
+                    if counting {
+                        counts[next] = 0;
+                    }
+                    MergeValue::zero()
+                };
+                nodes[next] = (parent_key, parent);
+                next += 1;
             }
-            nodes = next_nodes;
+            nodes.truncate(next);
+            counts.truncate(next);
         }
 
         assert!(nodes.len() == 1);
-        self.root = nodes[0].1.hash::<H>();
+        self.root = depth_root::<H>(DEPTH, &nodes[0].1);
         Ok(&self.root)
     }
 
+    /// Update multiple leaves at once, hashing the leaf values on `threads` threads.
+    ///
+    /// Worth it when `Value::to_h256` is expensive, e.g. hashing large serialized
+    /// values; the tree levels are still merged on the calling thread.
+    #[cfg(feature = "std")]
+    pub fn update_all_parallel(&mut self, leaves: Vec<(H256, V)>, threads: usize) -> Result<&H256>
+    where
+        V: Sync,
+    {
+        let leaves = Self::prepare_leaves(leaves)?;
+        let mut hashes = vec![H256::zero(); leaves.len()];
+        let threads = core::cmp::max(threads, 1);
+        let chunk_size = core::cmp::max(leaves.len().div_ceil(threads), 1);
+        std::thread::scope(|scope| {
+            for (leaves, hashes) in leaves.chunks(chunk_size).zip(hashes.chunks_mut(chunk_size)) {
+                scope.spawn(move || {
+                    for ((_, v), hash) in leaves.iter().zip(hashes.iter_mut()) {
+                        *hash = v.to_h256();
+                    }
+                });
+            }
+        });
+        self.update_sorted(leaves, hashes)
+    }
+
+    /// Delete all leaves under the branch at `height` on the path of `prefix`,
+    /// i.e. every key sharing the bits above `height` with `prefix`,
+    /// return new merkle root.
+    ///
+    /// Only the path above the subtree is recomputed. A store supporting
+    /// detached subtrees, e.g. `DetachStore`, detaches it in one step and
+    /// its nodes are removed later by `reclaim`, other stores remove them
+    /// at once.
+    pub fn delete_prefix(&mut self, height: u8, prefix: H256) -> Result<&H256> {
+        Self::check_key(&prefix)?;
+        if height > Self::ROOT_HEIGHT {
+            return Err(Error::HeightOutOfRange(height));
+        }
+        let node_key = prefix.parent_path(height);
+        let branch_key = BranchKey::new(height, node_key);
+        if self.store.get_branch(&branch_key)?.is_none() {
+            // already empty
+            return Ok(&self.root);
+        }
+        if !self.store.detach_branch(&branch_key)? {
+            remove_subtree(&mut self.store, &mut vec![(height, node_key)], usize::MAX)?;
+        }
+        if height == Self::ROOT_HEIGHT {
+            self.root = H256::zero();
+            return Ok(&self.root);
+        }
+        self.update_path(height + 1, node_key, MergeValue::zero(), 0)
+    }
+
+    /// Move all leaves of `other` into the empty subtree at `height` on the
+    /// path of `prefix`, return new merkle root.
+    ///
+    /// Every key of `other` must share the bits above `height` with `prefix`,
+    /// e.g. `other` is a shard built on its own. The nodes of the subtree are
+    /// transferred as they are, only the path above it is hashed again.
+    pub fn graft<S2: Store<V>>(
+        &mut self,
+        mut other: SparseMerkleTree<H, V, S2, DEPTH>,
+        height: u8,
+        prefix: H256,
+    ) -> Result<&H256> {
+        Self::check_key(&prefix)?;
+        if height > Self::ROOT_HEIGHT {
+            return Err(Error::HeightOutOfRange(height));
+        }
+        if other.is_empty() {
+            return Ok(&self.root);
+        }
+        let node_key = prefix.parent_path(height);
+        let top_key = BranchKey::new(height, node_key);
+        let top = other
+            .store
+            .get_branch(&top_key)?
+            .ok_or(Error::GraftOutOfRange)?;
+        let node = merge::<H>(height, &node_key, &top.left, &top.right);
+        // the rest of other must be a path of zeros from the subtree to the root
+        let mut current_node = node.clone();
+        if height < Self::ROOT_HEIGHT {
+            for h in height + 1..=Self::ROOT_HEIGHT {
+                let parent_key = node_key.parent_path(h);
+                current_node = if node_key.is_right(h) {
+                    merge::<H>(h, &parent_key, &MergeValue::zero(), &current_node)
+                } else {
+                    merge::<H>(h, &parent_key, &current_node, &MergeValue::zero())
+                };
+            }
+        }
+        if depth_root::<H>(DEPTH, &current_node) != other.root {
+            return Err(Error::GraftOutOfRange);
+        }
+
+        if self.store.get_branch(&top_key)?.is_some() {
+            return Err(Error::NonEmptySubtree(height, node_key));
+        }
+        move_subtree(&mut other.store, &mut self.store, height, node_key, false)?;
+
+        if height == Self::ROOT_HEIGHT {
+            self.root = other.root;
+            return Ok(&self.root);
+        }
+        let count = self.store.get_leaf_count(&top_key)?;
+        self.update_path(height + 1, node_key, node, count)
+    }
+
+    /// Move the subtree at `height` on the path of `prefix` into a new tree,
+    /// return the new tree.
+    ///
+    /// The new tree holds every key sharing the bits above `height` with
+    /// `prefix`, this tree keeps the others. The nodes of the subtree are
+    /// transferred as they are, only the paths above it are hashed again.
+    pub fn split(&mut self, height: u8, prefix: H256) -> Result<Self>
+    where
+        S: Default,
+    {
+        Self::check_key(&prefix)?;
+        if height > Self::ROOT_HEIGHT {
+            return Err(Error::HeightOutOfRange(height));
+        }
+        let mut tree = Self::new(H256::zero(), S::default());
+        let node_key = prefix.parent_path(height);
+        let top = match self.store.get_branch(&BranchKey::new(height, node_key))? {
+            Some(top) => top,
+            None => return Ok(tree),
+        };
+        move_subtree(&mut self.store, &mut tree.store, height, node_key, true)?;
+        if height == Self::ROOT_HEIGHT {
+            tree.root = core::mem::replace(&mut self.root, H256::zero());
+            return Ok(tree);
+        }
+        let node = merge::<H>(height, &node_key, &top.left, &top.right);
+        let count = tree
+            .store
+            .get_leaf_count(&BranchKey::new(height, node_key))?;
+        tree.update_path(height + 1, node_key, node, count)?;
+        self.update_path(height + 1, node_key, MergeValue::zero(), 0)?;
+        Ok(tree)
+    }
+
+    /// Remove at most `budget` branches of detached subtrees from the store,
+    /// along with their leaves, return true if nothing is left to reclaim
+    pub fn reclaim(&mut self, budget: usize) -> Result<bool> {
+        self.store.reclaim_detached(budget)
+    }
+
+    /// Return true if no detached subtree is left in the store
+    pub fn is_reclaimed(&self) -> bool {
+        !self.store.has_detached()
+    }
+
     /// Get value of a leaf
     /// return zero value if leaf not exists
     pub fn get(&self, key: &H256) -> Result<V> {
@@ -225,84 +499,364 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
         Ok(self.store.get_leaf(key)?.unwrap_or_else(V::zero))
     }
 
-    /// Generate merkle proof
-    pub fn merkle_proof(&self, mut keys: Vec<H256>) -> Result<MerkleProof> {
-        if keys.is_empty() {
-            return Err(Error::EmptyKeys);
+    /// Number of leaves with `lo <= key <= hi`, visits one path per bound.
+    /// The store must keep leaf counts, see `LeafCountStore`
+    pub fn count_range(&self, lo: &H256, hi: &H256) -> Result<u64> {
+        Self::check_key(lo)?;
+        Self::check_key(hi)?;
+        if !self.store.keeps_leaf_counts() {
+            return Err(Error::MissingLeafCounts);
+        }
+        if lo > hi {
+            return Ok(0);
+        }
+        Ok(self.rank(hi, true)? - self.rank(lo, false)?)
+    }
+
+    /// The key of the `index`-th leaf in key order, visits one path.
+    /// The store must keep leaf counts, see `LeafCountStore`
+    pub fn nth_key(&self, index: u64) -> Result<Option<H256>> {
+        if !self.store.keeps_leaf_counts() {
+            return Err(Error::MissingLeafCounts);
         }
+        let root_key = BranchKey::new(Self::ROOT_HEIGHT, H256::zero());
+        if self.is_empty() || index >= self.store.get_leaf_count(&root_key)? {
+            return Ok(None);
+        }
+        let mut index = index;
+        let mut node_key = H256::zero();
+        for height in (0..=Self::ROOT_HEIGHT).rev() {
+            let branch = self
+                .store
+                .get_branch(&BranchKey::new(height, node_key))?
+                .ok_or(Error::MissingBranch(height, node_key))?;
+            let left = child_leaf_count(&self.store, height, &node_key, &branch.left)?;
+            if index >= left {
+                index -= left;
+                node_key.set_bit(height);
+            }
+        }
+        Ok(Some(node_key))
+    }
 
-        // sort keys
-        keys.sort_unstable();
+    /// Number of leaves before `key`, and `key` itself if `inclusive`
+    fn rank(&self, key: &H256, inclusive: bool) -> Result<u64> {
+        let mut rank = 0;
+        if self.is_empty() {
+            return Ok(rank);
+        }
+        for height in (0..=Self::ROOT_HEIGHT).rev() {
+            let node_key = key.parent_path(height);
+            let branch = match self.store.get_branch(&BranchKey::new(height, node_key))? {
+                Some(branch) => branch,
+                None => break,
+            };
+            let is_right = key.is_right(height);
+            if is_right {
+                rank += child_leaf_count(&self.store, height, &node_key, &branch.left)?;
+            }
+            if height == 0 && inclusive {
+                let leaf = if is_right {
+                    &branch.right
+                } else {
+                    &branch.left
+                };
+                rank += !leaf.is_zero() as u64;
+            }
+        }
+        Ok(rank)
+    }
 
-        // Collect leaf bitmaps
-        let mut leaves_bitmap: Vec<H256> = Default::default();
-        for current_key in &keys {
-            let mut bitmap = H256::zero();
-            for height in 0..=core::u8::MAX {
-                let parent_key = current_key.parent_path(height);
-                let parent_branch_key = BranchKey::new(height, parent_key);
-                if let Some(parent_branch) = self.store.get_branch(&parent_branch_key)? {
-                    let sibling = if current_key.is_right(height) {
+    /// Run an incremental statistics pass, visiting at most `budget` branches
+    /// return true if the whole tree has been visited
+    pub fn collect_stats(&self, collector: &mut StatsCollector, budget: usize) -> Result<bool> {
+        collector.start(Self::ROOT_HEIGHT);
+        let mut visited = 0;
+        while visited < budget {
+            let (height, node_key, siblings) = match collector.pop() {
+                Some(item) => item,
+                None => break,
+            };
+            let branch_key = BranchKey::new(height, node_key);
+            if let Some(branch) = self.store.get_branch(&branch_key)? {
+                collector.visit(height, node_key, siblings, &branch);
+            }
+            visited += 1;
+        }
+        Ok(collector.is_finished())
+    }
+
+    /// Generate merkle proof
+    pub fn merkle_proof(&self, keys: Vec<H256>) -> Result<MerkleProof> {
+        self.merkle_proof_with(keys, |branch_key| self.store.get_branch(branch_key))
+    }
+
+    /// Generate merkle proof from the branches read by `get_branch`
+    pub(crate) fn merkle_proof_with<F>(&self, keys: Vec<H256>, get_branch: F) -> Result<MerkleProof>
+    where
+        F: Fn(&BranchKey) -> Result<Option<BranchNode>>,
+    {
+        merkle_proof_from_siblings(DEPTH, keys, |key| {
+            let mut siblings = Vec::new();
+            for height in 0..=Self::ROOT_HEIGHT {
+                let parent_branch_key = BranchKey::new(height, key.parent_path(height));
+                if let Some(parent_branch) = get_branch(&parent_branch_key)? {
+                    let sibling = if key.is_right(height) {
                         parent_branch.left
                     } else {
                         parent_branch.right
                     };
                     if !sibling.is_zero() {
-                        bitmap.set_bit(height);
+                        siblings.push((height, sibling));
                     }
                 } else {
                     // The key is not in the tree (support non-inclusion proof)
                 }
             }
-            leaves_bitmap.push(bitmap);
+            Ok(siblings)
+        })
+    }
+}
+
+/// Generate merkle proof of a tree with `depth` levels, `path_siblings`
+/// returns the non-zero siblings on the path of a key ordered by height
+pub(crate) fn merkle_proof_from_siblings<F>(
+    depth: usize,
+    mut keys: Vec<H256>,
+    mut path_siblings: F,
+) -> Result<MerkleProof>
+where
+    F: FnMut(&H256) -> Result<Vec<(u8, MergeValue)>>,
+{
+    if keys.is_empty() {
+        return Err(Error::EmptyKeys);
+    }
+
+    for key in &keys {
+        if !key.is_within_depth(depth) {
+            return Err(Error::KeyOutOfRange(*key));
+        }
+    }
+    // sort keys
+    keys.sort_unstable();
+    let root_height = (depth - 1) as u8;
+
+    // Collect leaf bitmaps
+    let mut leaves_bitmap: Vec<H256> = Default::default();
+    let mut leaves_siblings: Vec<Vec<(u8, MergeValue)>> = Default::default();
+    for current_key in &keys {
+        let siblings = path_siblings(current_key)?;
+        let mut bitmap = H256::zero();
+        for (height, _sibling) in &siblings {
+            bitmap.set_bit(*height);
+        }
+        leaves_bitmap.push(bitmap);
+        leaves_siblings.push(siblings);
+    }
+
+    let mut proof: Vec<MergeValue> = Default::default();
+    let mut stack_fork_height = [0u8; MAX_STACK_SIZE]; // store fork height
+    let mut stack_top = 0;
+    let mut leaf_index = 0;
+    while leaf_index < keys.len() {
+        let leaf_key = keys[leaf_index];
+        let fork_height = if leaf_index + 1 < keys.len() {
+            leaf_key.fork_height(&keys[leaf_index + 1])
+        } else {
+            root_height
+        };
+        let mut siblings = leaves_siblings[leaf_index].iter().peekable();
+        for height in 0..=fork_height {
+            if height == fork_height && leaf_index + 1 < keys.len() {
+                // If it's not final round, we don't need to merge to root (height=ROOT_HEIGHT)
+                break;
+            }
+            // siblings below the current height are in the proof or merged from the stack
+            while siblings.next_if(|(h, _)| *h < height).is_some() {}
+
+            // has non-zero sibling
+            if stack_top > 0 && stack_fork_height[stack_top - 1] == height {
+                stack_top -= 1;
+            } else if leaves_bitmap[leaf_index].get_bit(height) {
+                match siblings.next() {
+                    Some((h, sibling)) if *h == height => proof.push(sibling.clone()),
+                    _ => unreachable!(),
+                }
+            }
         }
+        debug_assert!(stack_top < MAX_STACK_SIZE);
+        stack_fork_height[stack_top] = fork_height;
+        stack_top += 1;
+        leaf_index += 1;
+    }
+    assert_eq!(stack_top, 1);
+    Ok(MerkleProof::new_with_depth(depth, leaves_bitmap, proof))
+}
 
-        let mut proof: Vec<MergeValue> = Default::default();
-        let mut stack_fork_height = [0u8; MAX_STACK_SIZE]; // store fork height
-        let mut stack_top = 0;
-        let mut leaf_index = 0;
-        while leaf_index < keys.len() {
-            let leaf_key = keys[leaf_index];
-            let fork_height = if leaf_index + 1 < keys.len() {
-                leaf_key.fork_height(&keys[leaf_index + 1])
+/// Remove at most `budget` branches of subtrees along with their leaves,
+/// `pending` holds the branches to remove and is refilled with their
+/// children. Return the number of branches taken from `pending`
+pub(crate) fn remove_subtree<V, S: Store<V>>(
+    store: &mut S,
+    pending: &mut Vec<(u8, H256)>,
+    budget: usize,
+) -> Result<usize> {
+    let mut removed = 0;
+    while removed < budget {
+        let (height, node_key) = match pending.pop() {
+            Some(item) => item,
+            None => break,
+        };
+        removed += 1;
+        let branch_key = BranchKey::new(height, node_key);
+        let branch = match store.get_branch(&branch_key)? {
+            Some(branch) => branch,
+            None => continue,
+        };
+        store.remove_branch(&branch_key)?;
+        let mut right_key = node_key;
+        right_key.set_bit(height);
+        for (child, child_key) in [(branch.left, node_key), (branch.right, right_key)].iter() {
+            if child.is_zero() {
+                continue;
+            }
+            if height == 0 {
+                store.remove_leaf(child_key)?;
             } else {
-                core::u8::MAX
-            };
-            for height in 0..=fork_height {
-                if height == fork_height && leaf_index + 1 < keys.len() {
-                    // If it's not final round, we don't need to merge to root (height=255)
-                    break;
+                pending.push((height - 1, *child_key));
+            }
+        }
+    }
+    Ok(removed)
+}
+
+/// Move the subtree at `height` on the path of `node_key` to another store,
+/// keep a copy in the source store unless `remove`
+fn move_subtree<V, S1: Store<V>, S2: Store<V>>(
+    from: &mut S1,
+    to: &mut S2,
+    height: u8,
+    node_key: H256,
+    remove: bool,
+) -> Result<()> {
+    let counting = to.keeps_leaf_counts();
+    // moved branches, parents before children
+    let mut moved = Vec::new();
+    let mut pending = vec![(height, node_key)];
+    while let Some((height, node_key)) = pending.pop() {
+        let branch_key = BranchKey::new(height, node_key);
+        let branch = from
+            .get_branch(&branch_key)?
+            .ok_or(Error::MissingBranch(height, node_key))?;
+        let mut right_key = node_key;
+        right_key.set_bit(height);
+        for (child, child_key) in [(&branch.left, node_key), (&branch.right, right_key)].iter() {
+            if child.is_zero() {
+                continue;
+            }
+            if height == 0 {
+                let leaf = from
+                    .get_leaf(child_key)?
+                    .ok_or(Error::MissingLeaf(*child_key))?;
+                if remove {
+                    from.remove_leaf(child_key)?;
                 }
-                let parent_key = leaf_key.parent_path(height);
-                let is_right = leaf_key.is_right(height);
-
-                // has non-zero sibling
-                if stack_top > 0 && stack_fork_height[stack_top - 1] == height {
-                    stack_top -= 1;
-                } else if leaves_bitmap[leaf_index].get_bit(height) {
-                    let parent_branch_key = BranchKey::new(height, parent_key);
-                    if let Some(parent_branch) = self.store.get_branch(&parent_branch_key)? {
-                        let sibling = if is_right {
-                            parent_branch.left
-                        } else {
-                            parent_branch.right
-                        };
-                        if !sibling.is_zero() {
-                            proof.push(sibling);
-                        } else {
-                            unreachable!();
-                        }
-                    } else {
-                        // The key is not in the tree (support non-inclusion proof)
-                    }
+                to.insert_leaf(*child_key, leaf)?;
+            } else {
+                pending.push((height - 1, *child_key));
+            }
+        }
+        if remove {
+            from.remove_branch(&branch_key)?;
+        }
+        to.insert_branch(branch_key, branch)?;
+        if counting {
+            moved.push((height, node_key));
+        }
+    }
+    insert_leaf_counts(to, moved)
+}
+
+/// Count the leaves of the subtree at `height` on the path of `node_key`,
+/// for a store keeping leaf counts filled without them
+pub(crate) fn rebuild_leaf_counts<V, S: Store<V>>(
+    store: &mut S,
+    height: u8,
+    node_key: H256,
+) -> Result<()> {
+    // branches of the subtree, parents before children
+    let mut branches = Vec::new();
+    let mut pending = vec![(height, node_key)];
+    while let Some((height, node_key)) = pending.pop() {
+        let branch = store
+            .get_branch(&BranchKey::new(height, node_key))?
+            .ok_or(Error::MissingBranch(height, node_key))?;
+        if height > 0 {
+            let mut right_key = node_key;
+            right_key.set_bit(height);
+            for (child, child_key) in [(&branch.left, node_key), (&branch.right, right_key)].iter()
+            {
+                if !child.is_zero() {
+                    pending.push((height - 1, *child_key));
                 }
             }
-            debug_assert!(stack_top < MAX_STACK_SIZE);
-            stack_fork_height[stack_top] = fork_height;
-            stack_top += 1;
-            leaf_index += 1;
         }
-        assert_eq!(stack_top, 1);
-        Ok(MerkleProof::new(leaves_bitmap, proof))
+        branches.push((height, node_key));
+    }
+    insert_leaf_counts(store, branches)
+}
+
+/// Count the leaves under `branches` from the bottom up, children must
+/// come after their parents
+fn insert_leaf_counts<V, S: Store<V>>(store: &mut S, branches: Vec<(u8, H256)>) -> Result<()> {
+    for (height, node_key) in branches.into_iter().rev() {
+        let branch_key = BranchKey::new(height, node_key);
+        let branch = store
+            .get_branch(&branch_key)?
+            .ok_or(Error::MissingBranch(height, node_key))?;
+        let mut right_key = node_key;
+        right_key.set_bit(height);
+        let count = child_leaf_count(store, height, &node_key, &branch.left)?
+            + child_leaf_count(store, height, &right_key, &branch.right)?;
+        store.insert_leaf_count(branch_key, count)?;
+    }
+    Ok(())
+}
+
+/// Number of leaves under a child of the branch at `height`,
+/// `child_key` is the path of the child
+fn child_leaf_count<V, S: Store<V>>(
+    store: &S,
+    height: u8,
+    child_key: &H256,
+    child: &MergeValue,
+) -> Result<u64> {
+    if child.is_zero() {
+        Ok(0)
+    } else if height == 0 {
+        Ok(1)
+    } else {
+        store.get_leaf_count(&BranchKey::new(
+            height - 1,
+            child_key.parent_path(height - 1),
+        ))
+    }
+}
+
+/// Number of leaves under the sibling of `key` in the branch at `height`
+fn sibling_leaf_count<V, S: Store<V>>(
+    store: &S,
+    height: u8,
+    key: &H256,
+    left: &MergeValue,
+    right: &MergeValue,
+) -> Result<u64> {
+    let mut sibling_key = *key;
+    if key.is_right(height) {
+        sibling_key.clear_bit(height);
+        child_leaf_count(store, height, &sibling_key, left)
+    } else {
+        sibling_key.set_bit(height);
+        child_leaf_count(store, height, &sibling_key, right)
     }
 }
@@ -0,0 +1,241 @@
+use crate::{
+    default_store::Map,
+    error::Error,
+    traits::{Store, Value, ValueCodec},
+    tree::{BranchKey, BranchNode},
+    vec::Vec,
+    H256,
+};
+use core::marker::PhantomData;
+
+// key and value length
+const RECORD_HEADER: usize = 32 + 4;
+
+/// Location of a value in the log, along with the leaf hash
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct LogPointer {
+    /// `to_h256` of the value
+    pub hash: H256,
+    /// offset of the record in the log
+    pub offset: u64,
+    /// length of the encoded value
+    pub len: u32,
+}
+
+impl LogPointer {
+    fn record_size(&self) -> u64 {
+        RECORD_HEADER as u64 + self.len as u64
+    }
+}
+
+/// An append-only log of values.
+///
+/// Records are `key | len (u32 LE) | value`, offsets are logical and keep
+/// growing, dropping records from the front never moves the others.
+/// Dropped bytes stay in the buffer until they are at least half of it,
+/// so the remaining records are moved once per doubling, not per drop.
+#[derive(Debug, Clone, Default)]
+pub struct ValueLog {
+    data: Vec<u8>,
+    // position of the oldest record in data
+    head: usize,
+    // logical offset of data[head]
+    start: u64,
+}
+
+impl ValueLog {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Logical offset of the oldest record
+    pub fn start(&self) -> u64 {
+        self.start
+    }
+
+    /// Logical offset the next record is appended at
+    pub fn end(&self) -> u64 {
+        self.start + self.size() as u64
+    }
+
+    /// Bytes held by the log
+    pub fn size(&self) -> usize {
+        self.data.len() - self.head
+    }
+
+    /// Append a record, return its offset
+    pub fn append(&mut self, key: &H256, value: &[u8]) -> u64 {
+        let offset = self.end();
+        self.data.extend_from_slice(key.as_slice());
+        self.data
+            .extend_from_slice(&(value.len() as u32).to_le_bytes());
+        self.data.extend_from_slice(value);
+        offset
+    }
+
+    /// Read the value of the record at offset
+    pub fn read(&self, offset: u64, len: u32) -> Option<&[u8]> {
+        let begin = self.head + offset.checked_sub(self.start)? as usize + RECORD_HEADER;
+        self.data.get(begin..begin + len as usize)
+    }
+
+    /// Return key and value of the record at offset
+    fn record(&self, offset: u64) -> Option<(H256, &[u8])> {
+        let begin = self.head + offset.checked_sub(self.start)? as usize;
+        let header = self.data.get(begin..begin + RECORD_HEADER)?;
+        let mut key = [0u8; 32];
+        key.copy_from_slice(&header[..32]);
+        let mut len = [0u8; 4];
+        len.copy_from_slice(&header[32..]);
+        let value_begin = begin + RECORD_HEADER;
+        let value = self
+            .data
+            .get(value_begin..value_begin + u32::from_le_bytes(len) as usize)?;
+        Some((key.into(), value))
+    }
+
+    /// Drop records before offset
+    fn truncate_front(&mut self, offset: u64) {
+        self.head += (offset - self.start) as usize;
+        self.start = offset;
+        if self.head * 2 >= self.data.len() {
+            self.data.drain(..self.head);
+            self.head = 0;
+        }
+    }
+}
+
+/// A memory store keeps leaf values out of the index.
+///
+/// Values are appended to a `ValueLog`, the leaf index only holds a
+/// `LogPointer` with the leaf hash, so the index stays small with large
+/// values. Overwritten and removed values are garbage in the log until
+/// `gc_step` reclaims them.
+#[derive(Debug, Clone)]
+pub struct ValueLogStore<V> {
+    branches_map: Map<BranchKey, BranchNode>,
+    index: Map<H256, LogPointer>,
+    log: ValueLog,
+    // bytes of records referenced by the index
+    live_bytes: u64,
+    buf: Vec<u8>,
+    phantom: PhantomData<V>,
+}
+
+impl<V> Default for ValueLogStore<V> {
+    fn default() -> Self {
+        ValueLogStore {
+            branches_map: Map::default(),
+            index: Map::default(),
+            log: ValueLog::default(),
+            live_bytes: 0,
+            buf: Vec::new(),
+            phantom: PhantomData,
+        }
+    }
+}
+
+impl<V> ValueLogStore<V> {
+    pub fn branches_map(&self) -> &Map<BranchKey, BranchNode> {
+        &self.branches_map
+    }
+    pub fn index(&self) -> &Map<H256, LogPointer> {
+        &self.index
+    }
+    pub fn log(&self) -> &ValueLog {
+        &self.log
+    }
+
+    /// Leaf hash of a key, read from the index only
+    pub fn get_leaf_hash(&self, leaf_key: &H256) -> Option<H256> {
+        self.index.get(leaf_key).map(|pointer| pointer.hash)
+    }
+
+    /// Bytes of the log no longer referenced by the index
+    pub fn garbage_bytes(&self) -> u64 {
+        self.log.size() as u64 - self.live_bytes
+    }
+
+    /// Reclaim garbage from the front of the log, scanning about `budget`
+    /// bytes: live records are moved to the end, the scanned range is
+    /// dropped. Return the number of bytes reclaimed.
+    pub fn gc_step(&mut self, budget: usize) -> usize {
+        let start = self.log.start();
+        let end = self.log.end();
+        let mut offset = start;
+        let mut relocated = 0;
+        while offset < end && ((offset - start) as usize) < budget {
+            let (key, size, live) = match self.log.record(offset) {
+                Some((key, value)) => {
+                    let size = (RECORD_HEADER + value.len()) as u64;
+                    let live = self.index.get(&key).map(|p| p.offset) == Some(offset);
+                    if live {
+                        self.buf.clear();
+                        self.buf.extend_from_slice(value);
+                    }
+                    (key, size, live)
+                }
+                None => break,
+            };
+            if live {
+                let new_offset = self.log.append(&key, &self.buf);
+                if let Some(pointer) = self.index.get_mut(&key) {
+                    pointer.offset = new_offset;
+                }
+                relocated += size;
+            }
+            offset += size;
+        }
+        self.log.truncate_front(offset);
+        (offset - start - relocated) as usize
+    }
+}
+
+impl<V: Value + ValueCodec> Store<V> for ValueLogStore<V> {
+    fn get_branch(&self, branch_key: &BranchKey) -> Result<Option<BranchNode>, Error> {
+        Ok(self.branches_map.get(branch_key).map(Clone::clone))
+    }
+    fn get_leaf(&self, leaf_key: &H256) -> Result<Option<V>, Error> {
+        let pointer = match self.index.get(leaf_key) {
+            Some(pointer) => pointer,
+            None => return Ok(None),
+        };
+        self.log
+            .read(pointer.offset, pointer.len)
+            .and_then(V::decode)
+            .map(Some)
+            .ok_or_else(|| Error::Store("corrupted value log record".into()))
+    }
+    fn insert_branch(&mut self, branch_key: BranchKey, branch: BranchNode) -> Result<(), Error> {
+        self.branches_map.insert(branch_key, branch);
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_key: H256, leaf: V) -> Result<(), Error> {
+        let hash = leaf.to_h256();
+        self.insert_leaf_with_hash(leaf_key, leaf, hash)
+    }
+    fn insert_leaf_with_hash(&mut self, leaf_key: H256, leaf: V, hash: H256) -> Result<(), Error> {
+        self.buf.clear();
+        leaf.encode(&mut self.buf);
+        let pointer = LogPointer {
+            hash,
+            offset: self.log.append(&leaf_key, &self.buf),
+            len: self.buf.len() as u32,
+        };
+        self.live_bytes += pointer.record_size();
+        if let Some(old) = self.index.insert(leaf_key, pointer) {
+            self.live_bytes -= old.record_size();
+        }
+        Ok(())
+    }
+    fn remove_branch(&mut self, branch_key: &BranchKey) -> Result<(), Error> {
+        self.branches_map.remove(branch_key);
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_key: &H256) -> Result<(), Error> {
+        if let Some(old) = self.index.remove(leaf_key) {
+            self.live_bytes -= old.record_size();
+        }
+        Ok(())
+    }
+}